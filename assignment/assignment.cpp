@@ -1,7 +1,20 @@
 #include <iostream>
 #include <vector>
+#include <fstream>
 
 #include "Utils.h"
+#include "Variants.h"
+#include "Matching.h"
+#include "Stream.h"
+#include "PointOps.h"
+#include "Stats.h"
+#include "ResultCache.h"
+#include "BufferPool.h"
+#include "DeviceArena.h"
+#include "TaskGraph.h"
+#include "ChannelPipeline.h"
+#include "HostPipeline.h"
+#include "Service.h"
 #include "CImg.h"
 
 using namespace cimg_library;
@@ -35,31 +48,141 @@ using namespace std;
 void print_help() {
 	std::cerr << "Application usage:" << std::endl;
 
-	std::cerr << "  -p : select platform " << std::endl;
-	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -p : select platform, overriding the automatic device selection" << std::endl;
+	std::cerr << "  -d : select device, overriding the automatic device selection" << std::endl;
+	std::cerr << "  -A : re-run the device selection benchmark instead of using this host's cached ranking" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -r : write a profiling report to file (.json or .csv)" << std::endl;
+	std::cerr << "  -t : write a Chrome trace of host and device activity to file" << std::endl;
+	std::cerr << "  -o : save the output image to file" << std::endl;
+	std::cerr << "  -m : match the histogram of a reference image instead of equalising" << std::endl;
+	std::cerr << "  -b : equalise every image listed in a file (one path per line) in batches, -o is then the output directory" << std::endl;
+	std::cerr << "  -j : with -b, decode and encode on this many threads each, overlapping file I/O with device work (default: 0, serial)" << std::endl;
+	std::cerr << "  -C : with -b, cache the LUTs of up to this many MB of results by image content so repeated images skip straight to the apply stage" << std::endl;
+	std::cerr << "  -Y : with -C, cache whole output images too so repeated images skip the device entirely" << std::endl;
+	std::cerr << "  -S : run as a service equalising images sent over this UNIX domain socket, or placed in a client's shared-memory ring, until asked to shut down" << std::endl;
+	std::cerr << "  -w : with -S, milliseconds to wait for more requests to batch with the first (default: 2)" << std::endl;
+	std::cerr << "  -v : equalise a frame sequence (numbered PGM/PPM pattern such as frames/%04d.pgm, or a .y4m file), -o is then the output pattern or .y4m file" << std::endl;
+	std::cerr << "  -e : weight of each new frame's CDF when smoothing a sequence, 1 disables smoothing (default: 0.25)" << std::endl;
+	std::cerr << "  -i : keep per-tile histograms on the device while streaming and only recount tiles that changed" << std::endl;
+	std::cerr << "  -s : build the histograms from a stratified sample of this fraction of the pixels, e.g. 0.05 (default: 1, exact)" << std::endl;
+	std::cerr << "  -q : point operations folded into the output LUT, e.g. gamma=0.8,contrast=1.2,brightness=-10,threshold=128,invert" << std::endl;
+	std::cerr << "  -n : skip equalisation and only apply the -q point operations" << std::endl;
+	std::cerr << "  -x : linear stretch from each channel's min/max instead of equalising, prints min/max/mean/variance" << std::endl;
+	std::cerr << "  -X : percentile stretch clipping at the given low,high percentiles of each channel, e.g. 0.5,99.5" << std::endl;
+	std::cerr << "  -O : Otsu thresholds of each channel with 1 or 2 levels, output is the image segmented at them" << std::endl;
+	std::cerr << "  -c : with -O only compute and print the thresholds, the output is the unchanged input" << std::endl;
+	std::cerr << "  -g : run the channels of a colour image concurrently, on an out-of-order queue or one queue per channel" << std::endl;
+	std::cerr << "  -z : build the colour kernels specialised to the image (channel, plane size, scale as -D constants), one cached program per specialisation" << std::endl;
+	std::cerr << "  -k : kernel variants for the greyscale stages, e.g. histogram=histogram_local:256:16:4,apply=lut_multi" << std::endl;
+	std::cerr << "  -a : autotune the kernel variants on this device and save the result" << std::endl;
+	std::cerr << "  -u : tuning file (default: tuning.txt)" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
-void perform_colour_op(CImg<unsigned char>, int, int);
-void perform_greyscale_op(CImg<unsigned char>, int, int);
+// Source of every kernel the application runs
+const string KERNEL_FILE = "kernels/assign_kernels.cl";
 
-int main(int argc, char **argv) {
-	//Part 1 - handle command line options such as device selection, verbosity, etc.
-	// Define platform and device ID's as defaults incase no arguements are passed through
+// Settings taken from the command line that the image operations need
+struct Options {
 	int platform_id = 0;
 	int device_id = 0;
+	bool autoDevice = true; // rank the devices by benchmark unless -p or -d picks one
+	bool remeasureDevices = false; // ignore the cached device ranking
+	string deviceRankingFilename = "devices.txt";
+	string variantConfig; // explicit kernel variant choices, override the tuned configuration
+	bool autotune = false;
+	string tuningFilename = "tuning.txt";
+	string referenceFilename; // reference image for histogram matching, empty to equalise
+	float streamAlpha = 0.25f; // weight of the newest frame in the smoothed CDF of a sequence
+	bool incremental = false; // update the histogram of a sequence from changed tiles only
+	float sampleRate = 1.0f; // fraction of pixels counted in the histograms, 1 for an exact histogram
+	PointPipeline pointOps; // point operations applied after equalisation/matching in the same LUT pass
+	bool pointOnly = false; // apply the point operations without equalising
+	bool stretch = false; // linear min/max stretch instead of equalisation
+	float lowPercentile = 0.0f, highPercentile = 0.0f; // percentile stretch bounds, both 0 to equalise
+	size_t cacheBytes = 0; // result cache memory bound for batches, 0 disables the cache
+	bool cacheOutputs = false; // keep whole outputs in the result cache, not just LUTs
+	int hostThreads = 0; // decode and encode threads for batches, 0 to do both on the device thread
+	float batchWindow = 2.0f; // service batching window [ms]
+	int otsuLevels = 0; // number of Otsu thresholds per channel, 0 to equalise
+	bool thresholdsOnly = false; // compute Otsu thresholds without segmenting the image
+	bool concurrentChannels = false; // overlap the per-channel stages of colour images
+	bool specialise = false; // build the colour kernels with the image's constants compiled in
+};
+
+CImg<unsigned char> perform_colour_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_colour_concurrent_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_greyscale_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_match_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_point_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_stretch_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_otsu_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+CImg<unsigned char> perform_percentile_op(CImg<unsigned char>, const Options&, ProfilingReport&);
+void run_batch(const string&, const string&, const Options&, ProfilingReport&);
+void run_stream(const string&, const string&, const Options&, ProfilingReport&);
+void run_service(const string&, const Options&, ProfilingReport&);
+void save_profiling(ProfilingReport&, const string&, const string&);
+void select_device(Options&, const vector<size_t>&);
+
+int main(int argc, char **argv) {
+	//Part 1 - handle command line options such as device selection, verbosity, etc.
+	// Platform and device ID's default to 0 incase no arguements are passed through
+	Options options;
 
 	// Load in our initial reference file
 	string inputImgFilename = "test.pgm";
+	// Profiling report and trace files, left empty to only print the report to the console
+	string reportFilename, traceFilename;
+	// Output image file, left empty to only display the result
+	string outputImgFilename;
+	// List of small images to process in batches instead of the single input image
+	string batchFilename;
+	// Frame sequence to stream instead of the single input image
+	string streamFilename;
+	// UNIX domain socket to serve requests on instead of processing the input image
+	string socketPath;
+	// Point operation chain, parsed once the options have been read
+	string pointOpsText;
 
 	// Handle command line arguements
 	for (int i = 1; i < argc; i++) {
-		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
-		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { options.platform_id = atoi(argv[++i]); options.autoDevice = false; }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { options.device_id = atoi(argv[++i]); options.autoDevice = false; }
+		else if (strcmp(argv[i], "-A") == 0) { options.remeasureDevices = true; }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { inputImgFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reportFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { traceFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { outputImgFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { options.referenceFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { batchFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-C") == 0) && (i < (argc - 1))) { options.cacheBytes = (size_t)(atof(argv[++i]) * 1024 * 1024); }
+		else if (strcmp(argv[i], "-Y") == 0) { options.cacheOutputs = true; }
+		else if (strcmp(argv[i], "-g") == 0) { options.concurrentChannels = true; }
+		else if (strcmp(argv[i], "-z") == 0) { options.specialise = true; }
+		else if ((strcmp(argv[i], "-S") == 0) && (i < (argc - 1))) { socketPath = argv[++i]; }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { options.batchWindow = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1))) { options.hostThreads = max(0, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) { streamFilename = argv[++i]; }
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { options.streamAlpha = (float)atof(argv[++i]); }
+		else if (strcmp(argv[i], "-i") == 0) { options.incremental = true; }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { options.sampleRate = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-q") == 0) && (i < (argc - 1))) { pointOpsText = argv[++i]; }
+		else if (strcmp(argv[i], "-n") == 0) { options.pointOnly = true; }
+		else if (strcmp(argv[i], "-x") == 0) { options.stretch = true; }
+		else if ((strcmp(argv[i], "-X") == 0) && (i < (argc - 1))) {
+			if (sscanf(argv[++i], "%f,%f", &options.lowPercentile, &options.highPercentile) != 2 || options.lowPercentile >= options.highPercentile) {
+				std::cerr << "ERROR: -X expects low,high percentiles such as 0.5,99.5" << std::endl;
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "-O") == 0) && (i < (argc - 1))) { options.otsuLevels = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-c") == 0) { options.thresholdsOnly = true; }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { options.variantConfig = argv[++i]; }
+		else if (strcmp(argv[i], "-a") == 0) { options.autotune = true; }
+		else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { options.tuningFilename = argv[++i]; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
@@ -68,22 +191,98 @@ int main(int argc, char **argv) {
 
 	//detect any potential exceptions
 	try {
+		// Collects the event of every command enqueued by the selected operation
+		ProfilingReport profiler;
+		options.pointOps = ParsePointPipeline(pointOpsText);
+
+		// Typical image sizes [pixels] weighting the device choice when the images are not known up front
+		const vector<size_t> TYPICAL_JOBS = { 512 * 512, 1024 * 1024, 2048 * 2048 * 3 };
+
+		// Batch mode processes the whole list without displaying anything
+		if (!batchFilename.empty()) {
+			select_device(options, TYPICAL_JOBS);
+			run_batch(batchFilename, outputImgFilename, options, profiler);
+			save_profiling(profiler, reportFilename, traceFilename);
+			return 0;
+		}
+		// As does streaming a frame sequence
+		if (!streamFilename.empty()) {
+			select_device(options, TYPICAL_JOBS);
+			run_stream(streamFilename, outputImgFilename, options, profiler);
+			save_profiling(profiler, reportFilename, traceFilename);
+			return 0;
+		}
+		// And serving requests until asked to shut down
+		if (!socketPath.empty()) {
+			select_device(options, TYPICAL_JOBS);
+			run_service(socketPath, options, profiler);
+			return 0;
+		}
+
 		// Returns a pointer to a image location from its filename
+		long long decodeStart = GetHostTime();
 		CImg<unsigned char> inputImgPtr(inputImgFilename.c_str());
+		profiler.AddHostSpan("image decode", decodeStart, GetHostTime());
 		bool IS_COLOUR = inputImgPtr.spectrum() == 3;
+		select_device(options, { inputImgPtr.size() });
 
 		// Report image width, height, and pixel count
 		cout << "==============================\n" << "Results for " << inputImgFilename << "\n==============================" << endl;
 		cout << "[INFO] Image Width: " << inputImgPtr.width() << ", Height: " << inputImgPtr.height() << ", Pixel Count: " << inputImgPtr.height() * inputImgPtr.width() << endl;
 		cout << "[INFO] Image is ";
 
-		if (IS_COLOUR) {
+		CImg<unsigned char> outputImg;
+		if (options.pointOnly) {
+			cout << (IS_COLOUR ? "colour" : "greyscale") << ", applying " << options.pointOps.ToString() << "." << endl;
+			outputImg = perform_point_op(inputImgPtr, options, profiler);
+		}
+		else if (options.otsuLevels > 0) {
+			cout << (IS_COLOUR ? "colour" : "greyscale") << ", " << options.otsuLevels << " level Otsu threshold." << endl;
+			outputImg = perform_otsu_op(inputImgPtr, options, profiler);
+		}
+		else if (options.highPercentile > 0.0f) {
+			cout << (IS_COLOUR ? "colour" : "greyscale") << ", stretching between the " << options.lowPercentile << " and " << options.highPercentile << " percentiles." << endl;
+			outputImg = perform_percentile_op(inputImgPtr, options, profiler);
+		}
+		else if (options.stretch) {
+			cout << (IS_COLOUR ? "colour" : "greyscale") << ", stretching to the full range." << endl;
+			outputImg = perform_stretch_op(inputImgPtr, options, profiler);
+		}
+		else if (!options.referenceFilename.empty()) {
+			cout << (IS_COLOUR ? "colour" : "greyscale") << ", matching to " << options.referenceFilename << "." << endl;
+			outputImg = perform_match_op(inputImgPtr, options, profiler);
+		}
+		else if (IS_COLOUR && options.concurrentChannels) {
+			cout << "colour (Spectrum value of 3), channels run concurrently." << endl;
+			outputImg = perform_colour_concurrent_op(inputImgPtr, options, profiler);
+		}
+		else if (IS_COLOUR) {
 			cout << "colour (Spectrum value of 3)." << endl;
-			perform_colour_op(inputImgPtr, platform_id, device_id);
+			outputImg = perform_colour_op(inputImgPtr, options, profiler);
 		}
 		else {
 			cout << "greyscale (Spectrum value of 1)." << endl;
-			perform_greyscale_op(inputImgPtr, platform_id, device_id);
+			outputImg = perform_greyscale_op(inputImgPtr, options, profiler);
+		}
+
+		// Report memory transfer and kernel execution times for every command
+		cout << profiler.Summary(ProfilingResolution::PROF_NS) << endl;
+		// Save the output image before the report so the encode shows up on the timeline
+		if (!outputImgFilename.empty()) {
+			ScopedHostSpan span(profiler, "output encode");
+			outputImg.save(outputImgFilename.c_str());
+		}
+
+		save_profiling(profiler, reportFilename, traceFilename);
+
+		// Display comparison between input & output
+		string title = IS_COLOUR ? "[COLOUR]" : "[GREY]";
+		CImgDisplay inputImgDisp(inputImgPtr, (title + " Input Image - IMP15591119").c_str());
+		CImgDisplay outputImgDisp(outputImg, (title + " Output Image - IMP15591119").c_str());
+
+		while (!inputImgDisp.is_closed() && !outputImgDisp.is_closed() && !inputImgDisp.is_keyESC() && !outputImgDisp.is_keyESC()) {
+			inputImgDisp.wait(1);
+			inputImgDisp.wait(1);
 		}
 	}
 	catch (const cl::Error& err) {
@@ -94,63 +293,234 @@ int main(int argc, char **argv) {
 		// Handle any CImg related exceptions that occur during build/runtime
 		std::cerr << "ERROR: " << err.what() << std::endl;
 	}
+	catch (const exception& err) {
+		// Handle invalid options such as an unknown kernel variant
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
 
 	// Return 0 to terminate the application
 	return 0;
 }
 
-// Performs contrast adjustment for a colour image
-void perform_colour_op(CImg<unsigned char> inputImgPtr, int platform_id, int device_id) {
-	// Select platform and device to use to create a context from
-	cl::Context context = GetContext(platform_id, device_id);
+// Writes the profiling report and Chrome trace when their files were requested
+void save_profiling(ProfilingReport& profiler, const string& reportFilename, const string& traceFilename) {
+	if (!reportFilename.empty()) {
+		profiler.Save(reportFilename);
+		cout << "[INFO] Profiling report written to " << reportFilename << endl;
+	}
+	if (!traceFilename.empty()) {
+		profiler.SaveChromeTrace(traceFilename);
+		cout << "[INFO] Chrome trace written to " << traceFilename << endl;
+	}
+}
+
+// Chooses the platform and device automatically for jobs of the given sizes [pixels], unless -p or -d did
+void select_device(Options& options, const vector<size_t>& jobSizes) {
+	if (!options.autoDevice)
+		return;
+	const DeviceInfo& info = SelectDevice(jobSizes, options.deviceRankingFilename, KERNEL_FILE, options.remeasureDevices, cout);
+	options.platform_id = info.platform_id;
+	options.device_id = info.device_id;
+}
+
+// Device objects shared by every image operation
+struct DeviceSetup {
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue queue;
+	cl::Program program;
+	BufferPool pool; // buffers recycled between the images of a batch
+};
+
+// Creates a context and profiling queue on the selected device and builds the assignment kernels
+DeviceSetup setup_device(const Options& options, ProfilingReport& profiler) {
+	DeviceSetup setup;
+
+	// Select platform and device to use, the registry enumerates them once and reuses their context
+	long long setupStart = GetHostTime();
+	DeviceRegistry& registry = DeviceRegistry::Get();
+	const DeviceInfo& info = registry.Info(options.platform_id, options.device_id);
+	setup.device = info.device;
+	setup.context = registry.Context(setup.device);
 
 	// Display the selected device
-	cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << endl;
+	cout << "Running on " << info.platformName << ", " << info.name << endl;
 
-	// Create a queue to which we will push commands for the device & enable profiling
-	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	// The device's profiling queue, shared with earlier operations in this process
+	setup.queue = registry.Queue(setup.device, CL_QUEUE_PROFILING_ENABLE);
+	profiler.AddHostSpan("context setup", setupStart, GetHostTime());
+	// Align this queue's device clock with the host clock for the trace
+	profiler.Calibrate(setup.queue);
 
-	// Create program source object to reference kernel files
-	cl::Program::Sources sources;
-	AddSources(sources, "kernels/assign_kernels.cl");
+	setup.pool = BufferPool(setup.context);
 
-	// Create a program to combine context and kernels
-	cl::Program program(context, sources);
+	// Build the OpenCL Program, or reuse it when this process has built it before. Build errors print
+	// the build log and are rethrown.
+	{
+		ScopedHostSpan span(profiler, "program build");
+		setup.program = ProgramCache::Get().Build(setup.context, setup.device, KERNEL_FILE);
+	}
 
-	// Attempt to build the OpenCL Program and catch any errors that occur during build
-	try {
-		program.build();
+	return setup;
+}
+
+// Build options fixing what histogram_rgb, lut_rgb and norm_bins otherwise read from buffers or work out
+// per work-item: the channel counted, the pixels in each channel plane and, unless it is 0, the scale
+string get_specialisation(int channel, int planeSize, float scale) {
+	string options = DefineOption("CHANNEL", to_string(channel)) + " " + DefineOption("IMAGE_SIZE", to_string(planeSize));
+	if (scale > 0.0f)
+		options += " " + DefineOption("SCALE", FloatLiteral(scale));
+	return options;
+}
+
+// Builds (or takes from the program cache) one program per channel specialised for the image when -z is
+// given, otherwise returns the generic program for every channel
+vector<cl::Program> get_channel_programs(DeviceSetup& setup, const Options& options, int planeSize, float scale, ProfilingReport& profiler) {
+	vector<cl::Program> programs(3, setup.program);
+	if (options.specialise) {
+		ScopedHostSpan span(profiler, "specialised program builds");
+		for (int c = 0; c < 3; c++)
+			programs[c] = ProgramCache::Get().Build(setup.context, setup.device, KERNEL_FILE, get_specialisation(c, planeSize, scale));
 	}
-	catch (const cl::Error& err) {
-		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-		// Throw error and exit
-		throw err;
-		return;
+	return programs;
+}
+
+// Enqueues lut (greyscale) or lut_rgb (colour) to apply one LUT per channel, a single LUT is used for every channel
+void enqueue_lut_apply(cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& input, const cl::Buffer& output, size_t size, const vector<cl::Buffer>& luts, int spectrum, cl::Event* event) {
+	cl::Kernel kernelLut;
+	if (spectrum == 1) {
+		kernelLut = cl::Kernel(program, "lut");
+		kernelLut.setArg(0, input);
+		kernelLut.setArg(1, output);
+		kernelLut.setArg(2, luts[0]);
+	}
+	else {
+		kernelLut = cl::Kernel(program, "lut_rgb");
+		kernelLut.setArg(0, input);
+		kernelLut.setArg(1, output);
+		for (int c = 0; c < 3; c++)
+			kernelLut.setArg(2 + c, luts[luts.size() == 1 ? 0 : c]);
+	}
+	queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, cl::NDRange(size), cl::NullRange, NULL, event);
+}
+
+// Returns the distance between samples for a sampling rate, 1 counts every pixel
+int get_sample_stride(float rate) {
+	if (rate >= 1.0f || rate <= 0.0f)
+		return 1;
+	return max(1, (int)(1.0f / rate + 0.5f));
+}
+
+// Enqueues histogram_sampled over the N pixels starting at offset and returns the number of samples it counts
+int enqueue_sampled_histogram(cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& image, const cl::Buffer& hist, int offset, int N, int stride, cl::Event* event, const vector<cl::Event>* wait = NULL) {
+	const size_t LOCAL_SIZE = 256;
+	int samples = (N + stride - 1) / stride;
+
+	cl::Kernel kernelSampled = SampledHistogramKernel(program, image, hist, offset, N, stride);
+	queue.enqueueNDRangeKernel(kernelSampled, cl::NullRange, cl::NDRange(RoundUp(samples, LOCAL_SIZE)), cl::NDRange(LOCAL_SIZE), wait, event);
+	return samples;
+}
+
+// Compares a sampled histogram and the LUT built from it with the exact ones, computed on the host, and
+// prints the L1 distance between the normalised histograms (0 to 2) and how far the LUT outputs move
+void report_sampling_accuracy(const CImg<unsigned char>& image, int channel, const vector<int>& sampledHist, int samples, const vector<int>& sampledLut, ProfilingReport& profiler) {
+	ScopedHostSpan span(profiler, "sampling accuracy check");
+	int pixels = image.width() * image.height() * image.depth();
+	const unsigned char* data = image.data(0, 0, 0, channel);
+
+	vector<int> exactHist(256, 0);
+	for (int i = 0; i < pixels; i++)
+		exactHist[data[i]]++;
+
+	// Same normalisation as norm_bins
+	float scale = (float)255 / (float)pixels;
+	double l1 = 0.0, meanDiff = 0.0;
+	int maxDiff = 0, cumulative = 0;
+	for (int bin = 0; bin < 256; bin++) {
+		l1 += fabs((double)exactHist[bin] / pixels - (double)sampledHist[bin] / samples);
+		cumulative += exactHist[bin];
+		int diff = abs((int)(cumulative * scale) - sampledLut[bin]);
+		// Only values present in the image affect the output
+		if (exactHist[bin] > 0)
+			maxDiff = max(maxDiff, diff);
+		meanDiff += (double)diff * exactHist[bin] / pixels;
 	}
 
-	// Get info about the device we're operating on
-	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cout << "[Sampling] Channel " << channel << ": " << samples << " of " << pixels << " pixels, histogram L1 error " << l1
+		<< ", LUT max difference " << maxDiff << ", mean output difference " << meanDiff << endl;
+}
+
+// Returns the kernel variant for each greyscale stage: the tuned configuration for this device (re-tuned
+// first when requested), with any stages given explicitly on the command line taking priority
+VariantConfig get_variant_config(const VariantRegistry& registry, const Options& options, const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, const CImg<unsigned char>& inputImg) {
+	// Tuning results are stored per device and driver, as drivers change kernel performance as much as hardware does
+	string deviceKey = DeviceRegistry::Get().Info(options.platform_id, options.device_id).Key();
+	VariantConfig config = registry.DefaultConfig();
+
+	if (options.autotune) {
+		config = AutotuneVariants(registry, context, queue, program, inputImg.get_channel(0));
+		SaveTunedConfig(options.tuningFilename, deviceKey, config);
+		cout << "[INFO] Tuned configuration saved to " << options.tuningFilename << endl;
+	}
+	else if (LoadTunedConfig(registry, options.tuningFilename, deviceKey, config)) {
+		cout << "[INFO] Using tuned configuration from " << options.tuningFilename << endl;
+	}
+
+	config = ParseVariantConfig(registry, options.variantConfig, config);
+	cout << "[INFO] Kernel variants: " << FormatVariantConfig(config) << endl;
+	return config;
+}
+
+// Performs contrast adjustment for a colour image
+CImg<unsigned char> perform_colour_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+	cl::Device& device = setup.device;
 
 	const int BIN_SIZE = 256; // Hard-coded bin size of 256
 	const size_t HIST_SIZE = BIN_SIZE * sizeof(int); // Hard-coded bin size
-	cl::Event inputProf, outputProf; // Create generic CL Events for profiling
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
 
 
 	/* PART 1 - Histogram Generation [COLOUR] */
 	std::vector<int> rHistBin(BIN_SIZE), gHistBin(BIN_SIZE), bHistBin(BIN_SIZE); // Create a histogram for RGB individually
 
+	// Carve every buffer out of one device allocation: the histograms, LUTs and scalars first, then the
+	// image buffers while the arena still fits in a single allocation
+	DeviceArena arena(context, device);
+	int histRegion = arena.Reserve(HIST_SIZE);
+	int cumHistRegion = arena.Reserve(HIST_SIZE);
+	int normHistRegion = arena.Reserve(HIST_SIZE);
+	int rOutRegion = arena.Reserve(HIST_SIZE), gOutRegion = arena.Reserve(HIST_SIZE), bOutRegion = arena.Reserve(HIST_SIZE);
+	int channelRegion = arena.Reserve(sizeof(int));
+	int pixelCountRegion = arena.Reserve(sizeof(float));
+	int inputRegion = arena.Fits(inputImgPtr.size()) ? arena.Reserve(inputImgPtr.size()) : -1;
+	int outputRegion = arena.Fits(inputImgPtr.size()) ? arena.Reserve(inputImgPtr.size()) : -1;
+	arena.Create();
+
 	// Create our initial buffers for usage in OpenCL Kernels
-	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size()); // Create a read-only buffer with a size of our input image
-	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);  // Create a read-write buffer with the size of our histogram bin (bin_size * size(int))
-	cl::Buffer channelBuffer(context, CL_MEM_READ_ONLY, sizeof(int)); // Create buffer to store current channel
+	cl::Buffer inputImgBuffer = inputRegion >= 0 ? arena.Get(inputRegion) : cl::Buffer(context, CL_MEM_READ_ONLY, inputImgPtr.size()); // Buffer with the size of our input image
+	cl::Buffer& histBuffer = arena.Get(histRegion);  // Buffer with the size of our histogram bin (bin_size * size(int))
+	cl::Buffer& channelBuffer = arena.Get(channelRegion); // Buffer to store current channel
 
 	// Write image input data to our device's memory via our image input buffer
-	queue.enqueueWriteBuffer(inputImgBuffer, CL_TRUE, 0, inputImgPtr.size(), &inputImgPtr.data()[0], NULL, &inputProf);
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_TRUE, 0, inputImgPtr.size(), &inputImgPtr.data()[0], NULL, &prof);
+	profiler.Add("Part 1 image write", prof, inputImgPtr.size());
+
+	// Pixels counted into each channel's histogram, fewer than the plane size when sampling
+	int planeSize = inputImgPtr.width() * inputImgPtr.height();
+	int sampleStride = get_sample_stride(options.sampleRate);
+	int histPixels = planeSize;
+
+	// With -z every channel has its own program with the channel, plane size and (unless sampling) scale built in
+	bool scaleFixed = options.specialise && sampleStride == 1;
+	vector<cl::Program> channelPrograms = get_channel_programs(setup, options, planeSize, scaleFixed ? (float)255 / (float)planeSize : 0.0f, profiler);
 
 	// Load Histogram RGB Kernel
-	cl::Kernel kernelHist = cl::Kernel(program, "histogram_rgb"); // Load the histogram kernel defined in my_kernels
+	cl::Kernel kernelHist = cl::Kernel(channelPrograms[0], "histogram_rgb"); // Load the histogram kernel defined in my_kernels
 
 	// Report stats for histogram kernel
 	cout << "[Part 1] Maximum Work Group Size: ";
@@ -158,41 +528,51 @@ void perform_colour_op(CImg<unsigned char> inputImgPtr, int platform_id, int dev
 	cout << "[Part 1] Preferred Work Group Size: ";
 	cerr << kernelHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Report image buffer write time
-	cout << "[Part 1] Image Buffer Memory Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-
-
-	// Event for tracking kernel execution time
-	cl::Event histogramProf;
-
 	// Execute the histogram_rgb for each image channel individually
 	for (int channel = 0 ; channel < 3; channel++) {
-		queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE); // Fill histogram buffer with 0's
-		queue.enqueueWriteBuffer(channelBuffer, CL_TRUE, 0, sizeof(int), &channel); // Write channel value to channel buffer
+		string stage = "Part 1 channel " + to_string(channel);
+		queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof); // Fill histogram buffer with 0's
+		profiler.Add(stage + " histogram fill", prof, HIST_SIZE);
+
+		if (sampleStride > 1) {
+			// Approximate histogram of this channel's plane from a stratified sample
+			histPixels = enqueue_sampled_histogram(queue, program, inputImgBuffer, histBuffer, channel * planeSize, planeSize, sampleStride, &prof);
+			profiler.Add(stage + " sampled histogram kernel", prof, histPixels);
+		}
+		else if (options.specialise) {
+			// The channel and plane size are built in, so nothing is written and only this channel's plane is launched
+			cl::Kernel kernelChannel(channelPrograms[channel], "histogram_rgb");
+			kernelChannel.setArg(0, inputImgBuffer);
+			kernelChannel.setArg(1, histBuffer);
+			kernelChannel.setArg(2, channelBuffer); // unused by the specialised kernel
+			queue.enqueueNDRangeKernel(kernelChannel, cl::NDRange((size_t)channel * planeSize), cl::NDRange(planeSize), cl::NullRange, NULL, &prof);
+			profiler.Add(stage + " specialised histogram kernel", prof, planeSize);
+		}
+		else {
+			queue.enqueueWriteBuffer(channelBuffer, CL_TRUE, 0, sizeof(int), &channel, NULL, &prof); // Write channel value to channel buffer
+			profiler.Add(stage + " channel write", prof, sizeof(int));
 
-		// Set kernel arguements for histogram_rgb
-		kernelHist.setArg(0, inputImgBuffer);
-		kernelHist.setArg(1, histBuffer);
-		kernelHist.setArg(2, channelBuffer);
+			// Set kernel arguements for histogram_rgb
+			kernelHist.setArg(0, inputImgBuffer);
+			kernelHist.setArg(1, histBuffer);
+			kernelHist.setArg(2, channelBuffer);
 
-		// Execute the kernel with our provided params
-		queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, cl::NDRange(inputImgPtr.size()), kernelHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), NULL, &histogramProf);
+			// Execute the kernel with our provided params
+			queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, cl::NDRange(inputImgPtr.size()), kernelHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), NULL, &prof);
+			profiler.Add(stage + " histogram kernel", prof, inputImgPtr.size());
+		}
 
 		// Write the histogram result from our device memory to our vector via the histogram buffer
 		if (channel == 0) {
-			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &rHistBin[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &rHistBin[0], NULL, &prof);
 		}
 		else if (channel == 1) {
-			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &gHistBin[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &gHistBin[0], NULL, &prof);
 		}
 		else {
-			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &bHistBin[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &bHistBin[0], NULL, &prof);
 		}
-
-		cout << "[Part 1] [Channel "<< channel << "] Histogram Buffer Memory Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "[Part 1] [Channel " << channel << "] Histogram Kernel Execution Time [ns]:" << histogramProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histogramProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "[Part 1] [Channel " << channel << "] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(histogramProf, ProfilingResolution::PROF_NS) << endl;
-
+		profiler.Add(stage + " histogram read", prof, HIST_SIZE);
 	}
 
 
@@ -200,127 +580,123 @@ void perform_colour_op(CImg<unsigned char> inputImgPtr, int platform_id, int dev
 	std::vector<int> rCumHist(BIN_SIZE), gCumHist(BIN_SIZE), bCumHist(BIN_SIZE); // Create 3 vectors to store cumulative R,G,B histogram values
 
 	cl::Kernel kernelCum = cl::Kernel(program, "scan_add_atomic"); // Load Scanning kernel
-	cl::Buffer cumHistBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE); // Create buffer to store cumulative values
+	cl::Buffer& cumHistBuffer = arena.Get(cumHistRegion); // Buffer to store cumulative values
 
 	// Report stats for histogram kernel
-	cout << "[Part 1] Maximum Work Group Size: ";
+	cout << "[Part 2] Maximum Work Group Size: ";
 	cerr << kernelCum.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) << endl; // Get device info
-	cout << "[Part 1] Preferred Work Group Size: ";
+	cout << "[Part 2] Preferred Work Group Size: ";
 	cerr << kernelCum.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event cumulativeProf;
-
 	// Execute scan_add_atomic for each spectrum (r,g,b) sequentially
 	for (int i = 0; i < 3; i++) {
-		queue.enqueueFillBuffer(cumHistBuffer, 0, 0, HIST_SIZE); // Fill cumulative buffer with 0's
+		string stage = "Part 2 channel " + to_string(i);
+		queue.enqueueFillBuffer(cumHistBuffer, 0, 0, HIST_SIZE, NULL, &prof); // Fill cumulative buffer with 0's
+		profiler.Add(stage + " cumulative fill", prof, HIST_SIZE);
 
 		// Queue a write of the correct histgram buffer
 		switch (i) {
 			case 0:
-				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &rHistBin[0], NULL, &inputProf);
+				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &rHistBin[0], NULL, &prof);
 				break;
 			case 1:
-				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &gHistBin[0], NULL, &inputProf);
+				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &gHistBin[0], NULL, &prof);
 				break;
 			case 2:
 			default:
-				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &bHistBin[0], NULL, &inputProf);
+				queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &bHistBin[0], NULL, &prof);
 				break;
 		}
-
-		cout << "[Part 2] [Channel " << i << "] Histogram Buffer Memory Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		profiler.Add(stage + " histogram write", prof, HIST_SIZE);
 
 		// Set kernel arguements for scanning kernel
 		kernelCum.setArg(0, histBuffer);
 		kernelCum.setArg(1, cumHistBuffer);
 
 		// Execute the cumulative histogram kernel on the selected device
-		queue.enqueueNDRangeKernel(kernelCum, cl::NullRange, cl::NDRange(rHistBin.size()), kernelCum.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), NULL, &cumulativeProf);
+		queue.enqueueNDRangeKernel(kernelCum, cl::NullRange, cl::NDRange(rHistBin.size()), kernelCum.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), NULL, &prof);
+		profiler.Add(stage + " cumulative kernel", prof, 2 * HIST_SIZE);
 
 		// Queue a read of the correct histgram buffer
 		switch (i) {
 		case 0:
-			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &rCumHist[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &rCumHist[0], NULL, &prof);
 			break;
 		case 1:
-			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &gCumHist[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &gCumHist[0], NULL, &prof);
 			break;
 		case 2:
 		default:
-			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &bCumHist[0], NULL, &outputProf);
+			queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &bCumHist[0], NULL, &prof);
 			break;
 		}
-
-		cout << "[Part 2] [Channel " << i << "] Cumulative Buffer Read Execution Time [ns]:" << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "[Part 2] [Channel " << i << "] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(cumulativeProf, ProfilingResolution::PROF_NS) << endl;
-		cout << "[Part 2] [Channel " << i << "] Cumulative Kernel Execution Time [ns]:" << cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		profiler.Add(stage + " cumulative read", prof, HIST_SIZE);
 	}
 
 
 	/* PART 3 - Normalise Histogram */
 	std::vector<int> rNormHist(BIN_SIZE), gNormHist(BIN_SIZE), bNormHist(BIN_SIZE); // Create 3 vectors to store normalised R,G,B histogram values
 
-	cl::Kernel kernelNormHist = cl::Kernel(program, "norm_bins"); // Load the norm_bins kernel defined in my_kernels
-	cl::Buffer normHistBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE); // Create buffer to store normalised histogram
-	cl::Buffer pixelCountBuffer(context, CL_MEM_READ_ONLY, sizeof(float)); // Create buffer to store normalisation calc
+	cl::Kernel kernelNormHist = cl::Kernel(channelPrograms[0], "norm_bins"); // Load the norm_bins kernel defined in my_kernels
+	cl::Buffer& normHistBuffer = arena.Get(normHistRegion); // Buffer to store normalised histogram
+	cl::Buffer& pixelCountBuffer = arena.Get(pixelCountRegion); // Buffer to store normalisation calc
 
 	// Report stats for histogram kernel
-	cout << "[Part 1] Maximum Work Group Size: ";
+	cout << "[Part 3] Maximum Work Group Size: ";
 	cerr << kernelNormHist.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) << endl; // Get device info
-	cout << "[Part 1] Preferred Work Group Size: ";
+	cout << "[Part 3] Preferred Work Group Size: ";
 	cerr << kernelNormHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event normalisedProf;
-	
-	float pixelCount = (float)255 / (float)(inputImgPtr.height() * inputImgPtr.width()); // Obtain pixel count of image
-	queue.enqueueWriteBuffer(pixelCountBuffer, CL_TRUE, 0, sizeof(int), &pixelCount); // Write pixel count value to buffer
+	// A specialised norm_bins has the scale built in and never reads the buffer
+	if (!scaleFixed) {
+		float pixelCount = (float)255 / (float)histPixels; // Obtain pixel count of image (or of the sample)
+		queue.enqueueWriteBuffer(pixelCountBuffer, CL_TRUE, 0, sizeof(float), &pixelCount, NULL, &prof); // Write pixel count value to buffer
+		profiler.Add("Part 3 pixel count write", prof, sizeof(float));
+	}
 
 	// Execute norm_bins for each spectrum (r,g,b) sequentially
 	for (int i = 0; i < 3; i++) {
-		queue.enqueueFillBuffer(normHistBuffer, 0, 0, HIST_SIZE); // Fill normalised buffer with 0's
-		
+		string stage = "Part 3 channel " + to_string(i);
+		queue.enqueueFillBuffer(normHistBuffer, 0, 0, HIST_SIZE, NULL, &prof); // Fill normalised buffer with 0's
+		profiler.Add(stage + " normalised fill", prof, HIST_SIZE);
+
 		// Queue a write of the correct histgram buffer
 		switch (i) {
 		case 0:
-			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &rCumHist[0], NULL, &inputProf);
+			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &rCumHist[0], NULL, &prof);
 			break;
 		case 1:
-			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &gCumHist[0], NULL, &inputProf);
+			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &gCumHist[0], NULL, &prof);
 			break;
 		case 2:
 		default:
-			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &bCumHist[0], NULL, &inputProf);
+			queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &bCumHist[0], NULL, &prof);
 			break;
 		}
-
-		cout << "[Part 3] [Channel " << i << "] Cumulative Buffer Memory Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		profiler.Add(stage + " cumulative write", prof, HIST_SIZE);
 
 		kernelNormHist.setArg(0, cumHistBuffer); // Load in the cumulative histogram buffer
 		kernelNormHist.setArg(1, normHistBuffer); // Pass in our normalised buffer filled with 0's
 		kernelNormHist.setArg(2, pixelCountBuffer); // Pass in the pixel count
 
 		// Execute the cumulative histogram kernel on the selected device
-		queue.enqueueNDRangeKernel(kernelNormHist, cl::NullRange, cl::NDRange(rHistBin.size()), kernelNormHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+		queue.enqueueNDRangeKernel(kernelNormHist, cl::NullRange, cl::NDRange(rHistBin.size()), kernelNormHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), NULL, &prof);
+		profiler.Add(stage + " normalise kernel", prof, 2 * HIST_SIZE);
 
 		// Queue a read of the correct histgram buffer
 		switch (i) {
 		case 0:
-			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &rNormHist[0]);
+			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &rNormHist[0], NULL, &prof);
 			break;
 		case 1:
-			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &gNormHist[0]);
+			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &gNormHist[0], NULL, &prof);
 			break;
 		case 2:
 		default:
-			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &bNormHist[0]);
+			queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &bNormHist[0], NULL, &prof);
 			break;
 		}
-
-		cout << "[Part 3] [Channel " << i << "] Normalised Buffer Read Execution Time [ns]:" << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "[Part 3] [Channel " << i << "] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(cumulativeProf, ProfilingResolution::PROF_NS) << endl;
-		cout << "[Part 3] [Channel " << i << "] Normalise Kernel Execution Time [ns]:" << cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		profiler.Add(stage + " normalised read", prof, HIST_SIZE);
 	}
 
 
@@ -328,16 +704,25 @@ void perform_colour_op(CImg<unsigned char> inputImgPtr, int platform_id, int dev
 	// Create an output buffer to store values copied from device once computation is complete
 	vector<unsigned char> outputImgVect(inputImgPtr.size());
 	// Create a new buffer to hold data about our output image
-	cl::Buffer outputImgBuffer(context, CL_MEM_READ_WRITE, inputImgPtr.size()); //should be the same as input image
+	cl::Buffer outputImgBuffer = outputRegion >= 0 ? arena.Get(outputRegion) : cl::Buffer(context, CL_MEM_READ_WRITE, inputImgPtr.size()); //should be the same as input image
+
+	// Fold any point operations into the equalisation LUTs so they cost no extra pass
+	vector<int> rLut = rNormHist, gLut = gNormHist, bLut = bNormHist;
+	options.pointOps.ComposeInto(rLut);
+	options.pointOps.ComposeInto(gLut);
+	options.pointOps.ComposeInto(bLut);
 
-	// Create output buffers for RGB normalised values & write normalised values to each buffer
-	cl::Buffer rOutBuffer(context, CL_MEM_READ_ONLY, HIST_SIZE), gOutBuffer(context, CL_MEM_READ_ONLY, HIST_SIZE), bOutBuffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
-	queue.enqueueWriteBuffer(rOutBuffer, CL_TRUE, 0, HIST_SIZE, &rNormHist[0]);
-	queue.enqueueWriteBuffer(gOutBuffer, CL_TRUE, 0, HIST_SIZE, &gNormHist[0]);
-	queue.enqueueWriteBuffer(bOutBuffer, CL_TRUE, 0, HIST_SIZE, &bNormHist[0]);
+	// Output buffers for RGB normalised values & write normalised values to each buffer
+	cl::Buffer& rOutBuffer = arena.Get(rOutRegion), & gOutBuffer = arena.Get(gOutRegion), & bOutBuffer = arena.Get(bOutRegion);
+	queue.enqueueWriteBuffer(rOutBuffer, CL_TRUE, 0, HIST_SIZE, &rLut[0], NULL, &prof);
+	profiler.Add("Part 4 red LUT write", prof, HIST_SIZE);
+	queue.enqueueWriteBuffer(gOutBuffer, CL_TRUE, 0, HIST_SIZE, &gLut[0], NULL, &prof);
+	profiler.Add("Part 4 green LUT write", prof, HIST_SIZE);
+	queue.enqueueWriteBuffer(bOutBuffer, CL_TRUE, 0, HIST_SIZE, &bLut[0], NULL, &prof);
+	profiler.Add("Part 4 blue LUT write", prof, HIST_SIZE);
 
 
-	cl::Kernel kernelLut = cl::Kernel(program, "lut_rgb"); // Load the LUT kernel defined in my_kernels
+	cl::Kernel kernelLut = cl::Kernel(channelPrograms[0], "lut_rgb"); // Load the LUT kernel defined in my_kernels
 	kernelLut.setArg(0, inputImgBuffer); // Load in our normalised histogram buffer bin
 	kernelLut.setArg(1, outputImgBuffer); // Load in our input image in buffer form
 	kernelLut.setArg(2, rOutBuffer); // Load in our output image buffer for writing to
@@ -350,88 +735,189 @@ void perform_colour_op(CImg<unsigned char> inputImgPtr, int platform_id, int dev
 	cout << "[Part 4] Preferred Work Group Size: ";
 	cerr << kernelLut.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event lutProf;
-
-
 	// Execute lut_rgb kernel
-	queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, cl::NDRange(inputImgPtr.size()), cl::NDRange(256), NULL, &lutProf);
+	queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, cl::NDRange(inputImgPtr.size()), cl::NDRange(256), NULL, &prof);
+	profiler.Add("Part 4 LUT kernel", prof, 2 * inputImgPtr.size());
 
 	// Copy the result from device to host
-	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect.data()[0], NULL, &outputProf);
-
-	// Display comparison between input & output
-	CImg<unsigned char> output_image(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
-	CImgDisplay inputImgDisp(inputImgPtr, "[COLOUR] Input Image - IMP15591119");
-	CImgDisplay outputImgDisp(output_image, "[COLOUR] Output Image - IMP15591119");
-
-	cout << "[Part 4] Output Image Buffer Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 4] Look-Up Table Kernel Execution Time [ns]:" << lutProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - lutProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 4] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(lutProf, ProfilingResolution::PROF_NS) << endl;
-
+	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect.data()[0], NULL, &prof);
+	profiler.Add("Part 4 output image read", prof, outputImgVect.size());
 
-	while (!inputImgDisp.is_closed() && !outputImgDisp.is_closed() && !inputImgDisp.is_keyESC() && !outputImgDisp.is_keyESC()) {
-		inputImgDisp.wait(1);
-		inputImgDisp.wait(1);
+	if (sampleStride > 1) {
+		report_sampling_accuracy(inputImgPtr, 0, rHistBin, histPixels, rNormHist, profiler);
+		report_sampling_accuracy(inputImgPtr, 1, gHistBin, histPixels, gNormHist, profiler);
+		report_sampling_accuracy(inputImgPtr, 2, bHistBin, histPixels, bNormHist, profiler);
 	}
 
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
 }
 
-// Performs contrast adjustment for a greyscale image
-void perform_greyscale_op(CImg<unsigned char> inputImgPtr, int platform_id, int device_id) {
-	// Select platform and device to use to create a context from
-	cl::Context context = GetContext(platform_id, device_id);
+// Performs contrast adjustment for a colour image with the histogram, scan and LUT-build stages of each
+// channel issued to its own lane of a task graph, so the channels overlap instead of running one after
+// another. The lanes share one out-of-order queue when the device has one, or get an in-order queue each.
+CImg<unsigned char> perform_colour_concurrent_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::Program& program = setup.program;
+	cl::Device& device = setup.device;
 
-	// Display the selected device
-	cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << endl;
-
-	// Create a queue to which we will push commands for the device & enable profiling
-	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t HIST_SIZE = BIN_SIZE * sizeof(int);
+	const int CHANNELS = 3;
+	size_t imageSize = inputImgPtr.size();
+
+	vector<cl::CommandQueue> queues(1, TaskGraph::GetQueue(device));
+	if (!TaskGraph::IsOutOfOrder(queues[0])) {
+		for (int c = 1; c < CHANNELS; c++)
+			queues.push_back(DeviceRegistry::Get().Queue(device, CL_QUEUE_PROFILING_ENABLE, c));
+	}
+	for (cl::CommandQueue& queue : queues)
+		profiler.Calibrate(queue);
+	TaskGraph graph(queues, profiler);
+	cout << "[INFO] Channels issued to " << (queues.size() == 1 ? "one out-of-order queue" : to_string(queues.size()) + " in-order queues") << endl;
+
+	// Every buffer from one arena, as in the sequential colour path
+	DeviceArena arena(context, device);
+	vector<int> channelRegions, histRegions, cdfRegions, lutRegions, composedRegions;
+	for (int c = 0; c < CHANNELS; c++) {
+		channelRegions.push_back(arena.Reserve(sizeof(int)));
+		histRegions.push_back(arena.Reserve(HIST_SIZE));
+		cdfRegions.push_back(arena.Reserve(HIST_SIZE));
+		lutRegions.push_back(arena.Reserve(HIST_SIZE));
+		composedRegions.push_back(arena.Reserve(HIST_SIZE));
+	}
+	int scaleRegion = arena.Reserve(sizeof(float));
+	int pointTableRegion = arena.Reserve(HIST_SIZE);
+	int inputRegion = arena.Fits(imageSize) ? arena.Reserve(imageSize) : -1;
+	int outputRegion = arena.Fits(imageSize) ? arena.Reserve(imageSize) : -1;
+	arena.Create();
+
+	cl::Buffer inputImgBuffer = inputRegion >= 0 ? arena.Get(inputRegion) : cl::Buffer(context, CL_MEM_READ_ONLY, imageSize);
+	cl::Buffer outputImgBuffer = outputRegion >= 0 ? arena.Get(outputRegion) : cl::Buffer(context, CL_MEM_READ_WRITE, imageSize);
+	cl::Buffer& scaleBuffer = arena.Get(scaleRegion);
+
+	graph.Write("Concurrent image write", inputImgBuffer, imageSize, inputImgPtr.data());
+	int planeSize = inputImgPtr.width() * inputImgPtr.height();
+	int sampleStride = get_sample_stride(options.sampleRate);
+	int histPixels = (planeSize + sampleStride - 1) / sampleStride; // Pixels counted into each channel's histogram
+	float pixelCount = (float)255 / (float)histPixels;
+	// Specialised programs have the scale built in unless sampling, so the buffer is only written otherwise
+	bool scaleFixed = options.specialise && sampleStride == 1;
+	vector<cl::Program> channelPrograms = get_channel_programs(setup, options, planeSize, scaleFixed ? pixelCount : 0.0f, profiler);
+	if (!scaleFixed)
+		graph.Write("Concurrent pixel count write", scaleBuffer, sizeof(float), &pixelCount);
+
+	// Point operations are folded into each channel's LUT on the device
+	vector<int> pointTable = options.pointOps.Table();
+	cl::Buffer& pointTableBuffer = arena.Get(pointTableRegion);
+	if (!options.pointOps.Empty())
+		graph.Write("Concurrent point table write", pointTableBuffer, HIST_SIZE, &pointTable[0]);
+
+	// When sampling, each channel's histogram and LUT are copied back for the accuracy report
+	vector<vector<int>> sampledHists(CHANNELS, vector<int>(BIN_SIZE)), sampledLuts(CHANNELS, vector<int>(BIN_SIZE));
+	vector<cl::Buffer> luts;
+	for (int c = 0; c < CHANNELS; c++) {
+		string stage = "Concurrent channel " + to_string(c);
+		ChannelBuffers channel = { arena.Get(channelRegions[c]), arena.Get(histRegions[c]), arena.Get(cdfRegions[c]), arena.Get(lutRegions[c]) };
+		EnqueueChannelLut(graph, c, channelPrograms[c], inputImgBuffer, imageSize, scaleBuffer, c, channel, stage, options.specialise,
+			sampleStride, sampleStride > 1 ? &sampledHists[c][0] : NULL);
+		if (sampleStride > 1)
+			graph.Read(stage + " LUT read", channel.lut, HIST_SIZE, &sampledLuts[c][0], c);
+
+		if (!options.pointOps.Empty()) {
+			cl::Buffer& composed = arena.Get(composedRegions[c]);
+			cl::Kernel kernelCompose(program, "compose_lut");
+			kernelCompose.setArg(0, channel.lut);
+			kernelCompose.setArg(1, composed);
+			kernelCompose.setArg(2, pointTableBuffer);
+			graph.Kernel(stage + " compose kernel", kernelCompose, cl::NDRange(BIN_SIZE), cl::NullRange, { channel.lut, pointTableBuffer }, { composed }, 3 * HIST_SIZE, c);
+			channel.lut = composed;
+		}
+		luts.push_back(channel.lut);
+	}
 
-	// Create a program to combine context and kernels
-	cl::Program::Sources sources;
-	AddSources(sources, "kernels/assign_kernels.cl");
+	// The apply waits for all three channels
+	EnqueueColourApply(graph, channelPrograms[0], inputImgBuffer, outputImgBuffer, imageSize, luts, "Concurrent");
 
-	// Create a program to combine context and kernels
-	cl::Program program(context, sources);
+	vector<unsigned char> outputImgVect(imageSize);
+	graph.Read("Concurrent output image read", outputImgBuffer, imageSize, &outputImgVect[0]);
+	graph.Finish();
 
-	// Attempt to build the OpenCL Program and catch any errors that occur during build
-	try {
-		program.build();
-	}
-	catch (const cl::Error& err) {
-		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-		// Throw error and exit
-		throw err;
-		return;
+	if (sampleStride > 1) {
+		for (int c = 0; c < CHANNELS; c++)
+			report_sampling_accuracy(inputImgPtr, c, sampledHists[c], histPixels, sampledLuts[c], profiler);
 	}
 
-	// Get info about the device we're operating on
-	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Performs contrast adjustment for a greyscale image. Every stage is enqueued without blocking through a
+// task graph, on an out-of-order queue when the device has one, and the host only waits for the output.
+CImg<unsigned char> perform_greyscale_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::Program& program = setup.program;
+	cl::Device& device = setup.device;
+
+	// Select the kernel variant used for each stage
+	VariantRegistry registry;
+	VariantConfig config = get_variant_config(registry, options, context, setup.queue, program, inputImgPtr);
+
+	// The stages themselves go through their own queue so it can be out-of-order
+	cl::CommandQueue queue = TaskGraph::GetQueue(device);
+	profiler.Calibrate(queue);
+	TaskGraph graph(queue, profiler);
+	cout << "[INFO] " << (TaskGraph::IsOutOfOrder(queue) ? "Out-of-order" : "In-order") << " queue" << endl;
 
 	const int BIN_SIZE = 256; // Hard-coded bin size of 256
-	cl::Event inputProf, outputProf; // Create generic CL Events for profiling
 
 
 	/* PART 1 - Histogram Generation [GREYSCALE] */
 	std::vector<int> histBin(BIN_SIZE); // Create a histogram to hold values 
 	const size_t HIST_SIZE = histBin.size() * sizeof(int); // Hard-coded bin size
 
-	// Create our initial buffers for usage in OpenCL Kernels
-	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size()); // Create a read-only buffer with a size of our input image
-	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);  // Create a read-write buffer with the size of our histogram bin (bin_size * size(int))
-	
+	// Buffers shared by the kernel variants of every stage
+	StageBuffers buffers;
+	buffers.pixels = inputImgPtr.size();
+
+	// Carve every buffer out of one device allocation: the histograms, LUT and scale next to each other so
+	// one fill clears them all, then the image buffers while the arena still fits in a single allocation
+	DeviceArena arena(context, device);
+	int histRegion = arena.Reserve(HIST_SIZE);
+	int cumHistRegion = arena.Reserve(HIST_SIZE);
+	int lutRegion = arena.Reserve(HIST_SIZE);
+	int scaleRegion = arena.Reserve(sizeof(float));
+	int pointTableRegion = arena.Reserve(HIST_SIZE);
+	int composedRegion = arena.Reserve(HIST_SIZE);
+	int inputRegion = arena.Fits(inputImgPtr.size()) ? arena.Reserve(inputImgPtr.size()) : -1;
+	int outputRegion = arena.Fits(inputImgPtr.size()) ? arena.Reserve(inputImgPtr.size()) : -1;
+	arena.Create();
+
+	// Our initial buffers for usage in OpenCL Kernels
+	buffers.image = inputRegion >= 0 ? arena.Get(inputRegion) : cl::Buffer(context, CL_MEM_READ_ONLY, inputImgPtr.size()); // Buffer with the size of our input image
+	buffers.hist = arena.Get(histRegion); // Buffer with the size of our histogram bin (bin_size * size(int))
+	buffers.cumHist = arena.Get(cumHistRegion);
+	buffers.lut = arena.Get(lutRegion);
+	buffers.scale = arena.Get(scaleRegion); // Buffer to store normalisation calc
+	buffers.output = outputRegion >= 0 ? arena.Get(outputRegion) : cl::Buffer(context, CL_MEM_READ_WRITE, inputImgPtr.size()); //should be the same as input image
+
+	// Fill the histogram, cumulative histogram and LUT buffers with 0's in one command. It goes through the
+	// whole arena, which must not be used at the same time as its sub-buffers, so every command on one waits for it.
+	vector<cl::Buffer> arenaBuffers = { buffers.hist, buffers.cumHist, buffers.lut, buffers.scale, arena.Get(pointTableRegion), arena.Get(composedRegion), buffers.image, buffers.output };
+	graph.Enqueue("Part 1 histogram fill", {}, arenaBuffers, arena.Span(histRegion, lutRegion),
+		[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			cl::Event evnt;
+			arena.EnqueueFill(queue, histRegion, lutRegion, wait, &evnt);
+			events->push_back(evnt);
+		});
 	// Write image input data to our device's memory via our image input buffer
-	queue.enqueueWriteBuffer(inputImgBuffer, CL_TRUE, 0, inputImgPtr.size(), &inputImgPtr.data()[0], NULL, &inputProf);
-	// Write histogram bin buffer filled with 0's to our device's memory
-	queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE);
+	graph.Write("Part 1 image write", buffers.image, inputImgPtr.size(), inputImgPtr.data());
 
 	// Set up histogram kernel for device execution
-	cl::Kernel kernelHist = cl::Kernel(program, "histogram"); // Load the histogram kernel defined in my_kernels
-	kernelHist.setArg(0, inputImgBuffer);  // Pass in our image buffer as our input
-	kernelHist.setArg(1, histBuffer);  // Pass in our histogram buffer as our output
+	const KernelVariant& histVariant = registry.Find(STAGE_HISTOGRAM, config[STAGE_HISTOGRAM].name);
+	cl::Kernel kernelHist = cl::Kernel(program, histVariant.kernel.c_str()); // Load the selected histogram kernel defined in assign_kernels
 
 	// Report stats for histogram kernel
 	cout << "[Part 1] Maximum Work Group Size: ";
@@ -439,36 +925,33 @@ void perform_greyscale_op(CImg<unsigned char> inputImgPtr, int platform_id, int
 	cout << "[Part 1] Preferred Work Group Size: ";
 	cerr << kernelHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event histogramProf;
-
 	// Execute histogram kernel with attatched profiler
-	queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, cl::NDRange(inputImgPtr.size()), cl::NDRange(256), NULL, &histogramProf);
-	// Write the histogram result from our device memory to our vector via the histogram buffer
-	queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, histBin.size() * sizeof(int), &histBin[0], NULL, &outputProf);
-
-	cout << "[Part 1] Image Buffer Memory Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 1] Histogram Buffer Memory Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 1] Histogram Kernel Execution Time [ns]:" << histogramProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histogramProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 1] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(histogramProf, ProfilingResolution::PROF_NS) << endl;
+	int sampleStride = get_sample_stride(options.sampleRate);
+	int histPixels = (int)inputImgPtr.size(); // Pixels counted into the histogram, fewer when sampling
+	if (sampleStride > 1) {
+		// Approximate histogram from a stratified sample instead of the selected variant
+		histPixels = (inputImgPtr.size() + sampleStride - 1) / sampleStride;
+		graph.Enqueue("Part 1 sampled histogram kernel", { buffers.image }, { buffers.hist }, histPixels,
+			[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				cl::Event evnt;
+				enqueue_sampled_histogram(queue, program, buffers.image, buffers.hist, 0, (int)inputImgPtr.size(), sampleStride, &evnt, wait);
+				events->push_back(evnt);
+			});
+	}
+	else {
+		graph.Enqueue("Part 1 histogram kernel", { buffers.image }, { buffers.hist }, inputImgPtr.size(),
+			[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				histVariant.enqueue(queue, kernelHist, buffers, config[STAGE_HISTOGRAM].params, wait, events);
+			});
+	}
+	// Copy the histogram back for the sampling report while the later stages run
+	graph.Read("Part 1 histogram read", buffers.hist, HIST_SIZE, &histBin[0]);
 
 
 	/* PART 2 - Cumulative Histogram Generation */
-	// Create a new vector to store our cumulative bin values
-	std::vector<int> cumBin(BIN_SIZE);
-
-	// Create a new buffer to hold data about our cumulative histogram on our device
-	cl::Buffer cumHistBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
-
-	// Write histogram data to our device's memory via our histogram buffer
-	queue.enqueueWriteBuffer(histBuffer, CL_TRUE, 0, HIST_SIZE, &histBin[0], NULL, &inputProf);
-	// Write cumulative histogram bin buffer filled with 0's to our devices memory
-	queue.enqueueFillBuffer(cumHistBuffer, 0, 0, HIST_SIZE);
-
 	// Set up cumulative kernel for device execution
-	cl::Kernel kernelCum = cl::Kernel(program, "scan_hs"); // Load the scan_hs kernel defined in assign_kernels
-	kernelCum.setArg(0, histBuffer); // Pass in our histogram buffer as our input
-	kernelCum.setArg(1, cumHistBuffer); // Pass in our cumulative histogram buffer as our output
+	const KernelVariant& scanVariant = registry.Find(STAGE_SCAN, config[STAGE_SCAN].name);
+	cl::Kernel kernelCum = cl::Kernel(program, scanVariant.kernel.c_str()); // Load the selected scan kernel defined in assign_kernels
 
 	// Report stats for cumulative kernel
 	cout << "[Part 2] Maximum Work Group Size: ";
@@ -476,42 +959,28 @@ void perform_greyscale_op(CImg<unsigned char> inputImgPtr, int platform_id, int
 	cout << "[Part 2] Preferred Work Group Size: ";
 	cerr << kernelCum.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event cumulativeProf;
-
-	// Execute the cumulative histogram kernel on the selected device
-	queue.enqueueNDRangeKernel(kernelCum, cl::NullRange, cl::NDRange(histBin.size()), kernelCum.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), NULL, &cumulativeProf);
-
-	// Copy the result from device to host
-	queue.enqueueReadBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &cumBin[0], NULL, &outputProf);
-
-	cout << "[Part 2] Cumulative Histogram Buffer Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 2] Cumulative Histogram Buffer Output Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 2] Cumulative Kernel Execution Time [ns]:" << cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 2] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(cumulativeProf, ProfilingResolution::PROF_NS) << endl;
+	// Execute the cumulative histogram kernel on the histogram already on the device
+	// scan_hs uses the histogram as its second buffer, so it writes both
+	vector<cl::Buffer> scanOutputs = { buffers.cumHist };
+	if (scanVariant.name == "scan_hs")
+		scanOutputs.push_back(buffers.hist);
+	graph.Enqueue("Part 2 cumulative kernel", { buffers.hist }, scanOutputs, 2 * HIST_SIZE,
+		[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			scanVariant.enqueue(queue, kernelCum, buffers, config[STAGE_SCAN].params, wait, events);
+		});
 
 
 	/* Part 3 - Cumulative Histogram Normalisation */
-	// Create a new vector to store our cumulative bin values
-	std::vector<int> normHistBin(cumBin.size());
-
-	// Create a new buffer to hold data about our normalised cumulative histogram on our device
-	cl::Buffer normHistBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
-	cl::Buffer pixelCountBuffer(context, CL_MEM_READ_ONLY, sizeof(float)); // Create buffer to store normalisation calc
+	// Create a new vector to store our normalised bin values
+	std::vector<int> normHistBin(BIN_SIZE);
 
-	float pixelCount = (float)255 / (float)(inputImgPtr.height() * inputImgPtr.width()); // Obtain pixel count of image
-
-	// Write histogram data to our device's memory via our cumulative histogram buffer
-	queue.enqueueWriteBuffer(cumHistBuffer, CL_TRUE, 0, HIST_SIZE, &cumBin[0], NULL, &inputProf);
-	queue.enqueueWriteBuffer(pixelCountBuffer, CL_TRUE, 0, sizeof(float), &pixelCount);
-	// Write normalised cumulative histogram bin buffer filled  with 0's to our devices memory
-	queue.enqueueFillBuffer(normHistBuffer, 0, 0, HIST_SIZE);
+	float pixelCount = (float)255 / (float)histPixels; // Obtain pixel count of image (or of the sample)
+	buffers.scaleValue = pixelCount;
+	graph.Write("Part 3 pixel count write", buffers.scale, sizeof(float), &pixelCount);
 
 	// Set up normalised cumulative kernel for device execution
-	cl::Kernel kernelCumNormHist = cl::Kernel(program, "norm_bins"); // Load the norm_bins kernel defined in my_kernels
-	kernelCumNormHist.setArg(0, cumHistBuffer); // Load in the cumulative histogram buffer
-	kernelCumNormHist.setArg(1, normHistBuffer); // Pass in our normalised buffer filled with 0's
-	kernelCumNormHist.setArg(2, pixelCountBuffer); // Pass in our calculated normalisation value TODO: ASK
+	const KernelVariant& normVariant = registry.Find(STAGE_LUT_BUILD, config[STAGE_LUT_BUILD].name);
+	cl::Kernel kernelCumNormHist = cl::Kernel(program, normVariant.kernel.c_str()); // Load the selected normalisation kernel defined in assign_kernels
 
 	// Report stats for normalisation kernel
 	cout << "[Part 3] Maximum Work Group Size: ";
@@ -519,34 +988,35 @@ void perform_greyscale_op(CImg<unsigned char> inputImgPtr, int platform_id, int
 	cout << "[Part 3] Preferred Work Group Size: ";
 	cerr << kernelCumNormHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event normalisedProf;
-
-	// Execute the cumulative histogram kernel on the selected device
-	queue.enqueueNDRangeKernel(kernelCumNormHist, cl::NullRange, cl::NDRange(cumBin.size()), kernelCumNormHist.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), NULL, &normalisedProf);
-
-	// Copy the result from device to host
-	queue.enqueueReadBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &normHistBin[0], NULL, &outputProf);
-
-	cout << "[Part 3] Normalised Histogram Buffer Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 3] Normalised Histogram Buffer Output Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 3] Normalised Kernel Execution Time [ns]:" << normalisedProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - normalisedProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 3] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(normalisedProf, ProfilingResolution::PROF_NS) << endl;
+	// Execute the normalisation kernel on the selected device
+	graph.Enqueue("Part 3 normalise kernel", { buffers.cumHist, buffers.scale }, { buffers.lut }, 2 * HIST_SIZE,
+		[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			normVariant.enqueue(queue, kernelCumNormHist, buffers, config[STAGE_LUT_BUILD].params, wait, events);
+		});
+	graph.Read("Part 3 normalised read", buffers.lut, HIST_SIZE, &normHistBin[0]);
 
 
 	/* Part 4 - Image from LUT */
 	// Create an output buffer to store values copied from device once computation is complete
 	vector<unsigned char> outputImgVect(inputImgPtr.size());
-	// Create a new buffer to hold data about our output image
-	cl::Buffer outputImgBuffer(context, CL_MEM_READ_WRITE, inputImgPtr.size()); //should be the same as input image
 
-	// Write normalised cumulative histogram data to our predefined buffer
-	queue.enqueueWriteBuffer(normHistBuffer, CL_TRUE, 0, HIST_SIZE, &normHistBin[0], NULL, &inputProf);
+	// Fold any point operations into the equalisation LUT on the device so they cost no extra pass
+	vector<int> pointTable = options.pointOps.Table();
+	if (!options.pointOps.Empty()) {
+		cl::Buffer& pointTableBuffer = arena.Get(pointTableRegion);
+		cl::Buffer& composedBuffer = arena.Get(composedRegion);
+		graph.Write("Part 4 point table write", pointTableBuffer, HIST_SIZE, &pointTable[0]);
+
+		cl::Kernel kernelCompose(program, "compose_lut");
+		kernelCompose.setArg(0, buffers.lut);
+		kernelCompose.setArg(1, composedBuffer);
+		kernelCompose.setArg(2, pointTableBuffer);
+		graph.Kernel("Part 4 compose kernel", kernelCompose, cl::NDRange(BIN_SIZE), cl::NullRange, { buffers.lut, pointTableBuffer }, { composedBuffer }, 3 * HIST_SIZE);
+		buffers.lut = composedBuffer;
+	}
 
-	cl::Kernel kernelLut = cl::Kernel(program, "lut"); // Load the LUT kernel defined in my_kernels
-	kernelLut.setArg(0, inputImgBuffer); // Load in our normalised histogram buffer bin
-	kernelLut.setArg(1, outputImgBuffer); // Load in our input image in buffer form
-	kernelLut.setArg(2, normHistBuffer); // Load in our output image buffer for writing to
+	const KernelVariant& lutVariant = registry.Find(STAGE_APPLY, config[STAGE_APPLY].name);
+	cl::Kernel kernelLut = cl::Kernel(program, lutVariant.kernel.c_str()); // Load the selected LUT kernel defined in assign_kernels
 
 	// Report stats for normalisation kernel
 	cout << "[Part 4] Maximum Work Group Size: ";
@@ -554,26 +1024,1193 @@ void perform_greyscale_op(CImg<unsigned char> inputImgPtr, int platform_id, int
 	cout << "[Part 4] Preferred Work Group Size: ";
 	cerr << kernelLut.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << endl; // Get device info
 
-	// Event for tracking kernel execution time
-	cl::Event lutProf;
-
 	// Execute the look-up table histogram kernel on the selected device
-	queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, cl::NDRange(inputImgPtr.size()), cl::NDRange(256), NULL, &lutProf);
+	graph.Enqueue("Part 4 LUT kernel", { buffers.image, buffers.lut }, { buffers.output }, 2 * inputImgPtr.size(),
+		[&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			lutVariant.enqueue(queue, kernelLut, buffers, config[STAGE_APPLY].params, wait, events);
+		});
+
+	//4.3 Copy the result from device to host, the only point the host waits for the device
+	graph.Read("Part 4 output image read", buffers.output, outputImgVect.size(), &outputImgVect[0]);
+	graph.Finish();
+
+	if (sampleStride > 1)
+		report_sampling_accuracy(inputImgPtr, 0, histBin, histPixels, normHistBin, profiler);
+
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Matches the histogram of each channel to the same channel of the reference image (or its only channel
+// when the reference is greyscale). Both CDFs come from the histogram and scan kernels, match_cdf inverts
+// the reference CDF into a LUT on the device and lut/lut_rgb apply it, so with the reference CDF cached
+// this takes the same number of commands as equalisation.
+CImg<unsigned char> perform_match_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	// Kept for the lifetime of the program so repeated matches against one reference reuse its CDF
+	static ReferenceCdfCache referenceCache;
+	const ReferenceCdf& reference = referenceCache.Get(options.referenceFilename, queue, program, profiler);
+
+	int spectrum = inputImgPtr.spectrum();
+	if (reference.channels != 1 && reference.channels != spectrum)
+		throw runtime_error("reference image must be greyscale or have the same number of channels as the input");
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t HIST_SIZE = BIN_SIZE * sizeof(int); // Hard-coded bin size
+	int pixelCount = inputImgPtr.width() * inputImgPtr.height() * inputImgPtr.depth();
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size());
+	cl::Buffer outputImgBuffer(context, CL_MEM_WRITE_ONLY, inputImgPtr.size());
+	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer cdfBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_FALSE, 0, inputImgPtr.size(), inputImgPtr.data(), NULL, &prof);
+	profiler.Add("Match image write", prof, inputImgPtr.size());
+
+	// Upload the cached reference CDF of every channel
+	vector<cl::Buffer> refCdfBuffers;
+	for (int c = 0; c < reference.channels; c++) {
+		refCdfBuffers.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE));
+		queue.enqueueWriteBuffer(refCdfBuffers.back(), CL_FALSE, 0, HIST_SIZE, &reference.cdf[c * BIN_SIZE], NULL, &prof);
+		profiler.Add("Match reference CDF " + to_string(c) + " write", prof, HIST_SIZE);
+	}
 
-	//4.3 Copy the result from device to host
-	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect.data()[0], NULL, &outputProf);
+	cl::Kernel kernelMatch(program, "match_cdf");
+	vector<cl::Buffer> lutBuffers;
+
+	// The matching LUTs never leave the device, so point operations are composed into them there
+	cl::Kernel kernelCompose;
+	cl::Buffer pointTableBuffer, composedBuffer;
+	vector<int> pointTable = options.pointOps.Table();
+	if (!options.pointOps.Empty()) {
+		pointTableBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+		queue.enqueueWriteBuffer(pointTableBuffer, CL_FALSE, 0, HIST_SIZE, &pointTable[0], NULL, &prof);
+		profiler.Add("Match point table write", prof, HIST_SIZE);
+		kernelCompose = cl::Kernel(program, "compose_lut");
+		kernelCompose.setArg(2, pointTableBuffer);
+	}
+
+	for (int c = 0; c < spectrum; c++) {
+		string stage = "Match channel " + to_string(c);
+		EnqueueChannelCdf(queue, program, inputImgBuffer, inputImgPtr.size(), spectrum, c, histBuffer, cdfBuffer, profiler, stage);
+
+		// A greyscale reference is used for every channel
+		cl::Buffer& refChannelCdf = refCdfBuffers[reference.channels == 1 ? 0 : c];
+
+		lutBuffers.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE));
+		kernelMatch.setArg(0, cdfBuffer);
+		kernelMatch.setArg(1, refChannelCdf);
+		kernelMatch.setArg(2, lutBuffers.back());
+		kernelMatch.setArg(3, pixelCount);
+		kernelMatch.setArg(4, reference.pixels);
+		queue.enqueueNDRangeKernel(kernelMatch, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+		profiler.Add(stage + " match kernel", prof, 3 * HIST_SIZE);
+
+		if (!options.pointOps.Empty()) {
+			cl::Buffer composed(context, CL_MEM_READ_WRITE, HIST_SIZE);
+			kernelCompose.setArg(0, lutBuffers.back());
+			kernelCompose.setArg(1, composed);
+			queue.enqueueNDRangeKernel(kernelCompose, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+			profiler.Add(stage + " compose kernel", prof, 3 * HIST_SIZE);
+			lutBuffers.back() = composed;
+		}
+	}
+
+	// Apply the LUTs with the same kernels as equalisation
+	enqueue_lut_apply(queue, program, inputImgBuffer, outputImgBuffer, inputImgPtr.size(), lutBuffers, spectrum, &prof);
+	profiler.Add("Match LUT kernel", prof, 2 * inputImgPtr.size());
+
+	vector<unsigned char> outputImgVect(inputImgPtr.size());
+	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect[0], NULL, &prof);
+	profiler.Add("Match output image read", prof, outputImgVect.size());
+
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Applies only the point operation chain. The chain is composed into one table on the host and applied with
+// a single lut/lut_rgb pass, so however many operations there are the image is read and written once.
+CImg<unsigned char> perform_point_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const size_t HIST_SIZE = 256 * sizeof(int);
+	vector<int> table = options.pointOps.Table();
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size());
+	cl::Buffer outputImgBuffer(context, CL_MEM_WRITE_ONLY, inputImgPtr.size());
+	cl::Buffer tableBuffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_FALSE, 0, inputImgPtr.size(), inputImgPtr.data(), NULL, &prof);
+	profiler.Add("Point image write", prof, inputImgPtr.size());
+	queue.enqueueWriteBuffer(tableBuffer, CL_FALSE, 0, HIST_SIZE, &table[0], NULL, &prof);
+	profiler.Add("Point table write", prof, HIST_SIZE);
+
+	// Every channel uses the same table
+	enqueue_lut_apply(queue, program, inputImgBuffer, outputImgBuffer, inputImgPtr.size(), vector<cl::Buffer>(1, tableBuffer), inputImgPtr.spectrum(), &prof);
+	profiler.Add("Point LUT kernel", prof, 2 * inputImgPtr.size());
+
+	vector<unsigned char> outputImgVect(inputImgPtr.size());
+	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect[0], NULL, &prof);
+	profiler.Add("Point output image read", prof, outputImgVect.size());
+
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Stretches each channel linearly from its min/max to the full range. One histogram_stats pass gives the
+// histogram and statistics of every channel, which are printed, and the stretch LUTs (with any point
+// operations folded in) are applied in one lut/lut_rgb pass.
+CImg<unsigned char> perform_stretch_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const size_t HIST_SIZE = 256 * sizeof(int);
+	int spectrum = inputImgPtr.spectrum();
+	int planeSize = inputImgPtr.width() * inputImgPtr.height() * inputImgPtr.depth();
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size());
+	cl::Buffer outputImgBuffer(context, CL_MEM_WRITE_ONLY, inputImgPtr.size());
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_FALSE, 0, inputImgPtr.size(), inputImgPtr.data(), NULL, &prof);
+	profiler.Add("Stretch image write", prof, inputImgPtr.size());
+
+	HistogramStats stats = ComputeHistogramStats(queue, program, inputImgBuffer, planeSize, spectrum, profiler);
+
+	// Build and upload the stretch LUT of every channel
+	vector<vector<int>> luts(spectrum);
+	vector<cl::Buffer> lutBuffers;
+	for (int c = 0; c < spectrum; c++) {
+		const ChannelStats& channel = stats.channels[c];
+		cout << "[Stats] Channel " << c << ": " << FormatChannelStats(channel) << endl;
+
+		luts[c] = LinearStretchOp(channel.min, channel.max).table;
+		options.pointOps.ComposeInto(luts[c]);
+		lutBuffers.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE));
+		queue.enqueueWriteBuffer(lutBuffers.back(), CL_FALSE, 0, HIST_SIZE, &luts[c][0], NULL, &prof);
+		profiler.Add("Stretch channel " + to_string(c) + " LUT write", prof, HIST_SIZE);
+	}
+
+	enqueue_lut_apply(queue, program, inputImgBuffer, outputImgBuffer, inputImgPtr.size(), lutBuffers, spectrum, &prof);
+	profiler.Add("Stretch LUT kernel", prof, 2 * inputImgPtr.size());
+
+	vector<unsigned char> outputImgVect(inputImgPtr.size());
+	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect[0], NULL, &prof);
+	profiler.Add("Stretch output image read", prof, outputImgVect.size());
+
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Computes single or two-level Otsu thresholds for each channel on the device from its histogram and prefix
+// sums, evaluating every candidate threshold in parallel, and segments the image at them through threshold_lut
+// and the LUT kernels. Only the thresholds come back to the host.
+CImg<unsigned char> perform_otsu_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	if (options.otsuLevels != 1 && options.otsuLevels != 2)
+		throw invalid_argument("Otsu thresholding supports 1 or 2 levels");
+
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t HIST_SIZE = BIN_SIZE * sizeof(int);
+	int spectrum = inputImgPtr.spectrum();
+	int levels = options.otsuLevels;
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size());
+	cl::Buffer outputImgBuffer(context, CL_MEM_WRITE_ONLY, inputImgPtr.size());
+	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer prefixCountBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer prefixSumBuffer(context, CL_MEM_READ_WRITE, BIN_SIZE * sizeof(cl_long));
+	cl::Buffer partialScoreBuffer(context, CL_MEM_READ_WRITE, BIN_SIZE * sizeof(float));
+	cl::Buffer partialIndexBuffer(context, CL_MEM_READ_WRITE, BIN_SIZE * sizeof(int));
+
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_FALSE, 0, inputImgPtr.size(), inputImgPtr.data(), NULL, &prof);
+	profiler.Add("Otsu image write", prof, inputImgPtr.size());
+
+	cl::Kernel kernelPrefix(program, "otsu_prefix");
+	kernelPrefix.setArg(0, histBuffer);
+	kernelPrefix.setArg(1, prefixCountBuffer);
+	kernelPrefix.setArg(2, prefixSumBuffer);
+	kernelPrefix.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+	kernelPrefix.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+	kernelPrefix.setArg(5, cl::Local(BIN_SIZE * sizeof(cl_long)));
+	kernelPrefix.setArg(6, cl::Local(BIN_SIZE * sizeof(cl_long)));
+
+	cl::Kernel kernelOtsu(program, levels == 1 ? "otsu_single" : "otsu_pair");
+	cl::Kernel kernelSelect(program, "otsu_select");
+	cl::Kernel kernelThresholdLut(program, "threshold_lut");
+
+	vector<cl::Buffer> lutBuffers, thresholdBuffers;
+	for (int c = 0; c < spectrum; c++) {
+		string stage = "Otsu channel " + to_string(c);
+		EnqueueChannelHistogram(queue, program, inputImgBuffer, inputImgPtr.size(), spectrum, c, histBuffer, profiler, stage);
+
+		queue.enqueueNDRangeKernel(kernelPrefix, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+		profiler.Add(stage + " prefix kernel", prof, HIST_SIZE);
+
+		// This channel's thresholds
+		thresholdBuffers.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, levels * sizeof(int)));
+		cl::Buffer& channelThresholds = thresholdBuffers.back();
+
+		kernelOtsu.setArg(0, prefixCountBuffer);
+		kernelOtsu.setArg(1, prefixSumBuffer);
+		if (levels == 1) {
+			kernelOtsu.setArg(2, channelThresholds);
+			kernelOtsu.setArg(3, cl::Local(BIN_SIZE * sizeof(float)));
+			kernelOtsu.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+			queue.enqueueNDRangeKernel(kernelOtsu, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+			profiler.Add(stage + " threshold kernel", prof, 2 * HIST_SIZE);
+		}
+		else {
+			kernelOtsu.setArg(2, partialScoreBuffer);
+			kernelOtsu.setArg(3, partialIndexBuffer);
+			kernelOtsu.setArg(4, cl::Local(BIN_SIZE * sizeof(float)));
+			kernelOtsu.setArg(5, cl::Local(BIN_SIZE * sizeof(int)));
+			queue.enqueueNDRangeKernel(kernelOtsu, cl::NullRange, cl::NDRange(BIN_SIZE, BIN_SIZE), cl::NDRange(BIN_SIZE, 1), NULL, &prof);
+			profiler.Add(stage + " threshold pair kernel", prof, 2 * HIST_SIZE);
+
+			kernelSelect.setArg(0, partialScoreBuffer);
+			kernelSelect.setArg(1, partialIndexBuffer);
+			kernelSelect.setArg(2, channelThresholds);
+			kernelSelect.setArg(3, cl::Local(BIN_SIZE * sizeof(float)));
+			kernelSelect.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+			queue.enqueueNDRangeKernel(kernelSelect, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+			profiler.Add(stage + " threshold select kernel", prof, 2 * HIST_SIZE);
+		}
+
+		if (!options.thresholdsOnly) {
+			lutBuffers.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE));
+			kernelThresholdLut.setArg(0, channelThresholds);
+			kernelThresholdLut.setArg(1, levels);
+			kernelThresholdLut.setArg(2, lutBuffers.back());
+			queue.enqueueNDRangeKernel(kernelThresholdLut, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+			profiler.Add(stage + " LUT kernel", prof, HIST_SIZE);
+		}
+	}
 
-	CImg<unsigned char> output_image(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
-	CImgDisplay inputImgDisp(inputImgPtr, "[GREY] Input Image - IMP15591119");
-	CImgDisplay outputImgDisp(output_image, "[GREY] Output Image - IMP15591119");
+	vector<int> thresholds(spectrum * levels);
+	for (int c = 0; c < spectrum; c++) {
+		queue.enqueueReadBuffer(thresholdBuffers[c], CL_FALSE, 0, levels * sizeof(int), &thresholds[c * levels], NULL, &prof);
+		profiler.Add("Otsu channel " + to_string(c) + " thresholds read", prof, levels * sizeof(int));
+	}
+
+	CImg<unsigned char> outputImg = inputImgPtr;
+	if (!options.thresholdsOnly) {
+		enqueue_lut_apply(queue, program, inputImgBuffer, outputImgBuffer, inputImgPtr.size(), lutBuffers, spectrum, &prof);
+		profiler.Add("Otsu segment kernel", prof, 2 * inputImgPtr.size());
+		queue.enqueueReadBuffer(outputImgBuffer, CL_FALSE, 0, outputImg.size(), outputImg.data(), NULL, &prof);
+		profiler.Add("Otsu output image read", prof, outputImg.size());
+	}
+	queue.finish();
+
+	for (int c = 0; c < spectrum; c++) {
+		cout << "[Otsu] Channel " << c << " threshold" << (levels > 1 ? "s" : "") << ":";
+		for (int l = 0; l < levels; l++)
+			cout << " " << thresholds[c * levels + l];
+		cout << endl;
+	}
+	return outputImg;
+}
+
+// Robust contrast stretch. Each channel's cumulative histogram comes from the histogram and scan_hs kernels,
+// percentile_lut binary-searches it for the clipping bins and builds the linear LUT on the device, and the
+// LUT kernels apply it, so this costs the same single pass over the image as equalisation.
+CImg<unsigned char> perform_percentile_op(CImg<unsigned char> inputImgPtr, const Options& options, ProfilingReport& profiler) {
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t HIST_SIZE = BIN_SIZE * sizeof(int);
+	int spectrum = inputImgPtr.spectrum();
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	cl::Buffer inputImgBuffer(context, CL_MEM_READ_ONLY, inputImgPtr.size());
+	cl::Buffer outputImgBuffer(context, CL_MEM_WRITE_ONLY, inputImgPtr.size());
+	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer cdfBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+
+	queue.enqueueWriteBuffer(inputImgBuffer, CL_FALSE, 0, inputImgPtr.size(), inputImgPtr.data(), NULL, &prof);
+	profiler.Add("Percentile image write", prof, inputImgPtr.size());
+
+	cl::Kernel kernelPercentile(program, "percentile_lut");
+	kernelPercentile.setArg(0, cdfBuffer);
+	kernelPercentile.setArg(3, options.lowPercentile);
+	kernelPercentile.setArg(4, options.highPercentile);
+
+	// Point operations are composed into the LUTs on the device as they never come back to the host
+	cl::Kernel kernelCompose;
+	cl::Buffer pointTableBuffer;
+	vector<int> pointTable = options.pointOps.Table();
+	if (!options.pointOps.Empty()) {
+		pointTableBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+		queue.enqueueWriteBuffer(pointTableBuffer, CL_FALSE, 0, HIST_SIZE, &pointTable[0], NULL, &prof);
+		profiler.Add("Percentile point table write", prof, HIST_SIZE);
+		kernelCompose = cl::Kernel(program, "compose_lut");
+		kernelCompose.setArg(2, pointTableBuffer);
+	}
 
-	cout << "[Part 4] Input Image Buffer Write Time [ns]: " << inputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 4] Output Image Buffer Write Time [ns]: " << outputProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 4] Look-Up Table Kernel Execution Time [ns]:" << lutProf.getProfilingInfo<CL_PROFILING_COMMAND_END>() - lutProf.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-	cout << "[Part 4] Full Profiling Info (kernel) [ns]: " << GetFullProfilingInfo(lutProf, ProfilingResolution::PROF_NS) << endl;
+	vector<cl::Buffer> lutBuffers, boundsBuffers;
+	for (int c = 0; c < spectrum; c++) {
+		string stage = "Percentile channel " + to_string(c);
+		EnqueueChannelCdf(queue, program, inputImgBuffer, inputImgPtr.size(), spectrum, c, histBuffer, cdfBuffer, profiler, stage);
+
+		lutBuffers.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE));
+		boundsBuffers.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(int)));
+		kernelPercentile.setArg(1, lutBuffers.back());
+		kernelPercentile.setArg(2, boundsBuffers.back());
+		queue.enqueueNDRangeKernel(kernelPercentile, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+		profiler.Add(stage + " percentile LUT kernel", prof, 2 * HIST_SIZE);
+
+		if (!options.pointOps.Empty()) {
+			cl::Buffer composed(context, CL_MEM_READ_WRITE, HIST_SIZE);
+			kernelCompose.setArg(0, lutBuffers.back());
+			kernelCompose.setArg(1, composed);
+			queue.enqueueNDRangeKernel(kernelCompose, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NDRange(BIN_SIZE), NULL, &prof);
+			profiler.Add(stage + " compose kernel", prof, 3 * HIST_SIZE);
+			lutBuffers.back() = composed;
+		}
+	}
 
-	while (!inputImgDisp.is_closed() && !outputImgDisp.is_closed() && !inputImgDisp.is_keyESC() && !outputImgDisp.is_keyESC()) {
-		inputImgDisp.wait(1);
-		inputImgDisp.wait(1);
+	enqueue_lut_apply(queue, program, inputImgBuffer, outputImgBuffer, inputImgPtr.size(), lutBuffers, spectrum, &prof);
+	profiler.Add("Percentile LUT kernel", prof, 2 * inputImgPtr.size());
+
+	vector<int> bounds(2 * spectrum);
+	for (int c = 0; c < spectrum; c++) {
+		queue.enqueueReadBuffer(boundsBuffers[c], CL_FALSE, 0, 2 * sizeof(int), &bounds[2 * c], NULL, &prof);
+		profiler.Add("Percentile channel " + to_string(c) + " bounds read", prof, 2 * sizeof(int));
 	}
-}
\ No newline at end of file
+	vector<unsigned char> outputImgVect(inputImgPtr.size());
+	queue.enqueueReadBuffer(outputImgBuffer, CL_TRUE, 0, outputImgVect.size(), &outputImgVect[0], NULL, &prof);
+	profiler.Add("Percentile output image read", prof, outputImgVect.size());
+
+	for (int c = 0; c < spectrum; c++)
+		cout << "[Percentile] Channel " << c << ": stretching " << bounds[2 * c] << "-" << bounds[2 * c + 1] << " to 0-255" << endl;
+
+	return CImg<unsigned char>(outputImgVect.data(), inputImgPtr.width(), inputImgPtr.height(), inputImgPtr.depth(), inputImgPtr.spectrum());
+}
+
+// Performs contrast adjustment for a batch of small images with a fixed number of commands however many
+// images the batch holds. Every channel of every image is packed back to back into one buffer as its own
+// segment, so colour images are equalised per channel like the colour path, and an offsets table marks
+// where each segment starts. One launch each then builds all the histograms, scans them into per-segment
+// LUTs and applies them. When knownLuts holds each image's LUTs (256 entries per channel) from an earlier
+// run they are uploaded instead and only the apply launch runs, and when computedLuts is given the LUTs
+// that were built are read back into it.
+vector<CImg<unsigned char>> perform_batch_op(const vector<CImg<unsigned char>>& inputImgs, DeviceSetup& setup, ProfilingReport& profiler,
+	const vector<const vector<int>*>* knownLuts = NULL, vector<vector<int>>* computedLuts = NULL) {
+	BufferPool& pool = setup.pool;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t LOCAL_SIZE = 256; // Work-group size along each segment
+	const size_t PIXELS_PER_ITEM = 16; // Pixels each work-item handles in the largest segment
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	// The kernels index the packed batch with int offsets, so a batch past 2 GB is split into batches that fit
+	size_t fitting = 0;
+	for (size_t total = 0; fitting < inputImgs.size() && total + inputImgs[fitting].size() <= (size_t)INT32_MAX; fitting++)
+		total += inputImgs[fitting].size();
+	if (fitting == 0 && !inputImgs.empty())
+		throw runtime_error("image of " + to_string(inputImgs[0].size()) + " bytes is too large for a batch");
+	if (fitting < inputImgs.size()) {
+		// Shared views, so splitting copies no pixels
+		vector<CImg<unsigned char>> first, rest;
+		for (size_t i = 0; i < inputImgs.size(); i++)
+			(i < fitting ? first : rest).push_back(CImg<unsigned char>(inputImgs[i], true));
+		vector<const vector<int>*> firstLuts, restLuts;
+		if (knownLuts) {
+			firstLuts.assign(knownLuts->begin(), knownLuts->begin() + fitting);
+			restLuts.assign(knownLuts->begin() + fitting, knownLuts->end());
+		}
+		vector<CImg<unsigned char>> outputImgs = perform_batch_op(first, setup, profiler, knownLuts ? &firstLuts : NULL, computedLuts);
+		vector<CImg<unsigned char>> restImgs = perform_batch_op(rest, setup, profiler, knownLuts ? &restLuts : NULL, computedLuts);
+		for (CImg<unsigned char>& img : restImgs)
+			outputImgs.push_back(std::move(img));
+		return outputImgs;
+	}
+
+	// CImg stores channels as consecutive planes, so an image's data is already its segments in order
+	vector<int> offsets(1, 0);
+	size_t maxSegment = 0;
+	size_t packedSize = 0;
+	for (const CImg<unsigned char>& img : inputImgs) {
+		size_t plane = (size_t)img.width() * img.height() * img.depth();
+		for (int c = 0; c < img.spectrum(); c++) {
+			packedSize += plane;
+			offsets.push_back((int)packedSize);
+		}
+		maxSegment = max(maxSegment, plane);
+	}
+	size_t segments = offsets.size() - 1;
+	const size_t HIST_SIZE = segments * BIN_SIZE * sizeof(int);
+
+	// Pack the batch into a single host buffer
+	vector<unsigned char> packed(packedSize);
+	{
+		ScopedHostSpan span(profiler, "batch pack");
+		for (size_t i = 0, pos = 0; i < inputImgs.size(); pos += inputImgs[i].size(), i++)
+			std::copy(inputImgs[i].begin(), inputImgs[i].end(), packed.begin() + pos);
+	}
+
+	// Buffers come from the pool, so batches of similar size reuse the previous batch's buffers
+	cl::Buffer inputBuffer = pool.Acquire(packedSize);
+	cl::Buffer outputBuffer = pool.Acquire(packedSize);
+	cl::Buffer offsetsBuffer = pool.Acquire(offsets.size() * sizeof(int));
+	cl::Buffer lutBuffer = pool.Acquire(HIST_SIZE);
+	cl::Buffer histBuffer;
+
+	queue.enqueueWriteBuffer(inputBuffer, CL_FALSE, 0, packedSize, &packed[0], NULL, &prof);
+	profiler.Add("Batch image write", prof, packedSize);
+	queue.enqueueWriteBuffer(offsetsBuffer, CL_FALSE, 0, offsets.size() * sizeof(int), &offsets[0], NULL, &prof);
+	profiler.Add("Batch offsets write", prof, offsets.size() * sizeof(int));
+
+	// Dimension 0 is sized for the largest segment, dimension 1 selects the segment
+	size_t groupsPerSegment = max((size_t)1, (maxSegment + LOCAL_SIZE * PIXELS_PER_ITEM - 1) / (LOCAL_SIZE * PIXELS_PER_ITEM));
+	cl::NDRange pixelRange(groupsPerSegment * LOCAL_SIZE, segments);
+
+	// Every image's LUTs back to back, in segment order
+	vector<int> packedLuts;
+	if (knownLuts) {
+		// Skip straight to the apply stage with the LUTs we already have
+		for (const vector<int>* luts : *knownLuts)
+			packedLuts.insert(packedLuts.end(), luts->begin(), luts->end());
+		queue.enqueueWriteBuffer(lutBuffer, CL_FALSE, 0, HIST_SIZE, &packedLuts[0], NULL, &prof);
+		profiler.Add("Batch known LUT write", prof, HIST_SIZE);
+	}
+	else {
+		histBuffer = pool.Acquire(HIST_SIZE);
+		queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof);
+		profiler.Add("Batch histogram fill", prof, HIST_SIZE);
+
+		// Per-segment histograms
+		cl::Kernel kernelHist(program, "histogram_batched");
+		kernelHist.setArg(0, inputBuffer);
+		kernelHist.setArg(1, offsetsBuffer);
+		kernelHist.setArg(2, histBuffer);
+		kernelHist.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+		queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+		profiler.Add("Batch histogram kernel", prof, packedSize);
+
+		// Segmented scan and normalisation into per-segment LUTs
+		cl::Kernel kernelScan(program, "scan_lut_batched");
+		kernelScan.setArg(0, histBuffer);
+		kernelScan.setArg(1, offsetsBuffer);
+		kernelScan.setArg(2, lutBuffer);
+		kernelScan.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+		kernelScan.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+		queue.enqueueNDRangeKernel(kernelScan, cl::NullRange, cl::NDRange(BIN_SIZE, segments), cl::NDRange(BIN_SIZE, 1), NULL, &prof);
+		profiler.Add("Batch scan kernel", prof, 2 * HIST_SIZE);
+
+		if (computedLuts) {
+			packedLuts.resize(segments * BIN_SIZE);
+			queue.enqueueReadBuffer(lutBuffer, CL_FALSE, 0, HIST_SIZE, &packedLuts[0], NULL, &prof);
+			profiler.Add("Batch LUT read", prof, HIST_SIZE);
+		}
+	}
+
+	// Apply every LUT to its own segment
+	cl::Kernel kernelLut(program, "lut_batched");
+	kernelLut.setArg(0, inputBuffer);
+	kernelLut.setArg(1, outputBuffer);
+	kernelLut.setArg(2, lutBuffer);
+	kernelLut.setArg(3, offsetsBuffer);
+	queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+	profiler.Add("Batch LUT kernel", prof, 2 * packedSize);
+
+	vector<unsigned char> outputPacked(packedSize);
+	queue.enqueueReadBuffer(outputBuffer, CL_TRUE, 0, packedSize, &outputPacked[0], NULL, &prof);
+	profiler.Add("Batch output read", prof, packedSize);
+
+	// The blocking read has waited for every command, so the buffers are free for the next batch
+	pool.Release(inputBuffer);
+	pool.Release(outputBuffer);
+	pool.Release(offsetsBuffer);
+	pool.Release(lutBuffer);
+	if (histBuffer())
+		pool.Release(histBuffer);
+
+	// Unpack the results into images of the original dimensions
+	vector<CImg<unsigned char>> outputImgs;
+	for (size_t i = 0, pos = 0, segment = 0; i < inputImgs.size(); pos += inputImgs[i].size(), segment += inputImgs[i].spectrum(), i++) {
+		const CImg<unsigned char>& img = inputImgs[i];
+		outputImgs.push_back(CImg<unsigned char>(&outputPacked[pos], img.width(), img.height(), img.depth(), img.spectrum()));
+		if (computedLuts && !knownLuts)
+			computedLuts->push_back(vector<int>(packedLuts.begin() + segment * BIN_SIZE, packedLuts.begin() + (segment + img.spectrum()) * BIN_SIZE));
+	}
+	return outputImgs;
+}
+
+// Equalises one batch of decoded images, through the result cache when it is enabled
+vector<CImg<unsigned char>> process_batch(const vector<CImg<unsigned char>>& inputImgs, DeviceSetup& setup, ResultCache& cache, const Options& options, ProfilingReport& profiler) {
+	// Images are recognised by content, equalisation has no other parameters
+	const string CACHE_PARAMS = "batch equalise";
+
+	if (options.cacheBytes == 0)
+		return perform_batch_op(inputImgs, setup, profiler);
+
+	// Split the batch into cached outputs, cached LUTs that only need applying, and new images
+	vector<CImg<unsigned char>> outputImgs(inputImgs.size());
+	vector<unsigned long long> keys(inputImgs.size());
+	vector<size_t> applyIndices, computeIndices;
+	vector<const vector<int>*> applyLuts;
+	{
+		ScopedHostSpan span(profiler, "cache lookup");
+		for (size_t i = 0; i < inputImgs.size(); i++) {
+			const CImg<unsigned char>& img = inputImgs[i];
+			keys[i] = ResultCache::MakeKey(img.data(), img.width(), img.height() * img.depth(), img.spectrum(), CACHE_PARAMS);
+			const CachedResult* cached = cache.Find(keys[i]);
+			if (cached && !cached->output.empty()) {
+				outputImgs[i] = CImg<unsigned char>(&cached->output[0], img.width(), img.height(), img.depth(), img.spectrum());
+			}
+			else if (cached) {
+				applyIndices.push_back(i);
+				applyLuts.push_back(&cached->luts);
+			}
+			else {
+				computeIndices.push_back(i);
+			}
+		}
+	}
+
+	// Apply the cached LUTs before anything new is inserted, which could evict them
+	if (!applyIndices.empty()) {
+		vector<CImg<unsigned char>> applyImgs;
+		for (size_t i : applyIndices)
+			applyImgs.push_back(inputImgs[i]);
+		vector<CImg<unsigned char>> results = perform_batch_op(applyImgs, setup, profiler, &applyLuts);
+		for (size_t j = 0; j < applyIndices.size(); j++)
+			outputImgs[applyIndices[j]] = results[j];
+	}
+
+	if (!computeIndices.empty()) {
+		vector<CImg<unsigned char>> computeImgs;
+		for (size_t i : computeIndices)
+			computeImgs.push_back(inputImgs[i]);
+		vector<vector<int>> luts;
+		vector<CImg<unsigned char>> results = perform_batch_op(computeImgs, setup, profiler, NULL, &luts);
+		for (size_t j = 0; j < computeIndices.size(); j++) {
+			size_t i = computeIndices[j];
+			outputImgs[i] = results[j];
+			CachedResult result;
+			result.luts = luts[j];
+			if (cache.StoresOutputs())
+				result.output.assign(results[j].begin(), results[j].end());
+			cache.Insert(keys[i], std::move(result));
+		}
+	}
+	return outputImgs;
+}
+
+// One image in flight through the host pipeline
+struct ImageSlot {
+	size_t index = 0; // position in the image list
+	CImg<unsigned char> input;
+	CImg<unsigned char> output;
+	string error; // why the image could not be decoded, it is then skipped
+};
+
+// Batch equalisation as a three-stage host pipeline: decode threads -> this thread driving the device ->
+// encode threads. The stages hand each other the indices of a fixed set of image slots through lock-free
+// queues, so a stage that runs ahead blocks on a full or empty queue and throughput is set by the slowest
+// stage rather than the sum of all three.
+void run_batch_pipelined(const vector<string>& filenames, const string& outputDir, DeviceSetup& setup, ResultCache& cache, const Options& options, ProfilingReport& profiler) {
+	const size_t BATCH_SIZE = 256; // Images packed into each batch
+	const int THREADS = options.hostThreads; // Decode threads, and as many encode threads
+	// Enough slots for one batch on the device, the next one decoding and every worker busy
+	const size_t SLOTS = 2 * BATCH_SIZE + 2 * THREADS;
+	const size_t END_OF_BATCHES = SLOTS; // Slot index telling an encode thread to finish
+
+	vector<ImageSlot> slots(SLOTS);
+	BoundedQueue<size_t> freeSlots(SLOTS), decoded(SLOTS), processed(SLOTS + THREADS);
+	for (size_t i = 0; i < SLOTS; i++)
+		freeSlots.TryPush(i);
+
+	StageCounters decodeCounters("decode", THREADS), deviceCounters("device", 1), encodeCounters("encode", THREADS);
+	atomic<size_t> nextImage(0);
+	atomic<bool> stop(false);
+	long long pipelineStart = GetHostTime();
+
+	auto decodeWorker = [&]() {
+		for (size_t index; (index = nextImage++) < filenames.size();) {
+			size_t slot;
+			if (!PopWait(freeSlots, slot, decodeCounters, stop))
+				return;
+			long long start = GetHostTime();
+			slots[slot].index = index;
+			slots[slot].error.clear();
+			try {
+				slots[slot].input.load(filenames[index].c_str());
+			}
+			catch (CImgException& err) {
+				slots[slot].error = err.what();
+			}
+			decodeCounters.busy += GetHostTime() - start;
+			decodeCounters.items++;
+			if (!PushWait(decoded, slot, decodeCounters, stop))
+				return;
+		}
+	};
+
+	auto encodeWorker = [&]() {
+		size_t slot;
+		while (PopWait(processed, slot, encodeCounters, stop) && slot != END_OF_BATCHES) {
+			long long start = GetHostTime();
+			ImageSlot& image = slots[slot];
+			if (!outputDir.empty() && image.error.empty()) {
+				const string& filename = filenames[image.index];
+				string name = filename.substr(filename.find_last_of("/\\") + 1);
+				try {
+					image.output.save((outputDir + "/" + name).c_str());
+				}
+				catch (CImgException& err) {
+					cerr << "[ERROR] " << err.what() << endl;
+				}
+			}
+			encodeCounters.busy += GetHostTime() - start;
+			encodeCounters.items++;
+			if (!PushWait(freeSlots, slot, encodeCounters, stop))
+				return;
+		}
+	};
+
+	vector<thread> workers;
+	for (int t = 0; t < THREADS; t++) {
+		workers.push_back(thread(decodeWorker));
+		workers.push_back(thread(encodeWorker));
+	}
+
+	try {
+		for (size_t done = 0; done < filenames.size();) {
+			// Wait for at least one image, then take whatever else has been decoded up to a full batch
+			vector<size_t> batch(1);
+			PopWait(decoded, batch[0], deviceCounters, stop);
+			for (size_t slot; batch.size() < BATCH_SIZE && decoded.TryPop(slot);)
+				batch.push_back(slot);
+
+			long long start = GetHostTime();
+			vector<CImg<unsigned char>> inputImgs;
+			vector<size_t> valid;
+			for (size_t slot : batch) {
+				if (slots[slot].error.empty()) {
+					inputImgs.push_back(std::move(slots[slot].input));
+					valid.push_back(slot);
+				}
+				else {
+					cerr << "[ERROR] " << slots[slot].error << endl;
+				}
+			}
+
+			if (!inputImgs.empty()) {
+				vector<CImg<unsigned char>> outputImgs = process_batch(inputImgs, setup, cache, options, profiler);
+				for (size_t j = 0; j < valid.size(); j++) {
+					slots[valid[j]].output = std::move(outputImgs[j]);
+					slots[valid[j]].input = std::move(inputImgs[j]); // hand the allocation back to the slot
+				}
+			}
+			deviceCounters.busy += GetHostTime() - start;
+			deviceCounters.items += (int)batch.size();
+
+			done += batch.size();
+			cout << "[INFO] Batch of " << batch.size() << " images (" << done << " of " << filenames.size() << ") processed" << endl;
+			for (size_t slot : batch)
+				PushWait(processed, slot, deviceCounters, stop);
+		}
+		for (int t = 0; t < THREADS; t++)
+			PushWait(processed, END_OF_BATCHES, deviceCounters, stop);
+	}
+	catch (...) {
+		// Release the workers from any queue they are blocked on before the error propagates
+		stop = true;
+		for (thread& worker : workers)
+			worker.join();
+		throw;
+	}
+	for (thread& worker : workers)
+		worker.join();
+
+	long long pipelineEnd = GetHostTime();
+	profiler.AddHostSpan("pipelined batches", pipelineStart, pipelineEnd);
+	long long wall = pipelineEnd - pipelineStart;
+	const StageCounters* stages[] = { &decodeCounters, &deviceCounters, &encodeCounters };
+	const StageCounters* slowest = stages[0];
+	for (const StageCounters* stage : stages) {
+		cout << "[INFO] " << stage->Summary(wall) << endl;
+		if (stage->Utilisation(wall) > slowest->Utilisation(wall))
+			slowest = stage;
+	}
+	cout << "[INFO] " << filenames.size() * 1e9 / wall << " images/s, limited by " << slowest->name << endl;
+}
+
+#ifndef _WIN32
+// Whether slot requests run on one CL_MEM_USE_HOST_PTR buffer over the whole ring rather than a buffer per slot
+bool slots_use_ring_buffer(const cl::Device& device) {
+	return (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+}
+
+// Equalises images that clients placed in slots of their shared-memory rings, writing each result over
+// its input. On CPU devices the device works on one buffer over the whole ring, created with
+// CL_MEM_USE_HOST_PTR so the kernels read and write the shared pages themselves. On other devices each
+// slot is uploaded straight from the pages into a pooled buffer and read back into them, so the pixels are
+// never copied on the host. Slots in one batch are not contiguous, so every image gets its own launches of
+// the batched kernels with a single segment per channel. The launch overhead is small compared with the
+// large images this path is for.
+void perform_slot_op(const vector<shared_ptr<ServiceRequest>>& requests, DeviceSetup& setup, ProfilingReport& profiler) {
+	BufferPool& pool = setup.pool;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t LOCAL_SIZE = 256; // Work-group size along each segment
+	const size_t PIXELS_PER_ITEM = 16; // Pixels each work-item handles
+	bool hostMemory = slots_use_ring_buffer(setup.device);
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	// Offsets tables stay alive until the non-blocking writes complete, and the buffers stay acquired
+	vector<vector<int>> offsetTables(requests.size());
+	vector<cl::Buffer> acquired;
+
+	for (size_t i = 0; i < requests.size(); i++) {
+		ServiceRequest& request = *requests[i];
+		SharedRing& ring = *request.ring;
+		if (hostMemory && !ring.buffer())
+			ring.buffer = cl::Buffer(setup.context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, ring.Size(), ring.Data());
+
+		// One segment per channel plane of the slot, as offsets into the whole ring or into the slot's own buffer
+		size_t plane = (size_t)request.width * request.height;
+		size_t size = plane * request.spectrum;
+		size_t offset = hostMemory ? ring.Offset(request.slot) : 0;
+		cl::Buffer image = hostMemory ? ring.buffer : pool.Acquire(size);
+		if (!hostMemory)
+			acquired.push_back(image);
+		vector<int>& offsets = offsetTables[i];
+		for (uint32_t c = 0; c <= request.spectrum; c++)
+			offsets.push_back((int)(offset + c * plane));
+		size_t segments = request.spectrum;
+		const size_t HIST_SIZE = segments * BIN_SIZE * sizeof(int);
+
+		cl::Buffer offsetsBuffer = pool.Acquire(offsets.size() * sizeof(int));
+		cl::Buffer histBuffer = pool.Acquire(HIST_SIZE);
+		cl::Buffer lutBuffer = pool.Acquire(HIST_SIZE);
+		acquired.insert(acquired.end(), { offsetsBuffer, histBuffer, lutBuffer });
+
+		if (!hostMemory) {
+			queue.enqueueWriteBuffer(image, CL_FALSE, 0, size, ring.Slot(request.slot), NULL, &prof);
+			profiler.Add("Slot image write", prof, size);
+		}
+		else {
+			// The client rewrote the slot since the buffer was created, and an implementation may have
+			// cached the pages, so map for writing to make the new pixels visible to the kernels
+			void* mapped = queue.enqueueMapBuffer(image, CL_FALSE, CL_MAP_WRITE, offset, size, NULL, &prof);
+			profiler.Add("Slot input map", prof, size);
+			queue.enqueueUnmapMemObject(image, mapped, NULL, &prof);
+			profiler.Add("Slot input unmap", prof, size);
+		}
+		queue.enqueueWriteBuffer(offsetsBuffer, CL_FALSE, 0, offsets.size() * sizeof(int), &offsets[0], NULL, &prof);
+		profiler.Add("Slot offsets write", prof, offsets.size() * sizeof(int));
+		queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof);
+		profiler.Add("Slot histogram fill", prof, HIST_SIZE);
+
+		size_t groups = max((size_t)1, (plane + LOCAL_SIZE * PIXELS_PER_ITEM - 1) / (LOCAL_SIZE * PIXELS_PER_ITEM));
+		cl::NDRange pixelRange(groups * LOCAL_SIZE, segments);
+
+		cl::Kernel kernelHist(program, "histogram_batched");
+		kernelHist.setArg(0, image);
+		kernelHist.setArg(1, offsetsBuffer);
+		kernelHist.setArg(2, histBuffer);
+		kernelHist.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+		queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+		profiler.Add("Slot histogram kernel", prof, size);
+
+		cl::Kernel kernelScan(program, "scan_lut_batched");
+		kernelScan.setArg(0, histBuffer);
+		kernelScan.setArg(1, offsetsBuffer);
+		kernelScan.setArg(2, lutBuffer);
+		kernelScan.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+		kernelScan.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+		queue.enqueueNDRangeKernel(kernelScan, cl::NullRange, cl::NDRange(BIN_SIZE, segments), cl::NDRange(BIN_SIZE, 1), NULL, &prof);
+		profiler.Add("Slot scan kernel", prof, 2 * HIST_SIZE);
+
+		// Each work-item reads and then writes its own pixels, so the LUT is applied in place
+		cl::Kernel kernelLut(program, "lut_batched");
+		kernelLut.setArg(0, image);
+		kernelLut.setArg(1, image);
+		kernelLut.setArg(2, lutBuffer);
+		kernelLut.setArg(3, offsetsBuffer);
+		queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+		profiler.Add("Slot LUT kernel", prof, 2 * size);
+
+		if (!hostMemory) {
+			queue.enqueueReadBuffer(image, CL_FALSE, 0, size, ring.Slot(request.slot), NULL, &prof);
+			profiler.Add("Slot output read", prof, size);
+		}
+		else {
+			// Mapping makes the device's writes visible in the pages, a no-op where it used them directly
+			void* mapped = queue.enqueueMapBuffer(image, CL_FALSE, CL_MAP_READ, offset, size, NULL, &prof);
+			profiler.Add("Slot output map", prof, size);
+			queue.enqueueUnmapMemObject(image, mapped, NULL, &prof);
+			profiler.Add("Slot output unmap", prof, size);
+		}
+	}
+
+	// One wait for every slot, after which the buffers are free again
+	queue.finish();
+	for (cl::Buffer& buffer : acquired)
+		pool.Release(buffer);
+}
+#endif
+
+// Serves equalisation requests on a UNIX domain socket until a client asks it to shut down. The device is
+// set up and the kernels built once, then the requests of every client that arrive within the batching
+// window of each other are equalised together as one batch.
+void run_service(const string& socketPath, const Options& options, ProfilingReport& profiler) {
+#ifdef _WIN32
+	throw runtime_error("the equalisation service needs UNIX domain sockets and is not available on Windows");
+#else
+	const size_t BATCH_SIZE = 256; // Most requests packed into each batch
+
+	DeviceSetup setup = setup_device(options, profiler);
+	ResultCache cache(options.cacheBytes, options.cacheOutputs);
+	EqualisationService service(socketPath, setup.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(), slots_use_ring_buffer(setup.device));
+	cout << "[INFO] Listening on " << socketPath << endl;
+
+	long long window = (long long)(options.batchWindow * 1e6);
+	vector<shared_ptr<ServiceRequest>> batch;
+	for (size_t batches = 1; service.NextBatch(batch, window, BATCH_SIZE); batches++) {
+		// Images sent over the socket are packed into one batch, images in shared memory are done in place
+		vector<shared_ptr<ServiceRequest>> imageRequests, slotRequests;
+		vector<CImg<unsigned char>> inputImgs;
+		for (shared_ptr<ServiceRequest>& request : batch) {
+			if (request->ring) {
+				slotRequests.push_back(request);
+			}
+			else {
+				imageRequests.push_back(request);
+				inputImgs.push_back(std::move(request->image));
+			}
+		}
+
+		try {
+			if (!inputImgs.empty()) {
+				vector<CImg<unsigned char>> outputImgs = process_batch(inputImgs, setup, cache, options, profiler);
+				for (size_t i = 0; i < imageRequests.size(); i++)
+					imageRequests[i]->output = std::move(outputImgs[i]);
+			}
+		}
+		catch (const cl::Error& err) {
+			// Fail these requests and keep serving
+			for (shared_ptr<ServiceRequest>& request : imageRequests)
+				request->error = string(err.what()) + ", " + getErrorString(err.err());
+		}
+		try {
+			if (!slotRequests.empty())
+				perform_slot_op(slotRequests, setup, profiler);
+		}
+		catch (const cl::Error& err) {
+			for (shared_ptr<ServiceRequest>& request : slotRequests)
+				request->error = string(err.what()) + ", " + getErrorString(err.err());
+		}
+		for (shared_ptr<ServiceRequest>& request : batch)
+			request->done.set_value();
+
+		// The report would otherwise grow with every request for as long as the service runs
+		profiler.Clear();
+		if (batches % 100 == 0)
+			cout << "[INFO] " << service.Stats().Summary() << endl;
+	}
+
+	cout << "[INFO] " << service.Stats().Summary() << endl;
+	cout << "[INFO] " << setup.pool.Summary() << endl;
+	if (options.cacheBytes > 0)
+		cout << "[INFO] " << cache.Summary() << endl;
+#endif
+}
+
+// Equalises every image named in listFilename, BATCH_SIZE images per batch, and saves each result
+// under the same file name in outputDir when one is given
+void run_batch(const string& listFilename, const string& outputDir, const Options& options, ProfilingReport& profiler) {
+	const size_t BATCH_SIZE = 256; // Images packed into each batch
+
+	// Read the image list, skipping blank lines
+	vector<string> filenames;
+	ifstream list(listFilename);
+	if (!list)
+		throw runtime_error("could not open image list " + listFilename);
+	for (string line; getline(list, line);) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (!line.empty())
+			filenames.push_back(line);
+	}
+
+	DeviceSetup setup = setup_device(options, profiler);
+	ResultCache cache(options.cacheBytes, options.cacheOutputs);
+
+	if (options.hostThreads > 0) {
+		run_batch_pipelined(filenames, outputDir, setup, cache, options, profiler);
+	}
+	else {
+		for (size_t first = 0; first < filenames.size(); first += BATCH_SIZE) {
+			size_t last = min(filenames.size(), first + BATCH_SIZE);
+
+			// Images that cannot be decoded are reported and skipped, as in the pipelined path
+			vector<CImg<unsigned char>> inputImgs;
+			vector<size_t> indices; // position in the image list of each decoded image
+			{
+				ScopedHostSpan span(profiler, "batch decode");
+				for (size_t i = first; i < last; i++) {
+					try {
+						inputImgs.push_back(CImg<unsigned char>(filenames[i].c_str()));
+						indices.push_back(i);
+					}
+					catch (CImgException& err) {
+						cerr << "[ERROR] " << err.what() << endl;
+					}
+				}
+			}
+			if (inputImgs.empty())
+				continue;
+
+			vector<CImg<unsigned char>> outputImgs = process_batch(inputImgs, setup, cache, options, profiler);
+			cout << "[INFO] Batch of " << inputImgs.size() << " images (" << first + 1 << "-" << last << " of " << filenames.size() << ") processed" << endl;
+
+			if (!outputDir.empty()) {
+				ScopedHostSpan span(profiler, "batch encode");
+				for (size_t j = 0; j < indices.size(); j++) {
+					const string& filename = filenames[indices[j]];
+					string name = filename.substr(filename.find_last_of("/\\") + 1);
+					outputImgs[j].save((outputDir + "/" + name).c_str());
+				}
+			}
+		}
+	}
+
+	cout << profiler.Summary(ProfilingResolution::PROF_NS) << endl;
+	cout << "[INFO] " << setup.pool.Summary() << endl;
+	if (options.cacheBytes > 0)
+		cout << "[INFO] " << cache.Summary() << endl;
+}
+
+// Device state kept for one stream between frames
+struct StreamState {
+	cl::Buffer cdf; // smoothed normalised CDF of every plane
+	bool primed = false; // set once the first frame has initialised cdf
+	float alpha = 1.0f; // weight of the newest frame
+	// Incremental mode only
+	cl::Buffer tileHist; // histogram of every tile of every plane as of its last change
+	cl::Buffer changed; // flag per tile, set by tile_changes for the current frame
+	cl::Buffer changedCount; // changed tiles summed over all frames
+};
+
+// Equalises a frame sequence with temporal smoothing. Each frame is a fixed six commands (write, clear,
+// histogram, scan and blend, LUT, read) using the batched kernels with the planes of a frame as the
+// segments. Frames alternate between two sets of buffers and every transfer is non-blocking, so while
+// the device processes one frame the host writes out the previous one and decodes the next.
+// In incremental mode the histogram stays on the device instead of being cleared and rebuilt: the
+// previous frame is still in the other buffer set, so tile_changes compares the two and
+// tile_histogram_update recounts only the tiles that differ.
+void run_stream(const string& inputName, const string& outputName, const Options& options, ProfilingReport& profiler) {
+	unique_ptr<FrameSource> source = OpenFrameSource(inputName);
+	unique_ptr<FrameSink> sink;
+
+	// Select the device, create a profiling queue and build the kernels
+	DeviceSetup setup = setup_device(options, profiler);
+	cl::Context& context = setup.context;
+	cl::CommandQueue& queue = setup.queue;
+	cl::Program& program = setup.program;
+
+	const int BIN_SIZE = 256; // Hard-coded bin size of 256
+	const size_t LOCAL_SIZE = 256; // Work-group size along each plane
+	const size_t PIXELS_PER_ITEM = 16; // Pixels each work-item handles
+	const int TILE_SIZE = 32; // Width and height of the tiles tracked in incremental mode
+	cl::Event prof; // Generic CL Event, handed to the profiler after every enqueue
+
+	Frame frames[2]; // decoded frames, one per buffer set
+	vector<unsigned char> results[2]; // equalised planes read back for each buffer set
+	cl::Event readEvents[2];
+
+	long long streamStart = GetHostTime();
+	bool haveFrame;
+	{
+		ScopedHostSpan span(profiler, "frame decode", "io");
+		haveFrame = source->Read(frames[0]);
+	}
+	if (!haveFrame)
+		throw runtime_error("no frames found in " + inputName);
+
+	// Every frame must have the size of the first, which sizes the device buffers
+	int width = frames[0].width, height = frames[0].height, planes = frames[0].planes;
+	size_t planeSize = (size_t)width * height;
+	size_t frameSize = planeSize * planes;
+	const size_t HIST_SIZE = planes * BIN_SIZE * sizeof(int);
+
+	vector<int> offsets;
+	for (int p = 0; p <= planes; p++)
+		offsets.push_back((int)(p * planeSize));
+
+	cl::Buffer inputBuffers[2] = { cl::Buffer(context, CL_MEM_READ_ONLY, frameSize), cl::Buffer(context, CL_MEM_READ_ONLY, frameSize) };
+	cl::Buffer outputBuffers[2] = { cl::Buffer(context, CL_MEM_WRITE_ONLY, frameSize), cl::Buffer(context, CL_MEM_WRITE_ONLY, frameSize) };
+	cl::Buffer offsetsBuffer(context, CL_MEM_READ_ONLY, offsets.size() * sizeof(int));
+	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer lutBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+
+	StreamState state;
+	state.cdf = cl::Buffer(context, CL_MEM_READ_WRITE, planes * BIN_SIZE * sizeof(float));
+	state.alpha = options.streamAlpha;
+
+	queue.enqueueWriteBuffer(offsetsBuffer, CL_TRUE, 0, offsets.size() * sizeof(int), &offsets[0], NULL, &prof);
+	profiler.Add("Stream offsets write", prof, offsets.size() * sizeof(int));
+
+	size_t groupsPerPlane = max((size_t)1, (planeSize + LOCAL_SIZE * PIXELS_PER_ITEM - 1) / (LOCAL_SIZE * PIXELS_PER_ITEM));
+	cl::NDRange pixelRange(groupsPerPlane * LOCAL_SIZE, planes);
+
+	cl::Kernel kernelHist(program, "histogram_batched");
+	kernelHist.setArg(1, offsetsBuffer);
+	kernelHist.setArg(2, histBuffer);
+	kernelHist.setArg(3, cl::Local(BIN_SIZE * sizeof(int)));
+
+	// Incremental mode keeps the histogram between frames, so it is only cleared once
+	int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE, tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	size_t tiles = (size_t)tilesX * tilesY;
+	cl::Kernel kernelChanges, kernelTileUpdate;
+	if (options.incremental) {
+		size_t tileHistSize = planes * tiles * BIN_SIZE * sizeof(int);
+		state.tileHist = cl::Buffer(context, CL_MEM_READ_WRITE, tileHistSize);
+		state.changed = cl::Buffer(context, CL_MEM_READ_WRITE, planes * tiles * sizeof(int));
+		state.changedCount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+		queue.enqueueFillBuffer(state.tileHist, 0, 0, tileHistSize, NULL, &prof);
+		profiler.Add("Stream tile histogram fill", prof, tileHistSize);
+		queue.enqueueFillBuffer(state.changedCount, 0, 0, sizeof(int), NULL, &prof);
+		profiler.Add("Stream changed count fill", prof, sizeof(int));
+		queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof);
+		profiler.Add("Stream histogram fill", prof, HIST_SIZE);
+
+		kernelChanges = cl::Kernel(program, "tile_changes");
+		kernelChanges.setArg(2, state.changed);
+		kernelChanges.setArg(3, state.changedCount);
+		kernelChanges.setArg(4, width);
+		kernelChanges.setArg(5, height);
+		kernelChanges.setArg(6, TILE_SIZE);
+
+		kernelTileUpdate = cl::Kernel(program, "tile_histogram_update");
+		kernelTileUpdate.setArg(1, state.changed);
+		kernelTileUpdate.setArg(2, state.tileHist);
+		kernelTileUpdate.setArg(3, histBuffer);
+		kernelTileUpdate.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+		kernelTileUpdate.setArg(5, width);
+		kernelTileUpdate.setArg(6, height);
+		kernelTileUpdate.setArg(7, TILE_SIZE);
+	}
+	cl::NDRange tileRange(tiles * LOCAL_SIZE, planes);
+
+	cl::Kernel kernelScan(program, "scan_blend_batched");
+	kernelScan.setArg(0, histBuffer);
+	kernelScan.setArg(1, offsetsBuffer);
+	kernelScan.setArg(2, state.cdf);
+	kernelScan.setArg(3, lutBuffer);
+	kernelScan.setArg(4, cl::Local(BIN_SIZE * sizeof(int)));
+	kernelScan.setArg(5, cl::Local(BIN_SIZE * sizeof(int)));
+	kernelScan.setArg(6, state.alpha);
+
+	cl::Kernel kernelLut(program, "lut_batched");
+	kernelLut.setArg(2, lutBuffer);
+	kernelLut.setArg(3, offsetsBuffer);
+
+	if (!outputName.empty())
+		sink = OpenFrameSink(outputName, *source);
+
+	// Waits for a frame's result and writes it out
+	auto finishFrame = [&](int slot) {
+		readEvents[slot].wait();
+		if (sink) {
+			ScopedHostSpan span(profiler, "frame encode", "io");
+			sink->Write(frames[slot], results[slot]);
+		}
+	};
+
+	int frameCount = 0;
+	while (haveFrame) {
+		int slot = frameCount % 2;
+		Frame& frame = frames[slot];
+		if (frame.width != width || frame.height != height || frame.planes != planes)
+			throw runtime_error("frame " + to_string(frame.index) + " does not match the size of the first frame");
+		string stage = "Frame " + to_string(frame.index);
+
+		queue.enqueueWriteBuffer(inputBuffers[slot], CL_FALSE, 0, frameSize, &frame.pixels[0], NULL, &prof);
+		profiler.Add(stage + " write", prof, frameSize);
+
+		if (options.incremental) {
+			// Compare against the previous frame, still in the other buffer set
+			kernelChanges.setArg(0, inputBuffers[slot]);
+			kernelChanges.setArg(1, inputBuffers[1 - slot]);
+			kernelChanges.setArg(7, frameCount == 0 ? 1 : 0);
+			queue.enqueueNDRangeKernel(kernelChanges, cl::NullRange, tileRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+			profiler.Add(stage + " tile change kernel", prof, 2 * frameSize);
+
+			kernelTileUpdate.setArg(0, inputBuffers[slot]);
+			queue.enqueueNDRangeKernel(kernelTileUpdate, cl::NullRange, tileRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+			profiler.Add(stage + " tile histogram kernel", prof, planes * tiles * sizeof(int));
+		}
+		else {
+			queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof);
+			profiler.Add(stage + " histogram fill", prof, HIST_SIZE);
+
+			kernelHist.setArg(0, inputBuffers[slot]);
+			queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+			profiler.Add(stage + " histogram kernel", prof, frameSize);
+		}
+
+		kernelScan.setArg(7, state.primed ? 0 : 1);
+		queue.enqueueNDRangeKernel(kernelScan, cl::NullRange, cl::NDRange(BIN_SIZE, planes), cl::NDRange(BIN_SIZE, 1), NULL, &prof);
+		profiler.Add(stage + " scan and blend kernel", prof, 3 * HIST_SIZE);
+		state.primed = true;
+
+		kernelLut.setArg(0, inputBuffers[slot]);
+		kernelLut.setArg(1, outputBuffers[slot]);
+		queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+		profiler.Add(stage + " LUT kernel", prof, 2 * frameSize);
+
+		results[slot].resize(frameSize);
+		queue.enqueueReadBuffer(outputBuffers[slot], CL_FALSE, 0, frameSize, &results[slot][0], NULL, &readEvents[slot]);
+		profiler.Add(stage + " read", readEvents[slot], frameSize);
+		queue.flush();
+
+		// While the device works on this frame, write out the previous one and decode the next into its
+		// buffer set, which is free again once the previous frame's read has completed
+		if (frameCount > 0)
+			finishFrame(1 - slot);
+		{
+			ScopedHostSpan span(profiler, "frame decode", "io");
+			haveFrame = source->Read(frames[1 - slot]);
+		}
+		frameCount++;
+	}
+	finishFrame((frameCount - 1) % 2);
+
+	double seconds = (GetHostTime() - streamStart) / 1e9;
+	cout << "[INFO] " << frameCount << " frames of " << width << "x" << height << " in " << seconds << " s, " << frameCount / seconds << " frames/s" << endl;
+
+	if (options.incremental) {
+		int changedTiles = 0;
+		queue.enqueueReadBuffer(state.changedCount, CL_TRUE, 0, sizeof(int), &changedTiles, NULL, &prof);
+		profiler.Add("Stream changed count read", prof, sizeof(int));
+		cout << "[INFO] " << 100.0 * changedTiles / ((double)frameCount * planes * tiles) << "% of " << TILE_SIZE << "x" << TILE_SIZE << " tiles recounted" << endl;
+	}
+}
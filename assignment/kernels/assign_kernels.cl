@@ -1,3 +1,27 @@
+// Values the host can fix when it builds the program, with -D options such as -DCHANNEL=1. Without
+// them the kernels read the value from their buffer argument or work it out per work-item, as before:
+//   CHANNEL     the colour channel histogram_rgb counts, otherwise read from its channel buffer
+//   IMAGE_SIZE  pixels per channel plane for histogram_rgb and lut_rgb, otherwise the global size / 3
+//   SCALE       normalisation factor of norm_bins (255 / pixel count), otherwise read from its buffer
+// The bin count needs no option, every kernel already has it as the literal 256.
+#ifdef CHANNEL
+#define SELECTED_CHANNEL(channel) CHANNEL
+#else
+#define SELECTED_CHANNEL(channel) (*(channel))
+#endif
+
+#ifdef IMAGE_SIZE
+#define PLANE_SIZE IMAGE_SIZE
+#else
+#define PLANE_SIZE (get_global_size(0) / 3)
+#endif
+
+#ifdef SCALE
+#define NORM_SCALE(C) SCALE
+#else
+#define NORM_SCALE(C) (*(C))
+#endif
+
 // Take A as a bin value and place it into a histogram bin
 kernel void histogram(global const uchar* A, global int* H) {
 	// Assumes that H has been initialised to 0 from writing buffer with 0's
@@ -12,17 +36,60 @@ kernel void norm_bins(global const int* A, global int* B, global const float* C)
 	int id = get_global_id(0);
 
 	// Return the normalised value in buffer B, using the pixel count in pointer C
-	B[id] = A[id] * *C;
+	B[id] = A[id] * NORM_SCALE(C);
+}
+
+// Same as norm_bins, but the normalisation factor is passed by value so no buffer write is needed
+kernel void norm_bins_arg(global const int* A, global int* B, float scale) {
+	int id = get_global_id(0);
+
+	B[id] = A[id] * scale;
+}
+
+// Work-group privatised histogram of N pixels. Each work-group counts into sub_histograms copies
+// of the histogram in local memory (work-items are spread over the copies to reduce contention on
+// popular bins), then merges them into the global histogram H with a single atomic per bin.
+// LH must hold 256 * sub_histograms ints, and each work-item handles pixels_per_item pixels.
+kernel void histogram_local(global const uchar* A, global int* H, local int* LH, int N, int pixels_per_item, int sub_histograms) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+
+	// Clear every local copy of the histogram
+	for (int i = lid; i < 256 * sub_histograms; i += local_size)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Pixels are strided by the work-group size so neighbouring work-items read neighbouring pixels
+	local int* sub_hist = LH + (lid % sub_histograms) * 256;
+	int base = get_group_id(0) * local_size * pixels_per_item + lid;
+	for (int i = 0; i < pixels_per_item; i++) {
+		int id = base + i * local_size;
+		if (id < N)
+			atomic_inc(&sub_hist[A[id]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Merge the local copies into the global histogram
+	for (int bin = lid; bin < 256; bin += local_size) {
+		int sum = 0;
+		for (int s = 0; s < sub_histograms; s++)
+			sum += LH[s * 256 + bin];
+		if (sum)
+			atomic_add(&H[bin], sum);
+	}
 }
 
 // Take A as a bin value and place it into a histogram bin
 kernel void histogram_rgb(global const uchar* A, global int* H, global int* channel) {
 	int id = get_global_id(0);
-	int image_size = get_global_size(0) / 3; // Each image consists of 3 colour channels
+	int image_size = PLANE_SIZE; // Each image consists of 3 colour channels
 	int colour_channel = id / image_size; // 0 - red, 1 - green, 2 - blue
 
-	// Performed in a series of maps, increment depending on the channel currently being executed
-	if (colour_channel == *channel) {
+	// Performed in a series of maps, increment depending on the channel currently being executed. With
+	// CHANNEL and IMAGE_SIZE built in the host can also launch over just the channel's plane, with a global offset
+	if (colour_channel == SELECTED_CHANNEL(channel)) {
 		atomic_inc(&H[A[id]]);
 	}
 }
@@ -30,7 +97,7 @@ kernel void histogram_rgb(global const uchar* A, global int* H, global int* chan
 // Look up table for each pixel of Red, Green, and Blue
 kernel void lut_rgb(global uchar* A, global uchar* O, global int* R, global int* G, global int* B) {
 	int id = get_global_id(0);
-	int image_size = get_global_size(0) / 3; // Each image consists of 3 colour channels
+	int image_size = PLANE_SIZE; // Each image consists of 3 colour channels
 	int colour_channel = id / image_size; // 0 - red, 1 - green, 2 - blue
 
 	if (colour_channel == 0) {
@@ -55,10 +122,12 @@ kernel void scan_add_atomic(global int* A, global int* B) {
 
 //Hillis-Steele basic inclusive scan
 //requires additional buffer B to avoid data overwrite 
+//must run as a single work-group as the barrier only syncs work-items within a group
 kernel void scan_hs(global int* A, global int* B) {
 	int id = get_global_id(0);
 	int N = get_global_size(0);
 	global int* C;
+	global int* output = B;
 
 	for (int stride = 1; stride < N; stride *= 2) {
 		B[id] = A[id];
@@ -69,6 +138,10 @@ kernel void scan_hs(global int* A, global int* B) {
 
 		C = A; A = B; B = C; //swap A & B between steps
 	}
+
+	//after an even number of steps the result ends up back in the input buffer
+	if (A != output)
+		output[id] = A[id];
 }
 
 
@@ -110,4 +183,554 @@ kernel void lut(global uchar* A, global uchar* B, global int* C) {
 	
 	// A[id] is our bin greyscale value from 0-255
 	B[id] = C[A[id]];
-}
\ No newline at end of file
+}
+
+// Atomic-free histogram, stage 1 of 2. Each work-item owns one column of a 256 x local_size table
+// in local memory and counts its pixels into it, so no two work-items share a counter and, as the
+// column index is the local id, bank access is conflict-free whatever the pixel values are. The
+// columns are then merged with a tree reduction and each work-group writes its histogram to
+// partial[group * 256 + bin]. LH must hold 256 * local_size ints and local_size must be a power of two.
+kernel void histogram_private(global const uchar* A, global int* partial, local int* LH, int N, int pixels_per_item) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int group = get_group_id(0);
+
+	// Each work-item only touches its own column until the reduction, so no barrier is needed yet
+	for (int bin = 0; bin < 256; bin++)
+		LH[bin * local_size + lid] = 0;
+
+	int base = group * local_size * pixels_per_item + lid;
+	for (int i = 0; i < pixels_per_item; i++) {
+		int id = base + i * local_size;
+		if (id < N)
+			LH[A[id] * local_size + lid]++;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Tree reduction across the columns, for all 256 bins at once
+	for (int stride = local_size / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			for (int bin = 0; bin < 256; bin++)
+				LH[bin * local_size + lid] += LH[bin * local_size + lid + stride];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	for (int bin = lid; bin < 256; bin += local_size)
+		partial[group * 256 + bin] = LH[bin * local_size];
+}
+
+// Atomic-free histogram, stage 2 of 2. One work-group per bin sums that bin over the partial
+// histograms of all groups with a tree reduction in local memory, always in the same order, so the
+// result is deterministic. Writes H directly, so H does not need clearing first.
+kernel void histogram_reduce(global const int* partial, global int* H, local int* scratch, int groups) {
+	int bin = get_group_id(0);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+
+	int sum = 0;
+	for (int g = lid; g < groups; g += local_size)
+		sum += partial[g * 256 + bin];
+	scratch[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = local_size / 2; stride > 0; stride /= 2) {
+		if (lid < stride)
+			scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0)
+		H[bin] = scratch[0];
+}
+
+// Look-up table applied to N pixels, with each work-item handling pixels_per_item pixels strided
+// by the global size so that consecutive work-items still access consecutive pixels
+kernel void lut_multi(global const uchar* A, global uchar* B, global const int* C, int N, int pixels_per_item) {
+	int id = get_global_id(0);
+	int stride = get_global_size(0);
+
+	for (int i = 0; i < pixels_per_item; i++) {
+		int index = id + i * stride;
+		if (index < N)
+			B[index] = C[A[index]];
+	}
+}
+
+// Batched histogram for many small images packed back to back in A. Image i occupies
+// A[offsets[i]] to A[offsets[i + 1] - 1], and dimension 1 of the NDRange selects the image, so every
+// image in the batch is counted by a single launch. The work-groups along dimension 0 split the
+// image between them, count into a local histogram and merge it into H[image * 256 + bin].
+// H must be cleared first.
+kernel void histogram_batched(global const uchar* A, global const int* offsets, global int* H, local int* LH) {
+	int image = get_global_id(1);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+
+	// Clear the local histogram
+	for (int bin = lid; bin < 256; bin += local_size)
+		LH[bin] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Stride over this image's segment, images smaller than the NDRange leave some work-items idle
+	int end = offsets[image + 1];
+	for (int id = offsets[image] + get_global_id(0); id < end; id += get_global_size(0))
+		atomic_inc(&LH[A[id]]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = lid; bin < 256; bin += local_size) {
+		if (LH[bin] != 0)
+			atomic_add(&H[image * 256 + bin], LH[bin]);
+	}
+}
+
+// Inclusive Hillis-Steele scan of the 256 bins of one segment of H in local memory, called by every
+// work-item of a 256 work-item group. Returns the cumulative count of the work-item's bin.
+int scan_segment(global const int* H, int segment, local int* scratch_1, local int* scratch_2) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	local int* scratch_3; // used for buffer swap
+
+	scratch_1[lid] = H[segment * N + lid];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = 1; stride < N; stride *= 2) {
+		if (lid >= stride)
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - stride];
+		else
+			scratch_2[lid] = scratch_1[lid];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// Buffer swap
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+
+	return scratch_1[lid];
+}
+
+// Segmented scan and LUT build for a batch of histograms. One work-group of 256 work-items per
+// image scans that image's 256 bins, then normalises the cumulative histogram by the image's own
+// pixel count, so L[image * 256 + bin] is ready to apply.
+kernel void scan_lut_batched(global const int* H, global const int* offsets, global int* L, local int* scratch_1, local int* scratch_2) {
+	int image = get_group_id(1);
+	int cumulative = scan_segment(H, image, scratch_1, scratch_2);
+
+	// Same normalisation as norm_bins, 255 / pixel count of this image
+	float scale = (float)255 / (float)(offsets[image + 1] - offsets[image]);
+	L[image * 256 + get_local_id(0)] = cumulative * scale;
+}
+
+// Streaming version of scan_lut_batched with temporal smoothing. state holds each segment's
+// normalised CDF from the previous frame and stays on the device between frames, the new CDF is
+// blended into it with weight alpha (first is set for the first frame, which only initialises
+// state) and the blended CDF becomes the LUT, so the mapping cannot jump between frames.
+kernel void scan_blend_batched(global const int* H, global const int* offsets, global float* state, global int* L, local int* scratch_1, local int* scratch_2, float alpha, int first) {
+	int image = get_group_id(1);
+	int index = image * 256 + get_local_id(0);
+	int cumulative = scan_segment(H, image, scratch_1, scratch_2);
+
+	float cdf = (float)cumulative / (float)(offsets[image + 1] - offsets[image]);
+	float blended = first ? cdf : alpha * cdf + (1.0f - alpha) * state[index];
+
+	state[index] = blended;
+	L[index] = blended * 255;
+}
+
+// Applies each image's own look-up table to its segment of the packed batch
+kernel void lut_batched(global const uchar* A, global uchar* B, global const int* L, global const int* offsets) {
+	int image = get_global_id(1);
+	global const int* C = L + image * 256;
+
+	int end = offsets[image + 1];
+	for (int id = offsets[image] + get_global_id(0); id < end; id += get_global_size(0))
+		B[id] = C[A[id]];
+}
+
+// Histogram specification: maps each source value v to the smallest reference value z whose
+// normalised cumulative count reaches that of v, i.e. the inverse of the reference CDF applied to
+// the source CDF. Both CDFs are inclusive scans of raw counts, so the comparison is done in 64-bit
+// integers scaled by the other image's pixel count rather than in floats. One work-item per bin.
+kernel void match_cdf(global const int* src_cdf, global const int* ref_cdf, global int* lut, int src_pixels, int ref_pixels) {
+	int v = get_global_id(0);
+	long target = (long)src_cdf[v] * ref_pixels;
+
+	// Binary search over the 256 reference bins, the last one always reaches the target
+	int lo = 0, hi = 255;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if ((long)ref_cdf[mid] * src_pixels >= target)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	lut[v] = lo;
+}
+
+// Change detection for incremental histograms. One work-group per tile_size x tile_size tile of
+// one plane (dimension 1 selects the plane) compares the tile between the current frame A and the
+// previous frame P and sets changed[plane * tiles + tile]. changed_count accumulates the number of
+// changed tiles over every frame. first marks every tile as changed so the first frame fills the
+// tile histograms.
+kernel void tile_changes(global const uchar* A, global const uchar* P, global int* changed, global int* changed_count, int width, int height, int tile_size, int first) {
+	int tile = get_group_id(0);
+	int plane = get_group_id(1);
+	int tiles = get_num_groups(0);
+	int lid = get_local_id(0);
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int x0 = (tile % tiles_x) * tile_size;
+	int y0 = (tile / tiles_x) * tile_size;
+	global const uchar* a = A + plane * width * height;
+	global const uchar* p = P + plane * width * height;
+	local int differs;
+
+	if (lid == 0)
+		differs = first;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Every work-item that finds a difference stores the same value, so the race is harmless
+	for (int i = lid; i < tile_size * tile_size; i += get_local_size(0)) {
+		int x = x0 + i % tile_size, y = y0 + i / tile_size;
+		if (x < width && y < height && a[y * width + x] != p[y * width + x])
+			differs = 1;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) {
+		changed[plane * tiles + tile] = differs;
+		if (differs)
+			atomic_inc(changed_count);
+	}
+}
+
+// Incremental histogram update, launched like tile_changes. Tiles that have not changed return
+// straight away, a changed tile is counted into local memory and the difference from its previous
+// histogram in tile_hist is added to the plane's histogram H, so the cost scales with the changed
+// area. tile_hist and H persist between frames and must start cleared.
+kernel void tile_histogram_update(global const uchar* A, global const int* changed, global int* tile_hist, global int* H, local int* LH, int width, int height, int tile_size) {
+	int tile = get_group_id(0);
+	int plane = get_group_id(1);
+	int tiles = get_num_groups(0);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+
+	// The whole work-group takes the same branch, so returning before the barriers is safe
+	if (!changed[plane * tiles + tile])
+		return;
+
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int x0 = (tile % tiles_x) * tile_size;
+	int y0 = (tile / tiles_x) * tile_size;
+	global const uchar* a = A + plane * width * height;
+
+	for (int bin = lid; bin < 256; bin += local_size)
+		LH[bin] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < tile_size * tile_size; i += local_size) {
+		int x = x0 + i % tile_size, y = y0 + i / tile_size;
+		if (x < width && y < height)
+			atomic_inc(&LH[a[y * width + x]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Subtract the tile's old contribution and add its new one
+	global int* old_hist = tile_hist + (plane * tiles + tile) * 256;
+	for (int bin = lid; bin < 256; bin += local_size) {
+		int delta = LH[bin] - old_hist[bin];
+		if (delta != 0) {
+			atomic_add(&H[plane * 256 + bin], delta);
+			old_hist[bin] = LH[bin];
+		}
+	}
+}
+
+// Approximate histogram of the N pixels starting at A[offset] from a stratified sample. The pixels
+// are split into strata of stride consecutive pixels (the last may be shorter) and one work-item
+// per stratum counts a single pixel at a hashed position within it, so the sample covers the whole
+// image evenly without the aliasing a fixed stride would have on regular patterns. The histogram
+// holds ceil(N / stride) samples, merged into H through a local histogram. H must be cleared first.
+kernel void histogram_sampled(global const uchar* A, global int* H, local int* LH, int offset, int N, int stride, uint seed) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int stratum = get_global_id(0);
+	int start = stratum * stride;
+
+	for (int bin = lid; bin < 256; bin += local_size)
+		LH[bin] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (start < N) {
+		// Integer hash of the stratum index picks the sample position
+		uint h = ((uint)stratum * 2654435761u) ^ seed;
+		h ^= h >> 16;
+		h *= 0x45d9f3bu;
+		h ^= h >> 16;
+		atomic_inc(&LH[A[offset + start + h % min(stride, N - start)]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = lid; bin < 256; bin += local_size) {
+		if (LH[bin] != 0)
+			atomic_add(&H[bin], LH[bin]);
+	}
+}
+
+// Composes two look-up tables on the device, B = C applied after A, so a LUT built on the device
+// can have further point operations folded into it without another pass over the image
+kernel void compose_lut(global const int* A, global int* B, global const int* C) {
+	int id = get_global_id(0);
+
+	B[id] = C[clamp(A[id], 0, 255)];
+}
+
+// Adds value to a 64-bit counter held as two 32-bit words, low word first, with 32-bit atomics
+// only. Each addition that wraps the low word carries exactly once into the high word.
+void atomic_add_wide(global uint* counter, uint value) {
+	uint old = atomic_add(&counter[0], value);
+	if (old + value < old)
+		atomic_inc(&counter[1]);
+}
+
+// Histogram plus min, max, sum and sum of squares of every channel in a single pass over the
+// image. Dimension 1 selects the channel (a plane of N pixels), dimension 0 strides over the
+// plane and must be sized so no work-item reads more than 16 pixels, which keeps the 32-bit
+// per-work-group sums from overflowing. Each work-group reduces into local memory and merges once
+// into H[channel * 256 + bin] and the 6 words per channel of S: min, max, then sum and sum of
+// squares as 64-bit low/high word pairs. H must be cleared and S set to {255, 0, 0, 0, 0, 0}.
+kernel void histogram_stats(global const uchar* A, global int* H, global uint* S, local int* LH, int N) {
+	int channel = get_global_id(1);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	global const uchar* a = A + channel * N;
+	local uint group_min, group_max, group_sum, group_sum_squares;
+
+	for (int bin = lid; bin < 256; bin += local_size)
+		LH[bin] = 0;
+	if (lid == 0) {
+		group_min = 255;
+		group_max = 0;
+		group_sum = 0;
+		group_sum_squares = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Each work-item keeps its own statistics in registers
+	uint item_min = 255, item_max = 0, item_sum = 0, item_sum_squares = 0;
+	for (int id = get_global_id(0); id < N; id += get_global_size(0)) {
+		uint value = a[id];
+		atomic_inc(&LH[value]);
+		item_min = min(item_min, value);
+		item_max = max(item_max, value);
+		item_sum += value;
+		item_sum_squares += value * value;
+	}
+
+	atomic_min(&group_min, item_min);
+	atomic_max(&group_max, item_max);
+	atomic_add(&group_sum, item_sum);
+	atomic_add(&group_sum_squares, item_sum_squares);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = lid; bin < 256; bin += local_size) {
+		if (LH[bin] != 0)
+			atomic_add(&H[channel * 256 + bin], LH[bin]);
+	}
+
+	if (lid == 0) {
+		global uint* stats = S + channel * 6;
+		atomic_min(&stats[0], group_min);
+		atomic_max(&stats[1], group_max);
+		atomic_add_wide(&stats[2], group_sum);
+		atomic_add_wide(&stats[4], group_sum_squares);
+	}
+}
+
+// Tree reduction to the highest score in local memory, ties going to the lower index, leaving the
+// winner in element 0. Must be called by every work-item of a power-of-two sized work-group after
+// a barrier.
+void argmax_local(local float* score, local int* index) {
+	int lid = get_local_id(0);
+
+	for (int stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+		if (lid < stride) {
+			float other = score[lid + stride];
+			int other_index = index[lid + stride];
+			if (other > score[lid] || (other == score[lid] && other_index < index[lid])) {
+				score[lid] = other;
+				index[lid] = other_index;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+// Prefix sums of a 256 bin histogram for Otsu thresholding, one work-group of 256: P[t] is the
+// number of pixels with value <= t and S[t] the sum of those values, in 64-bit as it can exceed
+// the range of an int on large images
+kernel void otsu_prefix(global const int* H, global int* P, global long* S, local int* count_1, local int* count_2, local long* sum_1, local long* sum_2) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	local int* count_3; // used for buffer swap
+	local long* sum_3;
+
+	count_1[lid] = H[lid];
+	sum_1[lid] = (long)lid * H[lid];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Hillis-Steele scan of both arrays at once
+	for (int stride = 1; stride < N; stride *= 2) {
+		count_2[lid] = count_1[lid];
+		sum_2[lid] = sum_1[lid];
+		if (lid >= stride) {
+			count_2[lid] += count_1[lid - stride];
+			sum_2[lid] += sum_1[lid - stride];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// Buffer swap
+		count_3 = count_2; count_2 = count_1; count_1 = count_3;
+		sum_3 = sum_2; sum_2 = sum_1; sum_1 = sum_3;
+	}
+
+	P[lid] = count_1[lid];
+	S[lid] = sum_1[lid];
+}
+
+// Single-level Otsu, one work-group of 256. Work-item t evaluates the between-class variance of
+// splitting at t (values <= t against values > t) from the prefix sums, and the best split is
+// found with an argmax reduction and written to thresholds[0].
+kernel void otsu_single(global const int* P, global const long* S, global int* thresholds, local float* score, local int* index) {
+	int t = get_local_id(0);
+	float total = P[255];
+	float w0 = P[t];
+	float w1 = total - w0;
+
+	score[t] = -1.0f;
+	index[t] = t;
+	if (w0 > 0.0f && w1 > 0.0f) {
+		float m0 = S[t] / w0;
+		float m1 = (S[255] - S[t]) / w1;
+		score[t] = (w0 / total) * (w1 / total) * (m0 - m1) * (m0 - m1);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	argmax_local(score, index);
+
+	if (t == 0)
+		thresholds[0] = index[0];
+}
+
+// Two-level Otsu, stage 1 of 2. Every pair t1 < t2 is evaluated in parallel on a 256 x 256 range:
+// work-group t1 (dimension 1) tries every t2 as a work-item and writes its best pair to
+// partial_score[t1] and partial_index[t1] (as t1 * 256 + t2). The classes are values <= t1, values
+// in (t1, t2] and values > t2, and the score sum(w * m^2) ranks splits the same way as the
+// between-class variance.
+kernel void otsu_pair(global const int* P, global const long* S, global float* partial_score, global int* partial_index, local float* score, local int* index) {
+	int t1 = get_group_id(1);
+	int t2 = get_local_id(0);
+	float total = P[255];
+
+	score[t2] = -1.0f;
+	index[t2] = t1 * 256 + t2;
+	if (t1 < t2) {
+		float w0 = P[t1], w1 = P[t2] - P[t1], w2 = total - P[t2];
+		if (w0 > 0.0f && w1 > 0.0f && w2 > 0.0f) {
+			float m0 = S[t1] / w0;
+			float m1 = (S[t2] - S[t1]) / w1;
+			float m2 = (S[255] - S[t2]) / w2;
+			score[t2] = (w0 * m0 * m0 + w1 * m1 * m1 + w2 * m2 * m2) / total;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	argmax_local(score, index);
+
+	if (t2 == 0) {
+		partial_score[t1] = score[0];
+		partial_index[t1] = index[0];
+	}
+}
+
+// Two-level Otsu, stage 2 of 2. One work-group of 256 picks the best of the per-t1 results and
+// writes the pair to thresholds[0] and thresholds[1].
+kernel void otsu_select(global const float* partial_score, global const int* partial_index, global int* thresholds, local float* score, local int* index) {
+	int lid = get_local_id(0);
+
+	score[lid] = partial_score[lid];
+	index[lid] = partial_index[lid];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	argmax_local(score, index);
+
+	if (lid == 0) {
+		thresholds[0] = index[0] / 256;
+		thresholds[1] = index[0] % 256;
+	}
+}
+
+// Look-up table that quantises values into the classes separated by levels ascending thresholds,
+// spread evenly over 0-255, so one threshold binarises the image
+kernel void threshold_lut(global const int* thresholds, int levels, global int* lut) {
+	int v = get_global_id(0);
+	int level = 0;
+
+	for (int i = 0; i < levels; i++) {
+		if (v > thresholds[i])
+			level++;
+	}
+
+	lut[v] = level * 255 / levels;
+}
+
+// Binary search for the smallest bin whose cumulative count reaches target
+int cdf_search(global const int* cdf, float target) {
+	int lo = 0, hi = 255;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (cdf[mid] >= target)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+// Robust contrast stretch from a cumulative histogram (the output of scan_hs), one work-item per
+// bin. The bins at the low and high percentiles are found by binary search, written to bounds, and
+// values between them are mapped linearly onto 0-255 with everything outside clipped, so a few
+// outlying pixels cannot stretch or compress the whole range the way min/max would.
+kernel void percentile_lut(global const int* cdf, global int* lut, global int* bounds, float low_percentile, float high_percentile) {
+	int v = get_global_id(0);
+	float total = cdf[255];
+	int low = cdf_search(cdf, total * low_percentile / 100.0f);
+	int high = cdf_search(cdf, total * high_percentile / 100.0f);
+
+	if (v == 0) {
+		bounds[0] = low;
+		bounds[1] = high;
+	}
+
+	lut[v] = high > low ? clamp((v - low) * 255 / (high - low), 0, 255) : v;
+}
@@ -0,0 +1,530 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <map>
+
+#include "Utils.h"
+#include "Synthetic.h"
+#include "Variants.h"
+#include "ChannelPipeline.h"
+
+using namespace cimg_library;
+using namespace std;
+
+/*
+	Benchmark harness for the histogram equalisation kernels
+	--------------------------------------------------------
+	Generates synthetic greyscale and RGB images in memory for a range of sizes and pixel value
+	distributions, then runs every kernel from assign_kernels.cl on each of them. Greyscale stages
+	are run through the variant registry, once for every candidate parameter set of each variant.
+	Each kernel is run a number of warm-up iterations before being timed over N repetitions with
+	OpenCL profiling events, and the min/median/p95/max execution time and pixel throughput are reported.
+
+	With -c only the histogram variants are run, and a summary compares how much their cost moves with
+	the pixel distribution: the atomic kernels slow down on the single-value (contention-heavy) images
+	while histogram_private should cost the same on every distribution.
+
+	With -g the colour pipeline is timed end to end instead, from the first command to the last, with the
+	channels issued one after another, to one in-order queue each, to an out-of-order queue, and through the
+	fused-channel batched kernels that handle every channel in one launch per stage.
+
+	With -z histogram_rgb, norm_bins and lut_rgb from the generic program are compared with the same kernels
+	from a program built for each image size with the channel, plane size and scale as -D constants, and
+	with the specialised histogram launched over its channel's plane only.
+*/
+
+// Returns console information about different flags that can be passed to the function
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -w : warm-up iterations per kernel (default: 3)" << std::endl;
+	std::cerr << "  -n : timed repetitions per kernel (default: 10)" << std::endl;
+	std::cerr << "  -s : largest image side to generate (default: 16384)" << std::endl;
+	std::cerr << "  -r : write every timed command to a profiling report (.json or .csv)" << std::endl;
+	std::cerr << "  -c : only compare histogram variants across pixel distributions" << std::endl;
+	std::cerr << "  -g : only compare concurrent per-channel colour execution with the fused-channel kernels" << std::endl;
+	std::cerr << "  -z : only compare the colour kernels with builds specialised through -D constants" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+const int BIN_SIZE = 256; // Hard-coded bin size of 256
+const size_t HIST_SIZE = BIN_SIZE * sizeof(int);
+
+// Device buffers shared by every kernel run on one synthetic image
+struct BenchBuffers {
+	StageBuffers stage; // buffers of the greyscale pipeline stages
+	cl::Buffer channel;
+	cl::Buffer rLut, gLut, bLut;
+};
+
+// One kernel to benchmark: prepare() runs untimed before each launch, launch() enqueues the timed kernel
+struct BenchVariant {
+	string name;
+	string kernel;
+	bool colour;    // runs on RGB images, otherwise on greyscale images
+	bool perPixel;  // work scales with the image, so throughput is reported in MP/s
+	bool histogram; // default parameters of a histogram variant, part of the contention comparison
+	function<void(cl::CommandQueue&, BenchBuffers&)> prepare;
+	function<void(cl::CommandQueue&, cl::Kernel&, BenchBuffers&, vector<cl::Event>*)> launch;
+};
+
+// Execution time statistics over the timed repetitions [ns]
+struct BenchStats {
+	double min, median, p95, max;
+	double mean, stddev;
+};
+
+BenchStats GetBenchStats(vector<cl_ulong> times) {
+	sort(times.begin(), times.end());
+	size_t n = times.size();
+	BenchStats stats;
+	stats.min = (double)times.front();
+	stats.max = (double)times.back();
+	stats.median = (n % 2) ? (double)times[n / 2] : 0.5 * (times[n / 2 - 1] + times[n / 2]);
+	stats.p95 = (double)times[(size_t)ceil(0.95 * n) - 1];
+
+	double sum = 0.0, sumSquares = 0.0;
+	for (cl_ulong time : times) {
+		sum += (double)time;
+		sumSquares += (double)time * (double)time;
+	}
+	stats.mean = sum / n;
+	stats.stddev = sqrt(max(0.0, sumSquares / n - stats.mean * stats.mean));
+	return stats;
+}
+
+vector<BenchVariant> GetBenchVariants(const VariantRegistry& registry) {
+	vector<BenchVariant> variants;
+
+	// Every variant of every greyscale stage, with each of its candidate parameter sets
+	for (const KernelVariant& variant : registry.All()) {
+		for (const VariantParams& params : variant.candidates) {
+			const KernelVariant* v = &variant;
+			variants.push_back({ variant.name + "[" + FormatVariantParams(params) + "]", variant.kernel, false,
+				variant.stage == STAGE_HISTOGRAM || variant.stage == STAGE_APPLY,
+				variant.stage == STAGE_HISTOGRAM && &params == &variant.candidates.front(),
+				[v](cl::CommandQueue& queue, BenchBuffers& b) {
+					if (v->stage == STAGE_HISTOGRAM)
+						queue.enqueueFillBuffer(b.stage.hist, 0, 0, HIST_SIZE);
+				},
+				[v, params](cl::CommandQueue& queue, cl::Kernel& kernel, BenchBuffers& b, vector<cl::Event>* events) {
+					v->enqueue(queue, kernel, b.stage, params, NULL, events);
+				} });
+		}
+	}
+
+	// The colour kernels are not part of the registry
+	variants.push_back({ "histogram_rgb", "histogram_rgb", true, true, false,
+		[](cl::CommandQueue& queue, BenchBuffers& b) { queue.enqueueFillBuffer(b.stage.hist, 0, 0, HIST_SIZE); },
+		[](cl::CommandQueue& queue, cl::Kernel& kernel, BenchBuffers& b, vector<cl::Event>* events) {
+			kernel.setArg(0, b.stage.image);
+			kernel.setArg(1, b.stage.hist);
+			kernel.setArg(2, b.channel);
+			EnqueueStageKernel(queue, kernel, cl::NDRange(b.stage.pixels), cl::NDRange(256), NULL, events);
+		} });
+	variants.push_back({ "scan_add_atomic", "scan_add_atomic", true, false, false,
+		[](cl::CommandQueue& queue, BenchBuffers& b) { queue.enqueueFillBuffer(b.stage.cumHist, 0, 0, HIST_SIZE); },
+		[](cl::CommandQueue& queue, cl::Kernel& kernel, BenchBuffers& b, vector<cl::Event>* events) {
+			kernel.setArg(0, b.stage.hist);
+			kernel.setArg(1, b.stage.cumHist);
+			EnqueueStageKernel(queue, kernel, cl::NDRange(BIN_SIZE), cl::NullRange, NULL, events);
+		} });
+	variants.push_back({ "lut_rgb", "lut_rgb", true, true, false,
+		[](cl::CommandQueue&, BenchBuffers&) {},
+		[](cl::CommandQueue& queue, cl::Kernel& kernel, BenchBuffers& b, vector<cl::Event>* events) {
+			kernel.setArg(0, b.stage.image);
+			kernel.setArg(1, b.stage.output);
+			kernel.setArg(2, b.rLut);
+			kernel.setArg(3, b.gLut);
+			kernel.setArg(4, b.bLut);
+			EnqueueStageKernel(queue, kernel, cl::NDRange(b.stage.pixels), cl::NDRange(256), NULL, events);
+		} });
+
+	return variants;
+}
+
+// Device time from the start of the first command of a run to the end of its last [ns], the commands may
+// have been spread over several queues of the same device
+cl_ulong GetRunSpan(const vector<ProfiledCommand>& commands) {
+	cl_ulong start = 0, end = 0;
+	for (const ProfiledCommand& command : commands) {
+		cl_ulong commandStart = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		cl_ulong commandEnd = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		start = (start == 0) ? commandStart : min(start, commandStart);
+		end = max(end, commandEnd);
+	}
+	return end - start;
+}
+
+// Times the whole colour pipeline of uniform RGB images of every size, with the per-channel stages run
+// sequentially, on concurrent queues, on an out-of-order queue, and as fused-channel batched kernels
+void RunChannelComparison(const cl::Context& context, const cl::Device& device, const cl::Program& program, int maxSide, int warmups, int repetitions) {
+	const int CHANNELS = 3;
+	cl::CommandQueue queue = DeviceRegistry::Get().Queue(device, CL_QUEUE_PROFILING_ENABLE);
+
+	// The per-channel execution modes, as the queues their lanes go to
+	vector<pair<string, vector<cl::CommandQueue>>> modes;
+	modes.push_back({ "per_channel_sequential", { queue } });
+	modes.push_back({ "per_channel_queues", { queue, DeviceRegistry::Get().Queue(device, CL_QUEUE_PROFILING_ENABLE, 1), DeviceRegistry::Get().Queue(device, CL_QUEUE_PROFILING_ENABLE, 2) } });
+	cl::CommandQueue outOfOrder = TaskGraph::GetQueue(device);
+	if (TaskGraph::IsOutOfOrder(outOfOrder))
+		modes.push_back({ "per_channel_out_of_order", { outOfOrder } });
+	else
+		cerr << "[INFO] The device has no out-of-order queues" << endl;
+
+	cout << "image,mode,min_ns,median_ns,p95_ns,max_ns,mpixels_per_s" << endl;
+	cl_ulong maxAlloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	for (int side = 64; side <= maxSide; side *= 4) {
+		size_t plane = (size_t)side * side;
+		size_t size = plane * CHANNELS;
+		if (size > maxAlloc)
+			break;
+		CImg<unsigned char> image = GenerateSyntheticImage(side, side, CHANNELS, DIST_UNIFORM);
+		string imageName = to_string(side) + "x" + to_string(side) + "x" + to_string(CHANNELS);
+
+		cl::Buffer input(context, CL_MEM_READ_ONLY, size), output(context, CL_MEM_READ_WRITE, size);
+		cl::Buffer scale(context, CL_MEM_READ_ONLY, sizeof(float));
+		float scaleValue = 255.0f / (float)plane;
+		queue.enqueueWriteBuffer(input, CL_TRUE, 0, size, image.data());
+		queue.enqueueWriteBuffer(scale, CL_TRUE, 0, sizeof(float), &scaleValue);
+		vector<ChannelBuffers> channels(CHANNELS);
+		vector<cl::Buffer> luts;
+		for (ChannelBuffers& channel : channels) {
+			channel = { cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(int)), cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE),
+				cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE), cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE) };
+			luts.push_back(channel.lut);
+		}
+
+		// The fused-channel kernels see the image as three segments, one per channel
+		vector<int> offsets = { 0, (int)plane, 2 * (int)plane, 3 * (int)plane };
+		cl::Buffer offsetsBuffer(context, CL_MEM_READ_ONLY, offsets.size() * sizeof(int));
+		cl::Buffer hist(context, CL_MEM_READ_WRITE, CHANNELS * HIST_SIZE), lut(context, CL_MEM_READ_WRITE, CHANNELS * HIST_SIZE);
+		queue.enqueueWriteBuffer(offsetsBuffer, CL_TRUE, 0, offsets.size() * sizeof(int), &offsets[0]);
+
+		vector<pair<string, function<void(ProfilingReport&)>>> runs;
+		for (auto& mode : modes) {
+			vector<cl::CommandQueue>& queues = mode.second;
+			runs.push_back({ mode.first, [&](ProfilingReport& commands) {
+				TaskGraph graph(queues, commands);
+				for (int c = 0; c < CHANNELS; c++)
+					EnqueueChannelLut(graph, c, program, input, size, scale, c, channels[c], "channel " + to_string(c));
+				EnqueueColourApply(graph, program, input, output, size, luts, "apply");
+				graph.Finish();
+			} });
+		}
+		runs.push_back({ "fused_channels", [&](ProfilingReport& commands) {
+			const size_t LOCAL_SIZE = 256, PIXELS_PER_ITEM = 16; // as in the batch mode of the application
+			cl::NDRange pixelRange(max((size_t)1, (plane + LOCAL_SIZE * PIXELS_PER_ITEM - 1) / (LOCAL_SIZE * PIXELS_PER_ITEM)) * LOCAL_SIZE, CHANNELS);
+			cl::Event evnt;
+
+			queue.enqueueFillBuffer(hist, 0, 0, CHANNELS * HIST_SIZE, NULL, &evnt);
+			commands.Add("fill", evnt);
+			cl::Kernel kernelHist(program, "histogram_batched");
+			kernelHist.setArg(0, input);
+			kernelHist.setArg(1, offsetsBuffer);
+			kernelHist.setArg(2, hist);
+			kernelHist.setArg(3, cl::Local(HIST_SIZE));
+			queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &evnt);
+			commands.Add("histogram", evnt);
+			cl::Kernel kernelScan(program, "scan_lut_batched");
+			kernelScan.setArg(0, hist);
+			kernelScan.setArg(1, offsetsBuffer);
+			kernelScan.setArg(2, lut);
+			kernelScan.setArg(3, cl::Local(HIST_SIZE));
+			kernelScan.setArg(4, cl::Local(HIST_SIZE));
+			queue.enqueueNDRangeKernel(kernelScan, cl::NullRange, cl::NDRange(BIN_SIZE, CHANNELS), cl::NDRange(BIN_SIZE, 1), NULL, &evnt);
+			commands.Add("scan", evnt);
+			cl::Kernel kernelLut(program, "lut_batched");
+			kernelLut.setArg(0, input);
+			kernelLut.setArg(1, output);
+			kernelLut.setArg(2, lut);
+			kernelLut.setArg(3, offsetsBuffer);
+			queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &evnt);
+			commands.Add("apply", evnt);
+			queue.finish();
+		} });
+
+		for (auto& run : runs) {
+			vector<cl_ulong> times;
+			for (int i = 0; i < warmups + repetitions; i++) {
+				ProfilingReport commands;
+				run.second(commands);
+				if (i >= warmups)
+					times.push_back(GetRunSpan(commands.Commands()));
+			}
+			BenchStats stats = GetBenchStats(times);
+			cout << imageName << "," << run.first << "," << stats.min << "," << stats.median << "," << stats.p95 << "," << stats.max << ","
+				<< (double)plane / stats.median * 1000.0 << endl;
+		}
+	}
+}
+
+// Times histogram_rgb, norm_bins and lut_rgb on uniform RGB images of every size, built generically and
+// specialised to the image. The specialised programs come from the program cache, one per image size, and
+// their build time is reported since it is what a specialisation costs up front.
+void RunSpecialisationComparison(const cl::Context& context, const cl::Device& device, const cl::Program& program, int maxSide, int warmups, int repetitions) {
+	const int CHANNELS = 3;
+	cl::CommandQueue queue = DeviceRegistry::Get().Queue(device, CL_QUEUE_PROFILING_ENABLE);
+
+	cout << "image,kernel,build,min_ns,median_ns,p95_ns,max_ns,mpixels_per_s,speedup" << endl;
+	cl_ulong maxAlloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	for (int side = 64; side <= maxSide; side *= 4) {
+		size_t plane = (size_t)side * side;
+		size_t size = plane * CHANNELS;
+		if (size > maxAlloc)
+			break;
+		CImg<unsigned char> image = GenerateSyntheticImage(side, side, CHANNELS, DIST_UNIFORM);
+		string imageName = to_string(side) + "x" + to_string(side) + "x" + to_string(CHANNELS);
+
+		// Histogram of channel 0 and an identity LUT for every channel
+		int channel = 0;
+		float scaleValue = 255.0f / (float)plane;
+		vector<int> identity(BIN_SIZE);
+		for (int i = 0; i < BIN_SIZE; i++) identity[i] = i;
+		cl::Buffer input(context, CL_MEM_READ_ONLY, size), output(context, CL_MEM_READ_WRITE, size);
+		cl::Buffer hist(context, CL_MEM_READ_WRITE, HIST_SIZE), norm(context, CL_MEM_READ_WRITE, HIST_SIZE), lut(context, CL_MEM_READ_ONLY, HIST_SIZE);
+		cl::Buffer channelBuffer(context, CL_MEM_READ_ONLY, sizeof(int)), scale(context, CL_MEM_READ_ONLY, sizeof(float));
+		queue.enqueueWriteBuffer(input, CL_TRUE, 0, size, image.data());
+		queue.enqueueWriteBuffer(lut, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+		queue.enqueueWriteBuffer(channelBuffer, CL_TRUE, 0, sizeof(int), &channel);
+		queue.enqueueWriteBuffer(scale, CL_TRUE, 0, sizeof(float), &scaleValue);
+
+		long long buildStart = GetHostTime();
+		string specialisation = DefineOption("CHANNEL", to_string(channel)) + " " + DefineOption("IMAGE_SIZE", to_string(plane)) + " " + DefineOption("SCALE", FloatLiteral(scaleValue));
+		cl::Program specialised = ProgramCache::Get().Build(context, device, "kernels/assign_kernels.cl", specialisation);
+		cerr << "[INFO] " << imageName << " specialised build (" << specialisation << ") took " << (GetHostTime() - buildStart) * 1e-6 << " ms" << endl;
+
+		// Kernel, build, program, offset and global size of each run, and whether it is timed per pixel
+		struct SpecialisationRun {
+			string kernel, build;
+			const cl::Program* program;
+			cl::NDRange offset, global, local;
+			bool perPixel;
+		};
+		vector<SpecialisationRun> runs = {
+			{ "histogram_rgb", "generic", &program, cl::NullRange, cl::NDRange(size), cl::NDRange(256), true },
+			{ "histogram_rgb", "specialised", &specialised, cl::NullRange, cl::NDRange(size), cl::NDRange(256), true },
+			{ "histogram_rgb", "specialised_plane", &specialised, cl::NDRange(channel * plane), cl::NDRange(plane), cl::NDRange(256), true },
+			{ "norm_bins", "generic", &program, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NullRange, false },
+			{ "norm_bins", "specialised", &specialised, cl::NullRange, cl::NDRange(BIN_SIZE), cl::NullRange, false },
+			{ "lut_rgb", "generic", &program, cl::NullRange, cl::NDRange(size), cl::NDRange(256), true },
+			{ "lut_rgb", "specialised", &specialised, cl::NullRange, cl::NDRange(size), cl::NDRange(256), true },
+		};
+
+		map<string, double> genericMedians;
+		for (SpecialisationRun& run : runs) {
+			cl::Kernel kernel(*run.program, run.kernel.c_str());
+			if (run.kernel == "histogram_rgb") {
+				kernel.setArg(0, input);
+				kernel.setArg(1, hist);
+				kernel.setArg(2, channelBuffer);
+			}
+			else if (run.kernel == "norm_bins") {
+				kernel.setArg(0, lut);
+				kernel.setArg(1, norm);
+				kernel.setArg(2, scale);
+			}
+			else {
+				kernel.setArg(0, input);
+				kernel.setArg(1, output);
+				kernel.setArg(2, lut);
+				kernel.setArg(3, lut);
+				kernel.setArg(4, lut);
+			}
+
+			vector<cl_ulong> times;
+			for (int i = 0; i < warmups + repetitions; i++) {
+				if (run.kernel == "histogram_rgb")
+					queue.enqueueFillBuffer(hist, 0, 0, HIST_SIZE);
+				cl::Event evnt;
+				queue.enqueueNDRangeKernel(kernel, run.offset, run.global, run.local, NULL, &evnt);
+				evnt.wait();
+				if (i >= warmups)
+					times.push_back(evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+			}
+
+			BenchStats stats = GetBenchStats(times);
+			if (run.build == "generic")
+				genericMedians[run.kernel] = stats.median;
+			cout << imageName << "," << run.kernel << "," << run.build << "," << stats.min << "," << stats.median << "," << stats.p95 << "," << stats.max << ",";
+			if (run.perPixel)
+				cout << (double)size / stats.median * 1000.0;
+			cout << "," << genericMedians[run.kernel] / stats.median << endl;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	int platform_id = 0;
+	int device_id = 0;
+	int warmups = 3;
+	int repetitions = 10;
+	int maxSide = 16384;
+	string reportFilename;
+	bool contentionOnly = false;
+	bool channelsOnly = false;
+	bool specialisationOnly = false;
+
+	// Handle command line arguements
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { warmups = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { repetitions = max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { maxSide = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reportFilename = argv[++i]; }
+		else if (strcmp(argv[i], "-c") == 0) { contentionOnly = true; }
+		else if (strcmp(argv[i], "-g") == 0) { channelsOnly = true; }
+		else if (strcmp(argv[i], "-z") == 0) { specialisationOnly = true; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	}
+
+	// Hides CImg library messages/exceptions from the output
+	cimg::exception_mode(0);
+
+	try {
+		DeviceRegistry& devices = DeviceRegistry::Get();
+		const DeviceInfo& info = devices.Info(platform_id, device_id);
+		cl::Device device = info.device;
+		cl::Context context = devices.Context(device);
+		cout << "Running on " << info.platformName << ", " << info.name << endl;
+
+		cl::CommandQueue queue = devices.Queue(device, CL_QUEUE_PROFILING_ENABLE);
+
+		// Build errors print the build log and are rethrown
+		cl::Program program = ProgramCache::Get().Build(context, device, "kernels/assign_kernels.cl");
+
+		if (channelsOnly) {
+			RunChannelComparison(context, device, program, maxSide, warmups, repetitions);
+			return 0;
+		}
+		if (specialisationOnly) {
+			RunSpecialisationComparison(context, device, program, maxSide, warmups, repetitions);
+			return 0;
+		}
+
+		VariantRegistry registry;
+		vector<BenchVariant> variants = GetBenchVariants(registry);
+		ProfilingReport profiler;
+		cl_ulong maxAlloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		// Histogram timings per image and kernel, keyed by distribution, for the contention comparison
+		map<string, map<string, map<SyntheticDistribution, BenchStats>>> histogramStats;
+
+		cout << "image,distribution,kernel,min_ns,median_ns,p95_ns,max_ns,mpixels_per_s" << endl;
+
+		for (int side = 64; side <= maxSide; side *= 4) {
+			for (int spectrum : { 1, 3 }) {
+				size_t size = (size_t)side * side * spectrum;
+				if (size > maxAlloc) {
+					cerr << "[INFO] Skipping " << side << "x" << side << "x" << spectrum << ", larger than the maximum allocation" << endl;
+					continue;
+				}
+
+				for (SyntheticDistribution distribution : ALL_DISTRIBUTIONS) {
+					CImg<unsigned char> image = GenerateSyntheticImage(side, side, spectrum, distribution);
+					string imageName = to_string(side) + "x" + to_string(side) + "x" + to_string(spectrum);
+
+					// Fresh buffers for every image, with a realistic LUT so the apply kernels read valid data
+					BenchBuffers b;
+					b.stage.pixels = size;
+					b.stage.image = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+					b.stage.output = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+					b.stage.hist = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+					b.stage.cumHist = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+					b.stage.lut = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+					b.stage.scale = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float));
+					b.stage.scaleValue = 255.0f / (float)(side * side);
+					b.channel = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(int));
+					b.rLut = cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+					b.gLut = cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+					b.bLut = cl::Buffer(context, CL_MEM_READ_ONLY, HIST_SIZE);
+
+					vector<int> identity(BIN_SIZE);
+					for (int i = 0; i < BIN_SIZE; i++) identity[i] = i;
+					int channel = 0;
+					queue.enqueueWriteBuffer(b.stage.image, CL_TRUE, 0, size, image.data());
+					queue.enqueueWriteBuffer(b.stage.hist, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+					queue.enqueueWriteBuffer(b.stage.lut, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+					queue.enqueueWriteBuffer(b.rLut, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+					queue.enqueueWriteBuffer(b.gLut, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+					queue.enqueueWriteBuffer(b.bLut, CL_TRUE, 0, HIST_SIZE, &identity[0]);
+					queue.enqueueWriteBuffer(b.stage.scale, CL_TRUE, 0, sizeof(float), &b.stage.scaleValue);
+					queue.enqueueWriteBuffer(b.channel, CL_TRUE, 0, sizeof(int), &channel);
+
+					for (BenchVariant& variant : variants) {
+						if (variant.colour != (spectrum == 3) || (contentionOnly && !variant.histogram))
+							continue;
+
+						cl::Kernel kernel(program, variant.kernel.c_str());
+						vector<cl_ulong> times;
+
+						try {
+							for (int i = 0; i < warmups + repetitions; i++) {
+								vector<cl::Event> events;
+								variant.prepare(queue, b);
+								variant.launch(queue, kernel, b, &events);
+								cl::WaitForEvents(events);
+								if (i < warmups)
+									continue;
+								times.push_back(GetStageTime(events));
+								if (!reportFilename.empty())
+									profiler.Add(imageName + " " + GetDistributionName(distribution) + " " + variant.name, events, variant.perPixel ? 2 * size : 2 * HIST_SIZE);
+							}
+						}
+						catch (const cl::Error& err) {
+							// Some parameter sets exceed what this device supports, e.g. its maximum work-group size
+							cerr << "[INFO] " << variant.name << " failed on " << imageName << ": " << getErrorString(err.err()) << endl;
+							continue;
+						}
+
+						BenchStats stats = GetBenchStats(times);
+						if (variant.histogram)
+							histogramStats[imageName][variant.name][distribution] = stats;
+						cout << imageName << "," << GetDistributionName(distribution) << "," << variant.name << ","
+							<< stats.min << "," << stats.median << "," << stats.p95 << "," << stats.max << ",";
+						if (variant.perPixel)
+							cout << (double)(side * side) / stats.median * 1000.0; // pixels per ns * 1000 = MP/s
+						cout << endl;
+					}
+				}
+			}
+		}
+
+		// How far each histogram kernel's median moves between the easiest and hardest distribution,
+		// and its run-to-run coefficient of variation on the single-value image
+		cout << endl << "image,kernel";
+		for (SyntheticDistribution distribution : ALL_DISTRIBUTIONS)
+			cout << "," << GetDistributionName(distribution) << "_median_ns";
+		cout << ",max_over_min,constant_cv" << endl;
+		for (auto& image : histogramStats) {
+			for (auto& kernel : image.second) {
+				double fastest = 0.0, slowest = 0.0;
+				cout << image.first << "," << kernel.first;
+				for (SyntheticDistribution distribution : ALL_DISTRIBUTIONS) {
+					double median = kernel.second[distribution].median;
+					fastest = (fastest == 0.0) ? median : min(fastest, median);
+					slowest = max(slowest, median);
+					cout << "," << median;
+				}
+				BenchStats& constant = kernel.second[DIST_CONSTANT];
+				cout << "," << slowest / fastest << "," << constant.stddev / constant.mean << endl;
+			}
+		}
+
+		if (!reportFilename.empty())
+			profiler.Save(reportFilename);
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
+
+	return 0;
+}
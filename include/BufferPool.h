@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Recycles device buffers between images instead of creating and releasing them for every one. Buffers are
+// handed out by power-of-two size class, so a request is served by any free buffer of its class however its
+// exact size varies from image to image. A class larger than the devices can allocate is not used, those
+// requests get a buffer of their exact size instead.
+class BufferPool {
+public:
+	BufferPool() {}
+	BufferPool(const cl::Context& context) : context(context) {
+		for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>())
+			maxAlloc = min(maxAlloc, (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+	}
+
+	// Returns a read-write buffer of at least size bytes, reusing a free one of the same class when there is one
+	cl::Buffer Acquire(size_t size) {
+		size_t sizeClass = SizeClass(size);
+		inUseBytes += sizeClass;
+		highWaterBytes = max(highWaterBytes, inUseBytes);
+
+		vector<cl::Buffer>& free = freeBuffers[sizeClass];
+		if (!free.empty()) {
+			cl::Buffer buffer = free.back();
+			free.pop_back();
+			freeBytes -= sizeClass;
+			hits++;
+			return buffer;
+		}
+
+		misses++;
+		allocatedBytes += sizeClass;
+		return cl::Buffer(context, CL_MEM_READ_WRITE, sizeClass);
+	}
+
+	// Returns a buffer from Acquire to the pool, only once every command using it has completed. A buffer that
+	// is never released is simply freed when its last reference goes.
+	void Release(const cl::Buffer& buffer) {
+		size_t sizeClass = buffer.getInfo<CL_MEM_SIZE>();
+		inUseBytes -= sizeClass;
+		freeBytes += sizeClass;
+		freeBuffers[sizeClass].push_back(buffer);
+	}
+
+	// Frees every buffer not currently in use
+	void Trim() {
+		allocatedBytes -= freeBytes;
+		freeBytes = 0;
+		freeBuffers.clear();
+	}
+
+	double HitRate() const {
+		return hits + misses > 0 ? (double)hits / (hits + misses) : 0.0;
+	}
+
+	string Summary() const {
+		stringstream text;
+		text << "Buffer pool: " << hits << " hits, " << misses << " misses, hit rate " << 100.0 * HitRate() << "%, "
+			<< allocatedBytes << " bytes allocated, " << freeBytes << " free, high-water mark " << highWaterBytes << " bytes in use";
+		return text.str();
+	}
+
+private:
+	static const size_t MIN_CLASS = 256; // Smallest buffer handed out, anything smaller would be all overhead
+
+	cl::Context context;
+	size_t maxAlloc = SIZE_MAX; // largest buffer every device of the context can allocate
+	map<size_t, vector<cl::Buffer>> freeBuffers; // free buffers by size class
+	size_t allocatedBytes = 0, inUseBytes = 0, freeBytes = 0, highWaterBytes = 0;
+	size_t hits = 0, misses = 0;
+
+	size_t SizeClass(size_t size) const {
+		size_t sizeClass = MIN_CLASS;
+		while (sizeClass < size)
+			sizeClass <<= 1;
+		return sizeClass <= maxAlloc ? sizeClass : size;
+	}
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "TaskGraph.h"
+
+using namespace std;
+
+// Channel indices read by histogram_rgb, kept alive for the non-blocking writes that upload them
+static const int CHANNEL_INDICES[3] = { 0, 1, 2 };
+
+// Device buffers of one channel of a colour image
+struct ChannelBuffers {
+	cl::Buffer channel; // channel index (int)
+	cl::Buffer hist;    // histogram (int[256])
+	cl::Buffer cdf;     // cumulative histogram (int[256])
+	cl::Buffer lut;     // normalised cumulative histogram (int[256])
+};
+
+// Sets up histogram_sampled to count one pixel in every stride of the N pixels starting at offset
+cl::Kernel SampledHistogramKernel(const cl::Program& program, const cl::Buffer& image, const cl::Buffer& hist, int offset, int N, int stride) {
+	cl::Kernel kernelSampled(program, "histogram_sampled");
+	kernelSampled.setArg(0, image);
+	kernelSampled.setArg(1, hist);
+	kernelSampled.setArg(2, cl::Local(256 * sizeof(int)));
+	kernelSampled.setArg(3, offset);
+	kernelSampled.setArg(4, N);
+	kernelSampled.setArg(5, stride);
+	kernelSampled.setArg(6, (cl_uint)0x9e3779b9);
+	return kernelSampled;
+}
+
+// Enqueues the histogram, scan and normalisation of one channel of a planar RGB image on its own lane of
+// graph, leaving the channel's LUT in buffers.lut, and returns the number of pixels counted. Channels on
+// different lanes share nothing but the image and the scale, so they only wait for the image upload and
+// otherwise run side by side. When program is specialised for the channel (built with CHANNEL and
+// IMAGE_SIZE defined) the channel index is not uploaded and the histogram only covers the channel's plane.
+// A sampleStride above 1 builds the histogram from a stratified sample of the plane instead, and
+// sampledHist, when given, receives a copy of the histogram before the scan overwrites it.
+int EnqueueChannelLut(TaskGraph& graph, int lane, const cl::Program& program, const cl::Buffer& image, size_t imageSize, const cl::Buffer& scale,
+	int channel, ChannelBuffers& buffers, const string& stage, bool specialised = false, int sampleStride = 1, int* sampledHist = NULL) {
+	const size_t HIST_SIZE = 256 * sizeof(int);
+	size_t planeSize = imageSize / 3;
+	int counted = (int)planeSize;
+
+	if (!specialised && sampleStride == 1)
+		graph.Write(stage + " channel write", buffers.channel, sizeof(int), &CHANNEL_INDICES[channel], lane);
+	graph.Fill(stage + " histogram fill", buffers.hist, HIST_SIZE, lane);
+
+	cl::Kernel kernelHist(program, "histogram_rgb");
+	kernelHist.setArg(0, image);
+	kernelHist.setArg(1, buffers.hist);
+	kernelHist.setArg(2, buffers.channel);
+	if (sampleStride > 1) {
+		counted = ((int)planeSize + sampleStride - 1) / sampleStride;
+		cl::Kernel kernelSampled = SampledHistogramKernel(program, image, buffers.hist, channel * (int)planeSize, (int)planeSize, sampleStride);
+		graph.Kernel(stage + " sampled histogram kernel", kernelSampled, cl::NDRange(RoundUp(counted, 256)), cl::NDRange(256), { image }, { buffers.hist }, counted, lane);
+	}
+	else if (specialised)
+		graph.Kernel(stage + " specialised histogram kernel", kernelHist, cl::NDRange(planeSize), cl::NullRange, { image }, { buffers.hist }, planeSize, lane, cl::NDRange(channel * planeSize));
+	else
+		graph.Kernel(stage + " histogram kernel", kernelHist, cl::NDRange(imageSize), cl::NullRange, { image, buffers.channel }, { buffers.hist }, imageSize, lane);
+
+	if (sampledHist)
+		graph.Read(stage + " histogram read", buffers.hist, HIST_SIZE, sampledHist, lane);
+
+	// scan_hs uses the histogram as its second buffer, so it writes both
+	cl::Kernel kernelScan(program, "scan_hs");
+	kernelScan.setArg(0, buffers.hist);
+	kernelScan.setArg(1, buffers.cdf);
+	graph.Kernel(stage + " cumulative kernel", kernelScan, cl::NDRange(256), cl::NDRange(256), {}, { buffers.hist, buffers.cdf }, 2 * HIST_SIZE, lane);
+
+	cl::Kernel kernelNorm(program, "norm_bins");
+	kernelNorm.setArg(0, buffers.cdf);
+	kernelNorm.setArg(1, buffers.lut);
+	kernelNorm.setArg(2, scale);
+	graph.Kernel(stage + " normalise kernel", kernelNorm, cl::NDRange(256), cl::NullRange, { buffers.cdf, scale }, { buffers.lut }, 2 * HIST_SIZE, lane);
+	return counted;
+}
+
+// Enqueues lut_rgb once the LUTs of all three channels are ready
+void EnqueueColourApply(TaskGraph& graph, const cl::Program& program, const cl::Buffer& image, const cl::Buffer& output, size_t imageSize,
+	const vector<cl::Buffer>& luts, const string& stage) {
+	cl::Kernel kernelLut(program, "lut_rgb");
+	kernelLut.setArg(0, image);
+	kernelLut.setArg(1, output);
+	kernelLut.setArg(2, luts[0]);
+	kernelLut.setArg(3, luts[1]);
+	kernelLut.setArg(4, luts[2]);
+	graph.Kernel(stage + " LUT kernel", kernelLut, cl::NDRange(imageSize), cl::NullRange, { image, luts[0], luts[1], luts[2] }, { output }, 2 * imageSize);
+}
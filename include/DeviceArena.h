@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// One device allocation carved into sub-buffers with clCreateSubBuffer. Regions are reserved first, then
+// Create allocates the whole arena at once and hands out every region as its own buffer. Each region starts
+// on a multiple of CL_DEVICE_MEM_BASE_ADDR_ALIGN, as sub-buffer origins must, and regions reserved one after
+// the other are contiguous, so a single fill or read can cover several of them.
+class DeviceArena {
+public:
+	DeviceArena(const cl::Context& context, const cl::Device& device) : context(context) {
+		alignment = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8; // reported in bits
+		maxSize = (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	}
+
+	// Reserves a region of size bytes and returns its index, only valid before Create
+	int Reserve(size_t size) {
+		regions.push_back(cl_buffer_region{ End(), size });
+		return (int)regions.size() - 1;
+	}
+
+	// True when a region of size bytes can still be reserved without the arena outgrowing the largest
+	// allocation the device allows
+	bool Fits(size_t size) const {
+		return End() + size <= maxSize;
+	}
+
+	// Allocates the arena and a sub-buffer for every reserved region
+	void Create() {
+		arena = cl::Buffer(context, CL_MEM_READ_WRITE, max((size_t)1, End()));
+		for (cl_buffer_region& region : regions)
+			buffers.push_back(arena.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region));
+	}
+
+	cl::Buffer& Get(int index) {
+		return buffers[index];
+	}
+
+	// Offset of a region from the start of the arena, for commands on the whole arena
+	size_t Offset(int index) const {
+		return regions[index].origin;
+	}
+
+	// Bytes from the start of region first to the end of region last, alignment padding included
+	size_t Span(int first, int last) const {
+		return regions[last].origin + regions[last].size - regions[first].origin;
+	}
+
+	// Zeroes regions first to last and the padding between them with one command
+	void EnqueueFill(cl::CommandQueue& queue, int first, int last, const vector<cl::Event>* wait, cl::Event* event) {
+		queue.enqueueFillBuffer(arena, (cl_uchar)0, Offset(first), Span(first, last), wait, event);
+	}
+
+	cl::Buffer& Buffer() {
+		return arena;
+	}
+
+private:
+	cl::Context context;
+	cl::Buffer arena;
+	size_t alignment;
+	size_t maxSize;
+	vector<cl_buffer_region> regions;
+	vector<cl::Buffer> buffers;
+
+	// Aligned offset of the next region
+	size_t End() const {
+		if (regions.empty())
+			return 0;
+		size_t end = regions.back().origin + regions.back().size;
+		return (end + alignment - 1) / alignment * alignment;
+	}
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "Utils.h"
+
+using namespace std;
+
+// Bounded lock-free queue (Vyukov's array queue). Each cell carries a sequence number that tells producers
+// and consumers whether it is free to write or ready to read, so any number of threads can push and pop
+// with one compare-and-swap each: it serves as MPSC queue from the decoders to the device thread and as
+// SPMC queue from the device thread to the encoders.
+template<typename T>
+class BoundedQueue {
+public:
+	// capacity is rounded up to a power of two
+	BoundedQueue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		mask = size - 1;
+		cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, memory_order_relaxed);
+		enqueuePos.store(0, memory_order_relaxed);
+		dequeuePos.store(0, memory_order_relaxed);
+	}
+
+	// Returns false when the queue is full
+	bool TryPush(const T& value) {
+		size_t pos = enqueuePos.load(memory_order_relaxed);
+		Cell* cell;
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = enqueuePos.load(memory_order_relaxed);
+			}
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, memory_order_release);
+		return true;
+	}
+
+	// Returns false when the queue is empty
+	bool TryPop(T& value) {
+		size_t pos = dequeuePos.load(memory_order_relaxed);
+		Cell* cell;
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = dequeuePos.load(memory_order_relaxed);
+			}
+		}
+		value = cell->value;
+		cell->sequence.store(pos + mask + 1, memory_order_release);
+		return true;
+	}
+
+private:
+	struct Cell {
+		atomic<size_t> sequence;
+		T value;
+	};
+
+	unique_ptr<Cell[]> cells;
+	size_t mask;
+	// Producers and consumers each update their own position, kept on separate cache lines
+	alignas(64) atomic<size_t> enqueuePos;
+	alignas(64) atomic<size_t> dequeuePos;
+};
+
+// Time the threads of one pipeline stage spent working and blocked, summed over the threads
+struct StageCounters {
+	string name;
+	int threads = 1;
+	atomic<long long> busy{ 0 };    // [ns]
+	atomic<long long> blocked{ 0 }; // [ns] waiting on a full or empty queue
+	atomic<int> items{ 0 };
+
+	StageCounters(const string& name, int threads) : name(name), threads(threads) {}
+
+	// Share of the stage's thread time over wall time spent busy, the busiest stage limits throughput
+	double Utilisation(long long wall) const {
+		return wall > 0 ? (double)busy / ((double)wall * threads) : 0.0;
+	}
+
+	string Summary(long long wall) const {
+		stringstream text;
+		text << name << ": " << threads << " thread(s), " << items << " items, " << 100.0 * Utilisation(wall) << "% busy, "
+			<< (wall > 0 ? 100.0 * blocked / ((double)wall * threads) : 0.0) << "% blocked";
+		return text.str();
+	}
+};
+
+// Pushes value, yielding while the queue is full so a fast stage is held back by a slow one. Returns false
+// without pushing when stop is set.
+template<typename T>
+bool PushWait(BoundedQueue<T>& queue, const T& value, StageCounters& counters, const atomic<bool>& stop) {
+	long long start = GetHostTime();
+	while (!queue.TryPush(value)) {
+		if (stop)
+			return false;
+		this_thread::yield();
+	}
+	counters.blocked += GetHostTime() - start;
+	return true;
+}
+
+// Pops into value, yielding while the queue is empty. Returns false when stop is set first.
+template<typename T>
+bool PopWait(BoundedQueue<T>& queue, T& value, StageCounters& counters, const atomic<bool>& stop) {
+	long long start = GetHostTime();
+	while (!queue.TryPop(value)) {
+		if (stop)
+			return false;
+		this_thread::yield();
+	}
+	counters.blocked += GetHostTime() - start;
+	return true;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+using namespace std;
+
+// Cumulative histogram of every channel of a reference image, which is all histogram matching needs from it
+struct ReferenceCdf {
+	int channels = 0;
+	int pixels = 0; // pixels per channel
+	vector<int> cdf; // 256 entries per channel
+};
+
+// FNV-1a hash of a file's bytes, identifies a reference image in the CDF cache without decoding it
+unsigned long long HashFile(const string& filename) {
+	ifstream file(filename, ios::binary);
+	if (!file)
+		throw runtime_error("could not open " + filename);
+
+	unsigned long long hash = 14695981039346656037ULL;
+	char buffer[65536];
+	while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+		for (streamsize i = 0; i < file.gcount(); i++) {
+			hash ^= (unsigned char)buffer[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+// Enqueues the histogram of one channel of a planar image already on the device into hist, using the
+// histogram kernel for greyscale images and histogram_rgb for colour images
+void EnqueueChannelHistogram(cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& image, size_t imageSize, int spectrum, int channel,
+	cl::Buffer& hist, ProfilingReport& profiler, const string& stage) {
+	const size_t HIST_SIZE = 256 * sizeof(int);
+	cl::Event prof;
+
+	queue.enqueueFillBuffer(hist, 0, 0, HIST_SIZE, NULL, &prof);
+	profiler.Add(stage + " histogram fill", prof, HIST_SIZE);
+
+	cl::Kernel kernelHist;
+	if (spectrum == 1) {
+		kernelHist = cl::Kernel(program, "histogram");
+		kernelHist.setArg(0, image);
+		kernelHist.setArg(1, hist);
+	}
+	else {
+		// histogram_rgb only counts the pixels of the channel held in its channel buffer
+		cl::Buffer channelBuffer(queue.getInfo<CL_QUEUE_CONTEXT>(), CL_MEM_READ_ONLY, sizeof(int));
+		queue.enqueueWriteBuffer(channelBuffer, CL_TRUE, 0, sizeof(int), &channel, NULL, &prof);
+		profiler.Add(stage + " channel write", prof, sizeof(int));
+		kernelHist = cl::Kernel(program, "histogram_rgb");
+		kernelHist.setArg(0, image);
+		kernelHist.setArg(1, hist);
+		kernelHist.setArg(2, channelBuffer);
+	}
+	queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, cl::NDRange(imageSize), cl::NullRange, NULL, &prof);
+	profiler.Add(stage + " histogram kernel", prof, imageSize);
+}
+
+// Enqueues the histogram and inclusive scan of one channel of a planar image already on the device, using
+// EnqueueChannelHistogram and scan_hs. hist is overwritten, the cumulative histogram is left in cdf.
+void EnqueueChannelCdf(cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& image, size_t imageSize, int spectrum, int channel,
+	cl::Buffer& hist, cl::Buffer& cdf, ProfilingReport& profiler, const string& stage) {
+	cl::Event prof;
+
+	EnqueueChannelHistogram(queue, program, image, imageSize, spectrum, channel, hist, profiler, stage);
+
+	cl::Kernel kernelScan(program, "scan_hs");
+	kernelScan.setArg(0, hist);
+	kernelScan.setArg(1, cdf);
+	queue.enqueueNDRangeKernel(kernelScan, cl::NullRange, cl::NDRange(256), cl::NDRange(256), NULL, &prof);
+	profiler.Add(stage + " cumulative kernel", prof, 2 * 256 * sizeof(int));
+}
+
+// Caches reference CDFs in memory and next to the reference image as <reference>.cdf, so once a reference
+// has been seen, matching against it costs the same as equalisation. Entries are keyed by a hash of the
+// file contents, so an edited reference image is recomputed.
+class ReferenceCdfCache {
+public:
+	// Returns the CDF of the reference image, only decoding and computing it on the device when it is in
+	// neither cache
+	const ReferenceCdf& Get(const string& filename, cl::CommandQueue& queue, const cl::Program& program, ProfilingReport& profiler) {
+		unsigned long long hash = HashFile(filename);
+
+		map<unsigned long long, ReferenceCdf>::iterator it = cdfs.find(hash);
+		if (it != cdfs.end())
+			return it->second;
+
+		ReferenceCdf reference;
+		string cacheFilename = filename + ".cdf";
+		if (Load(cacheFilename, hash, reference)) {
+			cout << "[INFO] Reference CDF loaded from " << cacheFilename << endl;
+		}
+		else {
+			reference = Compute(filename, queue, program, profiler);
+			Save(cacheFilename, hash, reference);
+			cout << "[INFO] Reference CDF cached in " << cacheFilename << endl;
+		}
+		return cdfs[hash] = reference;
+	}
+
+private:
+	map<unsigned long long, ReferenceCdf> cdfs;
+
+	static ReferenceCdf Compute(const string& filename, cl::CommandQueue& queue, const cl::Program& program, ProfilingReport& profiler) {
+		long long decodeStart = GetHostTime();
+		CImg<unsigned char> image(filename.c_str());
+		profiler.AddHostSpan("reference decode", decodeStart, GetHostTime());
+
+		ReferenceCdf reference;
+		reference.channels = image.spectrum();
+		reference.pixels = image.width() * image.height() * image.depth();
+		reference.cdf.resize(256 * reference.channels);
+
+		cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+		cl::Buffer imageBuffer(context, CL_MEM_READ_ONLY, image.size());
+		cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+		cl::Buffer cdfBuffer(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+		cl::Event prof;
+
+		queue.enqueueWriteBuffer(imageBuffer, CL_TRUE, 0, image.size(), image.data(), NULL, &prof);
+		profiler.Add("Reference image write", prof, image.size());
+
+		for (int c = 0; c < reference.channels; c++) {
+			string stage = "Reference channel " + to_string(c);
+			EnqueueChannelCdf(queue, program, imageBuffer, image.size(), reference.channels, c, histBuffer, cdfBuffer, profiler, stage);
+			queue.enqueueReadBuffer(cdfBuffer, CL_TRUE, 0, 256 * sizeof(int), &reference.cdf[256 * c], NULL, &prof);
+			profiler.Add(stage + " cumulative read", prof, 256 * sizeof(int));
+		}
+		return reference;
+	}
+
+	// Cache file format: "hash channels pixels" followed by the CDF values
+	static bool Load(const string& cacheFilename, unsigned long long hash, ReferenceCdf& reference) {
+		ifstream file(cacheFilename);
+		unsigned long long fileHash;
+		if (!(file >> fileHash >> reference.channels >> reference.pixels) || fileHash != hash)
+			return false;
+		// A damaged header falls back to recomputing the CDF rather than sizing it from garbage
+		if ((reference.channels != 1 && reference.channels != 3) || reference.pixels <= 0)
+			return false;
+
+		reference.cdf.resize(256 * reference.channels);
+		for (int& value : reference.cdf) {
+			if (!(file >> value))
+				return false;
+		}
+		return true;
+	}
+
+	static void Save(const string& cacheFilename, unsigned long long hash, const ReferenceCdf& reference) {
+		ofstream file(cacheFilename);
+		file << hash << " " << reference.channels << " " << reference.pixels << "\n";
+		for (size_t i = 0; i < reference.cdf.size(); i++)
+			file << reference.cdf[i] << ((i % 256 == 255) ? "\n" : " ");
+	}
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A point operation maps every pixel value independently of its neighbours, so it is completely
+// described by a 256-entry table and any chain of them collapses into a single table
+struct PointOp {
+	string name;
+	vector<int> table;
+};
+
+// Clamps a mapped value into the 0-255 range of a pixel
+int ClampPixel(float value) {
+	return (int)min(255.0f, max(0.0f, floorf(value + 0.5f)));
+}
+
+// Maps v to 255 * (v / 255)^gamma, values below 1 brighten the mid-tones
+PointOp GammaOp(float gamma) {
+	PointOp op = { "gamma", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = ClampPixel(255.0f * powf(v / 255.0f, gamma));
+	return op;
+}
+
+// Adds offset to every value
+PointOp BrightnessOp(float offset) {
+	PointOp op = { "brightness", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = ClampPixel(v + offset);
+	return op;
+}
+
+// Scales the distance of every value from mid-grey by factor
+PointOp ContrastOp(float factor) {
+	PointOp op = { "contrast", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = ClampPixel((v - 128.0f) * factor + 128.0f);
+	return op;
+}
+
+// Values at or above level become 255, the rest 0
+PointOp ThresholdOp(int level) {
+	PointOp op = { "threshold", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = v >= level ? 255 : 0;
+	return op;
+}
+
+// Maps low to 0 and high to 255 linearly, clipping values outside the range
+PointOp LinearStretchOp(int low, int high) {
+	PointOp op = { "stretch", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = high > low ? ClampPixel((v - low) * 255.0f / (high - low)) : v;
+	return op;
+}
+
+PointOp InvertOp() {
+	PointOp op = { "invert", vector<int>(256) };
+	for (int v = 0; v < 256; v++)
+		op.table[v] = 255 - v;
+	return op;
+}
+
+// An ordered chain of point operations
+class PointPipeline {
+public:
+	void Add(const PointOp& op) {
+		ops.push_back(op);
+	}
+
+	bool Empty() const {
+		return ops.empty();
+	}
+
+	// Passes every entry of lut through the chain in order, so applying the result is the same as
+	// applying lut followed by every operation
+	void ComposeInto(vector<int>& lut) const {
+		for (int& value : lut) {
+			for (const PointOp& op : ops)
+				value = op.table[min(255, max(0, value))];
+		}
+	}
+
+	// The whole chain as one table
+	vector<int> Table() const {
+		vector<int> lut(256);
+		for (int v = 0; v < 256; v++)
+			lut[v] = v;
+		ComposeInto(lut);
+		return lut;
+	}
+
+	string ToString() const {
+		string text;
+		for (const PointOp& op : ops)
+			text += (text.empty() ? "" : " -> ") + op.name;
+		return text;
+	}
+
+private:
+	vector<PointOp> ops;
+};
+
+// Parses a comma separated chain such as "gamma=0.8,contrast=1.2,brightness=-10,threshold=128,invert",
+// applied left to right
+PointPipeline ParsePointPipeline(const string& text) {
+	PointPipeline pipeline;
+	istringstream entries(text);
+	for (string entry; getline(entries, entry, ',');) {
+		if (entry.empty())
+			continue;
+
+		size_t equals = entry.find('=');
+		string name = entry.substr(0, equals);
+		bool hasValue = equals != string::npos;
+		float value = hasValue ? stof(entry.substr(equals + 1)) : 0.0f;
+
+		if (name == "invert") pipeline.Add(InvertOp());
+		else if (!hasValue) throw invalid_argument("point operation " + name + " needs a value, e.g. " + name + "=1");
+		else if (name == "gamma") pipeline.Add(GammaOp(value));
+		else if (name == "brightness") pipeline.Add(BrightnessOp(value));
+		else if (name == "contrast") pipeline.Add(ContrastOp(value));
+		else if (name == "threshold") pipeline.Add(ThresholdOp((int)value));
+		else throw invalid_argument("unknown point operation " + name);
+	}
+	return pipeline;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstring>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Fast 64-bit hash of a block of memory, eight bytes at a time with a multiply/xor-shift mix per word
+unsigned long long HashBytes(const void* data, size_t size, unsigned long long seed = 0) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	unsigned long long hash = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long word;
+		memcpy(&word, bytes + i, 8);
+		word *= 0xbf58476d1ce4e5b9ULL;
+		word ^= word >> 31;
+		hash = (hash ^ word) * 0x94d049bb133111ebULL;
+	}
+	// Remaining 0-7 bytes
+	unsigned long long tail = 0;
+	for (int shift = 0; i < size; i++, shift += 8)
+		tail |= (unsigned long long)bytes[i] << shift;
+	hash = (hash ^ tail) * 0x94d049bb133111ebULL;
+
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Cached result of one operation on one image: its LUT(s), which are always kept as they are small, and
+// optionally the whole output
+struct CachedResult {
+	vector<int> luts; // 256 entries per channel
+	vector<unsigned char> output; // empty unless outputs are cached
+};
+
+// Content-addressed cache of operation results. Entries are keyed by a hash of the pixel data and the
+// operation parameters, so a repeated image is recognised however it arrives, and the least recently used
+// entries are evicted to keep the stored LUTs and outputs within a memory bound.
+class ResultCache {
+public:
+	ResultCache(size_t maxBytes = 64 << 20, bool storeOutputs = false) : maxBytes(maxBytes), storeOutputs(storeOutputs) {}
+
+	// Key for an image's pixels and dimensions under the given operation parameters
+	static unsigned long long MakeKey(const unsigned char* pixels, int width, int height, int spectrum, const string& params) {
+		stringstream text;
+		text << params << ";" << width << "x" << height << "x" << spectrum;
+		string description = text.str();
+		return HashBytes(pixels, (size_t)width * height * spectrum, HashBytes(description.data(), description.size()));
+	}
+
+	// Returns the cached result and marks it most recently used, or NULL on a miss
+	const CachedResult* Find(unsigned long long key) {
+		unordered_map<unsigned long long, list<Entry>::iterator>::iterator it = index.find(key);
+		if (it == index.end()) {
+			misses++;
+			return NULL;
+		}
+
+		entries.splice(entries.begin(), entries, it->second);
+		hits++;
+		if (!it->second->result.output.empty())
+			outputHits++;
+		return &it->second->result;
+	}
+
+	void Insert(unsigned long long key, CachedResult result) {
+		if (!storeOutputs)
+			result.output.clear();
+		size_t size = Size(result);
+		if (size > maxBytes)
+			return;
+
+		unordered_map<unsigned long long, list<Entry>::iterator>::iterator it = index.find(key);
+		if (it != index.end()) {
+			bytes -= Size(it->second->result);
+			entries.erase(it->second);
+			index.erase(it);
+		}
+
+		entries.push_front(Entry{ key, std::move(result) });
+		index[key] = entries.begin();
+		bytes += size;
+
+		// Evict from the least recently used end until the cache fits again
+		while (bytes > maxBytes) {
+			bytes -= Size(entries.back().result);
+			index.erase(entries.back().key);
+			entries.pop_back();
+			evictions++;
+		}
+	}
+
+	bool StoresOutputs() const {
+		return storeOutputs;
+	}
+
+	double HitRate() const {
+		return hits + misses > 0 ? (double)hits / (hits + misses) : 0.0;
+	}
+
+	string Summary() const {
+		stringstream text;
+		text << "Result cache: " << hits << " hits (" << outputHits << " with output), " << misses << " misses, hit rate "
+			<< 100.0 * HitRate() << "%, " << entries.size() << " entries, " << bytes << " of " << maxBytes << " bytes, "
+			<< evictions << " evictions";
+		return text.str();
+	}
+
+private:
+	struct Entry {
+		unsigned long long key;
+		CachedResult result;
+	};
+
+	list<Entry> entries; // most recently used first
+	unordered_map<unsigned long long, list<Entry>::iterator> index;
+	size_t maxBytes;
+	bool storeOutputs;
+	size_t bytes = 0;
+	size_t hits = 0, misses = 0, outputHits = 0, evictions = 0;
+
+	static size_t Size(const CachedResult& result) {
+		return sizeof(Entry) + result.luts.size() * sizeof(int) + result.output.size();
+	}
+};
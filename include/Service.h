@@ -0,0 +1,552 @@
+#pragma once
+
+// Long-running equalisation service over a UNIX domain socket, POSIX only
+#ifndef _WIN32
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+using namespace std;
+
+/*
+	Protocol
+	--------
+	Every message, in either direction, is a MessageHeader followed by length payload bytes, all fields
+	32-bit unsigned in host byte order (both ends are on the same machine).
+
+	Requests (code is the request type):
+	  REQUEST_PIXELS   width, height, spectrum of a planar 8-bit image, payload the pixels
+	  REQUEST_FILES    payload "input path\noutput path", the image is decoded and saved by the service
+	  REQUEST_STATS    no payload, the reply payload is the latency and throughput counters as text
+	  REQUEST_SHUTDOWN no payload, the service stops after replying
+	  REQUEST_ATTACH   payload the name of a SharedRing the client created, mapped for the rest of the connection
+	  REQUEST_SLOT     width, height, spectrum of a planar 8-bit image the client placed in a slot of its ring,
+	                   payload the 32-bit slot index, the equalised image replaces it in place
+
+	Replies (code is 0 on success, 1 on failure with the error message as payload): a pixels request is
+	answered with the equalised image in the same layout, the other requests with an empty payload. A client
+	must leave a slot alone from sending its REQUEST_SLOT until the reply arrives, and may have any number of
+	slots in flight at once.
+*/
+
+const uint32_t SERVICE_MAGIC = 0x31514548; // "HEQ1"
+const uint32_t MAX_PAYLOAD = 1u << 30; // Largest payload accepted, guards against garbage headers
+
+enum RequestType {
+	REQUEST_PIXELS = 0,
+	REQUEST_FILES = 1,
+	REQUEST_STATS = 2,
+	REQUEST_SHUTDOWN = 3,
+	REQUEST_ATTACH = 4,
+	REQUEST_SLOT = 5
+};
+
+struct MessageHeader {
+	uint32_t magic = SERVICE_MAGIC;
+	uint32_t code = 0; // request type, or reply status
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t spectrum = 0;
+	uint32_t length = 0; // payload bytes
+};
+
+// Reads or writes exactly size bytes, returns false when the connection closes or fails first
+bool ReadFull(int fd, void* data, size_t size) {
+	char* bytes = (char*)data;
+	while (size > 0) {
+		ssize_t count = read(fd, bytes, size);
+		if (count <= 0)
+			return false;
+		bytes += count;
+		size -= count;
+	}
+	return true;
+}
+
+bool WriteFull(int fd, const void* data, size_t size) {
+	const char* bytes = (const char*)data;
+	while (size > 0) {
+		ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (count <= 0)
+			return false;
+		bytes += count;
+		size -= count;
+	}
+	return true;
+}
+
+bool ReadMessage(int fd, MessageHeader& header, vector<unsigned char>& payload) {
+	if (!ReadFull(fd, &header, sizeof(header)) || header.magic != SERVICE_MAGIC || header.length > MAX_PAYLOAD)
+		return false;
+	payload.resize(header.length);
+	return header.length == 0 || ReadFull(fd, &payload[0], header.length);
+}
+
+bool WriteMessage(int fd, MessageHeader header, const void* payload, size_t length) {
+	header.length = (uint32_t)length;
+	return WriteFull(fd, &header, sizeof(header)) && (length == 0 || WriteFull(fd, payload, length));
+}
+
+// Header on the first page of a shared-memory ring
+struct RingHeader {
+	uint32_t magic = SERVICE_MAGIC;
+	uint32_t slots = 0;
+	uint64_t slotSize = 0; // bytes per slot, a multiple of the page size
+};
+
+// POSIX shared memory split into fixed-size slots, so clients can hand the service images without
+// sending the pixels over the socket. The client creates the ring and fills slots, the service maps the
+// same pages and equalises the slots in place. Slots start on page boundaries, which keeps them aligned
+// for CL_MEM_USE_HOST_PTR.
+class SharedRing {
+public:
+	// Creates and maps a ring of slots of at least slotSize bytes each, the client's side. The name is
+	// unlinked again when the ring is destroyed.
+	static shared_ptr<SharedRing> Create(const string& name, uint32_t slots, size_t slotSize) {
+		size_t page = PageSize();
+		slotSize = (slotSize + page - 1) / page * page;
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+			throw runtime_error("could not create shared memory " + name);
+		shared_ptr<SharedRing> ring(new SharedRing(name, page + slots * slotSize, true));
+		if (ftruncate(fd, ring->size) != 0 || !ring->Map(fd)) {
+			close(fd);
+			throw runtime_error("could not map shared memory " + name);
+		}
+		close(fd);
+
+		RingHeader* header = (RingHeader*)ring->base;
+		*header = RingHeader();
+		header->slots = slots;
+		header->slotSize = slotSize;
+		ring->header = *header;
+		return ring;
+	}
+
+	// Maps a ring a client created, the service's side
+	static shared_ptr<SharedRing> Attach(const string& name) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+			throw runtime_error("no shared memory named " + name);
+		struct stat info;
+		shared_ptr<SharedRing> ring;
+		if (fstat(fd, &info) == 0 && (size_t)info.st_size >= PageSize()) {
+			ring.reset(new SharedRing(name, info.st_size, false));
+			if (!ring->Map(fd))
+				ring.reset();
+		}
+		close(fd);
+		if (!ring)
+			throw runtime_error("could not map shared memory " + name);
+
+		// Copy the header so a client cannot change the layout under the service
+		ring->header = *(RingHeader*)ring->base;
+		uint64_t needed = PageSize() + (uint64_t)ring->header.slots * ring->header.slotSize;
+		if (ring->header.magic != SERVICE_MAGIC || ring->header.slotSize % PageSize() != 0 || needed > ring->size)
+			throw runtime_error(name + " is not a shared-memory ring");
+		// The kernels index the ring with int offsets
+		if (needed > (uint64_t)INT32_MAX)
+			throw runtime_error(name + " is larger than 2 GB");
+		return ring;
+	}
+
+	~SharedRing() {
+		// The device buffer may use the pages, so it goes first
+		buffer = cl::Buffer();
+		if (base)
+			munmap(base, size);
+		if (owner)
+			shm_unlink(name.c_str());
+	}
+
+	uint32_t Slots() const {
+		return header.slots;
+	}
+
+	size_t SlotSize() const {
+		return (size_t)header.slotSize;
+	}
+
+	// Offset of a slot from the start of the mapping
+	size_t Offset(uint32_t slot) const {
+		return PageSize() + slot * SlotSize();
+	}
+
+	unsigned char* Slot(uint32_t slot) {
+		return base + Offset(slot);
+	}
+
+	// The whole mapping, header included
+	unsigned char* Data() {
+		return base;
+	}
+
+	size_t Size() const {
+		return size;
+	}
+
+	// Device view of the whole mapping on CPU devices, created and only used by the device thread
+	cl::Buffer buffer;
+
+private:
+	string name;
+	size_t size;
+	bool owner;
+	unsigned char* base = NULL;
+	RingHeader header;
+
+	SharedRing(const string& name, size_t size, bool owner) : name(name), size(size), owner(owner) {}
+
+	bool Map(int fd) {
+		void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED)
+			return false;
+		base = (unsigned char*)mapped;
+		return true;
+	}
+
+	static size_t PageSize() {
+		return (size_t)sysconf(_SC_PAGESIZE);
+	}
+};
+
+// One image waiting for the device thread, which fills in output or error and then sets done
+struct ServiceRequest {
+	CImg<unsigned char> image;
+	CImg<unsigned char> output;
+	// Set instead of image when the pixels are in a slot of a client's ring, the output then replaces them
+	shared_ptr<SharedRing> ring;
+	uint32_t slot = 0;
+	uint32_t width = 0, height = 0, spectrum = 0;
+	string error;
+	promise<void> done;
+};
+
+// Image request latencies, from the request being read to its reply being written, and throughput since start
+class LatencyStats {
+public:
+	LatencyStats() : start(GetHostTime()) {}
+
+	void Add(long long latency) {
+		lock_guard<mutex> lock(guard);
+		// Percentiles are taken over the most recent WINDOW requests
+		if (latencies.size() < WINDOW)
+			latencies.push_back(latency);
+		else
+			latencies[count % WINDOW] = latency;
+		count++;
+	}
+
+	string Summary() {
+		lock_guard<mutex> lock(guard);
+		vector<long long> sorted = latencies;
+		sort(sorted.begin(), sorted.end());
+		double elapsed = (GetHostTime() - start) * 1e-9;
+
+		stringstream text;
+		text << "requests " << count << ", throughput " << (elapsed > 0 ? count / elapsed : 0.0) << " req/s";
+		if (!sorted.empty()) {
+			text << ", latency p50 " << sorted[(sorted.size() - 1) / 2] * 1e-6 << " ms, p99 "
+				<< sorted[(size_t)((sorted.size() - 1) * 0.99)] * 1e-6 << " ms";
+		}
+		return text.str();
+	}
+
+private:
+	static const size_t WINDOW = 100000;
+
+	mutex guard;
+	vector<long long> latencies;
+	size_t count = 0;
+	long long start;
+};
+
+// Accepts connections on a UNIX domain socket and serves each on its own thread. Connection threads decode
+// and encode files themselves and queue the images for the device thread, which takes them in batches
+// through NextBatch, so many clients share every launch.
+class EqualisationService {
+public:
+	// maxBuffer is the largest buffer the device can allocate, and wholeRing says whether slot requests use
+	// one device buffer over the whole ring rather than one per slot
+	EqualisationService(const string& socketPath, size_t maxBuffer = SIZE_MAX, bool wholeRing = false) : path(socketPath), maxBuffer(maxBuffer), wholeRing(wholeRing) {
+		if (path.size() >= sizeof(sockaddr_un::sun_path))
+			throw runtime_error("socket path too long: " + path);
+
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenFd < 0)
+			throw runtime_error("could not create a socket");
+
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, path.c_str());
+		unlink(path.c_str()); // a socket left behind by an earlier run
+		if (::bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+			close(listenFd);
+			throw runtime_error("could not listen on " + path);
+		}
+
+		acceptThread = thread(&EqualisationService::AcceptLoop, this);
+	}
+
+	~EqualisationService() {
+		Stop();
+		// Unblock the accept and every connection waiting for its next request, then wait for them
+		shutdown(listenFd, SHUT_RDWR);
+		acceptThread.join();
+		close(listenFd);
+		{
+			lock_guard<mutex> lock(guard);
+			for (int fd : connections)
+				shutdown(fd, SHUT_RDWR);
+		}
+		for (auto& connection : connectionThreads)
+			connection.second.join();
+		unlink(path.c_str());
+	}
+
+	// Waits for a request, then up to window ns for more, and takes up to maxBatch of them. Returns false
+	// once the service is stopping.
+	bool NextBatch(vector<shared_ptr<ServiceRequest>>& batch, long long window, size_t maxBatch) {
+		batch.clear();
+		unique_lock<mutex> lock(guard);
+		available.wait(lock, [this] { return stopping || !pending.empty(); });
+		if (stopping)
+			return false;
+
+		// Give other clients a short window to join the batch
+		available.wait_for(lock, chrono::nanoseconds(window), [&] { return stopping || pending.size() >= maxBatch; });
+		while (!pending.empty() && batch.size() < maxBatch) {
+			batch.push_back(pending.front());
+			pending.pop_front();
+		}
+		return true;
+	}
+
+	void Stop() {
+		lock_guard<mutex> lock(guard);
+		stopping = true;
+		// Fail whatever the device thread will no longer take
+		for (shared_ptr<ServiceRequest>& request : pending) {
+			request->error = "service shutting down";
+			request->done.set_value();
+		}
+		pending.clear();
+		available.notify_all();
+	}
+
+	bool Stopping() {
+		lock_guard<mutex> lock(guard);
+		return stopping;
+	}
+
+	LatencyStats& Stats() {
+		return stats;
+	}
+
+private:
+	string path;
+	size_t maxBuffer;
+	bool wholeRing;
+	int listenFd;
+	thread acceptThread;
+	map<unsigned long long, thread> connectionThreads; // by connection id, only touched by the accept thread until it has been joined
+	unsigned long long nextConnection = 0;
+	set<int> connections;
+	vector<unsigned long long> finished; // connections whose thread has returned and can be joined
+
+	mutex guard;
+	condition_variable available;
+	deque<shared_ptr<ServiceRequest>> pending;
+	bool stopping = false;
+	LatencyStats stats;
+
+	void AcceptLoop() {
+		for (;;) {
+			int fd = accept(listenFd, NULL, NULL);
+			if (fd < 0)
+				return;
+			// Join the threads of connections that have closed so a long-running service does not keep them
+			vector<unsigned long long> done;
+			{
+				lock_guard<mutex> lock(guard);
+				done.swap(finished);
+			}
+			for (unsigned long long id : done) {
+				connectionThreads[id].join();
+				connectionThreads.erase(id);
+			}
+
+			lock_guard<mutex> lock(guard);
+			if (stopping) {
+				close(fd);
+				return;
+			}
+			connections.insert(fd);
+			unsigned long long id = nextConnection++;
+			connectionThreads[id] = thread(&EqualisationService::Serve, this, fd, id);
+		}
+	}
+
+	// Queues a request for the device thread and waits for it to be done
+	bool Submit(const shared_ptr<ServiceRequest>& request, string& error) {
+		future<void> done = request->done.get_future();
+		{
+			lock_guard<mutex> lock(guard);
+			if (stopping) {
+				error = "service shutting down";
+				return false;
+			}
+			pending.push_back(request);
+			available.notify_all();
+		}
+		done.wait();
+		error = request->error;
+		return error.empty();
+	}
+
+	bool Equalise(const CImg<unsigned char>& image, CImg<unsigned char>& output, string& error) {
+		shared_ptr<ServiceRequest> request = make_shared<ServiceRequest>();
+		request->image = image;
+		bool equalised = Submit(request, error);
+		output = std::move(request->output);
+		return equalised;
+	}
+
+	// Equalises an image in a slot of ring in place
+	void EqualiseSlot(const shared_ptr<SharedRing>& ring, const MessageHeader& header, const vector<unsigned char>& payload, string& error) {
+		if (!ring) {
+			error = "no shared-memory ring attached";
+			return;
+		}
+		shared_ptr<ServiceRequest> request = make_shared<ServiceRequest>();
+		request->ring = ring;
+		request->width = header.width;
+		request->height = header.height;
+		request->spectrum = header.spectrum;
+		if (payload.size() != sizeof(uint32_t)) {
+			error = "slot payload must be the slot index";
+			return;
+		}
+		memcpy(&request->slot, &payload[0], sizeof(uint32_t));
+
+		uint64_t size = (uint64_t)header.width * header.height * header.spectrum;
+		if (request->slot >= ring->Slots())
+			error = "slot " + to_string(request->slot) + " is outside the ring";
+		else if (size == 0 || size > ring->SlotSize())
+			error = "image dimensions do not fit a slot";
+		else if (wholeRing && ring->Size() > maxBuffer)
+			error = "ring of " + to_string(ring->Size()) + " bytes is larger than the device's largest buffer of " + to_string(maxBuffer) + " bytes";
+		else if (size > maxBuffer)
+			error = "image is larger than the device's largest buffer of " + to_string(maxBuffer) + " bytes";
+		else
+			Submit(request, error);
+	}
+
+	// Answers one client's requests in order until it disconnects
+	void Serve(int fd, unsigned long long id) {
+		MessageHeader header;
+		vector<unsigned char> payload;
+		shared_ptr<SharedRing> ring; // the client's shared-memory ring once attached
+		while (ReadMessage(fd, header, payload)) {
+			long long received = GetHostTime();
+			MessageHeader reply;
+			string error;
+			bool written = true;
+			bool image = header.code == REQUEST_PIXELS || header.code == REQUEST_FILES || header.code == REQUEST_SLOT;
+
+			if (header.code == REQUEST_PIXELS) {
+				CImg<unsigned char> output;
+				if ((size_t)header.width * header.height * header.spectrum != payload.size() || payload.empty())
+					error = "pixel payload does not match the image dimensions";
+				else
+					Equalise(CImg<unsigned char>(&payload[0], header.width, header.height, 1, header.spectrum), output, error);
+				reply.width = output.width();
+				reply.height = output.height();
+				reply.spectrum = output.spectrum();
+				written = error.empty() ? WriteMessage(fd, reply, output.data(), output.size()) : true;
+			}
+			else if (header.code == REQUEST_FILES) {
+				string text(payload.begin(), payload.end());
+				size_t newline = text.find('\n');
+				if (newline == string::npos) {
+					error = "files payload must be the input and output paths separated by a newline";
+				}
+				else {
+					try {
+						CImg<unsigned char> image(text.substr(0, newline).c_str()), output;
+						if (Equalise(image, output, error))
+							output.save(text.substr(newline + 1).c_str());
+					}
+					catch (CImgException& err) {
+						error = err.what();
+					}
+				}
+				written = error.empty() ? WriteMessage(fd, reply, NULL, 0) : true;
+			}
+			else if (header.code == REQUEST_SLOT) {
+				EqualiseSlot(ring, header, payload, error);
+				written = error.empty() ? WriteMessage(fd, reply, NULL, 0) : true;
+			}
+			else if (header.code == REQUEST_ATTACH) {
+				try {
+					ring = SharedRing::Attach(string(payload.begin(), payload.end()));
+				}
+				catch (const runtime_error& err) {
+					error = err.what();
+				}
+				written = error.empty() ? WriteMessage(fd, reply, NULL, 0) : true;
+			}
+			else if (header.code == REQUEST_STATS) {
+				string summary = stats.Summary();
+				written = WriteMessage(fd, reply, summary.data(), summary.size());
+			}
+			else if (header.code == REQUEST_SHUTDOWN) {
+				written = WriteMessage(fd, reply, NULL, 0);
+				Stop();
+			}
+			else {
+				error = "unknown request type " + to_string(header.code);
+			}
+
+			if (!error.empty()) {
+				reply.code = 1;
+				written = WriteMessage(fd, reply, error.data(), error.size());
+			}
+			if (image)
+				stats.Add(GetHostTime() - received);
+			if (!written)
+				break;
+		}
+
+		lock_guard<mutex> lock(guard);
+		connections.erase(fd);
+		close(fd);
+		finished.push_back(id);
+	}
+};
+
+#endif
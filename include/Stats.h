@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+using namespace std;
+
+// Summary statistics of one channel, reduced on the device alongside its histogram
+struct ChannelStats {
+	int pixels = 0;
+	int min = 0;
+	int max = 0;
+	unsigned long long sum = 0;
+	unsigned long long sumSquares = 0;
+
+	double Mean() const {
+		return pixels > 0 ? (double)sum / pixels : 0.0;
+	}
+
+	// Population variance
+	double Variance() const {
+		if (pixels == 0)
+			return 0.0;
+		double mean = Mean();
+		return std::max(0.0, (double)sumSquares / pixels - mean * mean);
+	}
+};
+
+// Histograms of every channel, 256 bins each, with their statistics
+struct HistogramStats {
+	vector<int> hist;
+	vector<ChannelStats> channels;
+};
+
+string FormatChannelStats(const ChannelStats& stats) {
+	stringstream text;
+	text << "min " << stats.min << ", max " << stats.max << ", mean " << stats.Mean()
+		<< ", variance " << stats.Variance() << ", std dev " << sqrt(stats.Variance());
+	return text.str();
+}
+
+// Computes the histogram and statistics of every channel of a planar image already on the device with one
+// histogram_stats launch
+HistogramStats ComputeHistogramStats(cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& image, int planeSize, int channels, ProfilingReport& profiler) {
+	const size_t LOCAL_SIZE = 256;
+	const size_t PIXELS_PER_ITEM = 16; // histogram_stats relies on no work-item reading more than 16 pixels
+	const int STATS_WORDS = 6; // min, max, sum low/high, sum of squares low/high
+	const size_t HIST_SIZE = channels * 256 * sizeof(int);
+	cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+	cl::Event prof;
+
+	cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	cl::Buffer statsBuffer(context, CL_MEM_READ_WRITE, channels * STATS_WORDS * sizeof(cl_uint));
+
+	// Every channel starts with min 255 so the atomic minimum can only lower it
+	vector<cl_uint> words(channels * STATS_WORDS, 0);
+	for (int c = 0; c < channels; c++)
+		words[c * STATS_WORDS] = 255;
+
+	queue.enqueueFillBuffer(histBuffer, 0, 0, HIST_SIZE, NULL, &prof);
+	profiler.Add("Stats histogram fill", prof, HIST_SIZE);
+	queue.enqueueWriteBuffer(statsBuffer, CL_FALSE, 0, words.size() * sizeof(cl_uint), &words[0], NULL, &prof);
+	profiler.Add("Stats initial write", prof, words.size() * sizeof(cl_uint));
+
+	cl::Kernel kernelStats(program, "histogram_stats");
+	kernelStats.setArg(0, image);
+	kernelStats.setArg(1, histBuffer);
+	kernelStats.setArg(2, statsBuffer);
+	kernelStats.setArg(3, cl::Local(256 * sizeof(int)));
+	kernelStats.setArg(4, planeSize);
+	size_t items = RoundUp((planeSize + PIXELS_PER_ITEM - 1) / PIXELS_PER_ITEM, LOCAL_SIZE);
+	queue.enqueueNDRangeKernel(kernelStats, cl::NullRange, cl::NDRange(items, channels), cl::NDRange(LOCAL_SIZE, 1), NULL, &prof);
+	profiler.Add("Stats histogram kernel", prof, (size_t)planeSize * channels);
+
+	HistogramStats result;
+	result.hist.resize(channels * 256);
+	queue.enqueueReadBuffer(histBuffer, CL_FALSE, 0, HIST_SIZE, &result.hist[0], NULL, &prof);
+	profiler.Add("Stats histogram read", prof, HIST_SIZE);
+	queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, words.size() * sizeof(cl_uint), &words[0], NULL, &prof);
+	profiler.Add("Stats read", prof, words.size() * sizeof(cl_uint));
+
+	for (int c = 0; c < channels; c++) {
+		const cl_uint* w = &words[c * STATS_WORDS];
+		ChannelStats stats;
+		stats.pixels = planeSize;
+		stats.min = (int)w[0];
+		stats.max = (int)w[1];
+		stats.sum = ((unsigned long long)w[3] << 32) | w[2];
+		stats.sumSquares = ((unsigned long long)w[5] << 32) | w[4];
+		result.channels.push_back(stats);
+	}
+	return result;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CImg.h"
+
+using namespace cimg_library;
+using namespace std;
+
+// One frame of a sequence. pixels holds the planes that are equalised (every channel of a PGM/PPM frame,
+// the luma plane of a Y4M frame) one after the other, chroma holds Y4M chroma planes passed through as-is.
+struct Frame {
+	int index = 0;
+	int width = 0;
+	int height = 0;
+	int planes = 0;
+	vector<unsigned char> pixels;
+	vector<unsigned char> chroma;
+};
+
+// Returns true when filename ends with the given extension, ignoring case
+bool HasExtension(const string& filename, const string& extension) {
+	if (filename.size() < extension.size())
+		return false;
+	for (size_t i = 0; i < extension.size(); i++) {
+		if (tolower(filename[filename.size() - extension.size() + i]) != tolower(extension[i]))
+			return false;
+	}
+	return true;
+}
+
+// Expands a printf style pattern such as frames/%04d.pgm for one frame index
+string FormatFrameFilename(const string& pattern, int index) {
+	vector<char> name(pattern.size() + 32);
+	snprintf(&name[0], name.size(), pattern.c_str(), index);
+	return string(&name[0]);
+}
+
+class FrameSource {
+public:
+	virtual ~FrameSource() {}
+	// Reads the next frame, returns false at the end of the sequence
+	virtual bool Read(Frame& frame) = 0;
+	// Y4M stream header describing these frames, for writing the output as Y4M, valid once a frame has been read
+	virtual string Y4MHeader() const = 0;
+};
+
+class FrameSink {
+public:
+	virtual ~FrameSink() {}
+	// Writes a frame with its equalised planes replaced by pixels
+	virtual void Write(const Frame& frame, const vector<unsigned char>& pixels) = 0;
+};
+
+// Numbered PGM/PPM files, starting from frame 0 or 1 and ending at the first missing number
+class SequenceSource : public FrameSource {
+public:
+	SequenceSource(const string& pattern) : pattern(pattern) {
+		next = Exists(FormatFrameFilename(pattern, 0)) ? 0 : 1;
+	}
+
+	bool Read(Frame& frame) {
+		string filename = FormatFrameFilename(pattern, next);
+		if (!Exists(filename))
+			return false;
+
+		CImg<unsigned char> image(filename.c_str());
+		frame.index = next++;
+		frame.width = width = image.width();
+		frame.height = height = image.height();
+		frame.planes = image.spectrum();
+		frame.pixels.assign(image.begin(), image.end());
+		frame.chroma.clear();
+		return true;
+	}
+
+	string Y4MHeader() const {
+		return "YUV4MPEG2 W" + to_string(width) + " H" + to_string(height) + " F25:1 Ip A1:1 Cmono";
+	}
+
+private:
+	string pattern;
+	int next;
+	int width = 0, height = 0;
+
+	static bool Exists(const string& filename) {
+		return ifstream(filename).good();
+	}
+};
+
+// Raw YUV4MPEG2 stream, the luma plane is equalised and the chroma planes are passed through
+class Y4MSource : public FrameSource {
+public:
+	Y4MSource(const string& filename) : file(filename, ios::binary) {
+		if (!file)
+			throw runtime_error("could not open " + filename);
+		getline(file, header);
+		if (header.compare(0, 9, "YUV4MPEG2") != 0)
+			throw runtime_error(filename + " is not a YUV4MPEG2 stream");
+
+		// Parse the width, height and chroma subsampling tags, 4:2:0 is the default
+		string colourspace = "420";
+		istringstream tags(header.substr(9));
+		for (string tag; tags >> tag;) {
+			if (tag[0] == 'W') width = stoi(tag.substr(1));
+			else if (tag[0] == 'H') height = stoi(tag.substr(1));
+			else if (tag[0] == 'C') colourspace = tag.substr(1);
+		}
+
+		int halfWidth = (width + 1) / 2, halfHeight = (height + 1) / 2;
+		if (colourspace.compare(0, 4, "mono") == 0) chromaSize = 0;
+		else if (colourspace == "444alpha") chromaSize = 3 * width * height; // alpha plane passed through with the chroma
+		else if (colourspace.compare(0, 3, "444") == 0) chromaSize = 2 * width * height;
+		else if (colourspace.compare(0, 3, "422") == 0) chromaSize = 2 * halfWidth * height;
+		else if (colourspace.compare(0, 3, "420") == 0) chromaSize = 2 * halfWidth * halfHeight;
+		else throw runtime_error("unsupported Y4M colourspace " + colourspace);
+	}
+
+	bool Read(Frame& frame) {
+		string frameHeader;
+		if (!getline(file, frameHeader) || frameHeader.compare(0, 5, "FRAME") != 0)
+			return false;
+
+		frame.index = index++;
+		frame.width = width;
+		frame.height = height;
+		frame.planes = 1;
+		frame.pixels.resize((size_t)width * height);
+		frame.chroma.resize(chromaSize);
+		file.read((char*)&frame.pixels[0], frame.pixels.size());
+		if (chromaSize > 0)
+			file.read((char*)&frame.chroma[0], chromaSize);
+		return (bool)file;
+	}
+
+	string Y4MHeader() const {
+		return header;
+	}
+
+private:
+	ifstream file;
+	string header;
+	int width = 0, height = 0, index = 0;
+	size_t chromaSize = 0;
+};
+
+// Numbered PGM/PPM files written with the input frame numbers
+class SequenceSink : public FrameSink {
+public:
+	SequenceSink(const string& pattern) : pattern(pattern) {}
+
+	void Write(const Frame& frame, const vector<unsigned char>& pixels) {
+		CImg<unsigned char> image(&pixels[0], frame.width, frame.height, 1, frame.planes);
+		image.save(FormatFrameFilename(pattern, frame.index).c_str());
+	}
+
+private:
+	string pattern;
+};
+
+class Y4MSink : public FrameSink {
+public:
+	Y4MSink(const string& filename, const string& header) : file(filename, ios::binary) {
+		if (!file)
+			throw runtime_error("could not create " + filename);
+		file << header << "\n";
+	}
+
+	void Write(const Frame& frame, const vector<unsigned char>& pixels) {
+		if (frame.planes != 1)
+			throw runtime_error("only greyscale or Y4M frames can be written as Y4M");
+		file << "FRAME\n";
+		file.write((const char*)&pixels[0], pixels.size());
+		if (!frame.chroma.empty())
+			file.write((const char*)&frame.chroma[0], frame.chroma.size());
+	}
+
+private:
+	ofstream file;
+};
+
+// Opens a .y4m file or a printf pattern of numbered PGM/PPM files
+unique_ptr<FrameSource> OpenFrameSource(const string& name) {
+	if (HasExtension(name, ".y4m"))
+		return unique_ptr<FrameSource>(new Y4MSource(name));
+	return unique_ptr<FrameSource>(new SequenceSource(name));
+}
+
+unique_ptr<FrameSink> OpenFrameSink(const string& name, const FrameSource& source) {
+	if (HasExtension(name, ".y4m"))
+		return unique_ptr<FrameSink>(new Y4MSink(name, source.Y4MHeader()));
+	return unique_ptr<FrameSink>(new SequenceSink(name));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <cmath>
+
+#include "CImg.h"
+
+using namespace cimg_library;
+using namespace std;
+
+// Pixel value distributions used to generate synthetic test images
+enum SyntheticDistribution {
+	DIST_UNIFORM,  // every value equally likely, spreads histogram atomics evenly over all bins
+	DIST_GAUSSIAN, // values clustered around mid-grey
+	DIST_CONSTANT, // every pixel the same value, worst-case atomic contention on a single bin
+	DIST_NATURAL   // smooth low-frequency structure plus sensor noise, similar to a photograph
+};
+
+const SyntheticDistribution ALL_DISTRIBUTIONS[] = { DIST_UNIFORM, DIST_GAUSSIAN, DIST_CONSTANT, DIST_NATURAL };
+
+string GetDistributionName(SyntheticDistribution distribution) {
+	switch (distribution) {
+	case DIST_UNIFORM: return "uniform";
+	case DIST_GAUSSIAN: return "gaussian";
+	case DIST_CONSTANT: return "constant";
+	case DIST_NATURAL: return "natural";
+	default: return "unknown";
+	}
+}
+
+// Generates a width x height image with 1 (greyscale) or 3 (RGB) channels entirely in memory.
+// The same seed always produces the same image so runs are comparable.
+CImg<unsigned char> GenerateSyntheticImage(int width, int height, int spectrum, SyntheticDistribution distribution, unsigned int seed = 42) {
+	CImg<unsigned char> image(width, height, 1, spectrum);
+	mt19937 rng(seed);
+
+	switch (distribution) {
+	case DIST_UNIFORM: {
+		uniform_int_distribution<int> value(0, 255);
+		for (unsigned char& pixel : image)
+			pixel = (unsigned char)value(rng);
+		break;
+	}
+	case DIST_GAUSSIAN: {
+		normal_distribution<float> value(128.0f, 32.0f);
+		for (unsigned char& pixel : image)
+			pixel = (unsigned char)min(255.0f, max(0.0f, value(rng)));
+		break;
+	}
+	case DIST_CONSTANT:
+		image.fill(200);
+		break;
+	case DIST_NATURAL:
+	default: {
+		// A few overlapping low-frequency waves and a gradient give large smooth regions, the noise
+		// spreads each region over neighbouring bins the way a real sensor does
+		normal_distribution<float> noise(0.0f, 6.0f);
+		for (int c = 0; c < spectrum; c++) {
+			float phase = 0.7f * c;
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					float u = (float)x / width, v = (float)y / height;
+					float value = 90.0f + 60.0f * u * v
+						+ 45.0f * sinf(6.3f * u + phase) * cosf(4.1f * v)
+						+ 25.0f * sinf(17.0f * (u + v) + 2.0f * phase)
+						+ noise(rng);
+					image(x, y, 0, c) = (unsigned char)min(255.0f, max(0.0f, value));
+				}
+			}
+		}
+		break;
+	}
+	}
+
+	return image;
+}
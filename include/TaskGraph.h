@@ -0,0 +1,125 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+using namespace std;
+
+// Enqueues commands without blocking and works out their event wait lists from the buffers each one reads
+// and writes: a command waits for the last writer of everything it reads (read after write), and for the
+// last writer and every reader since of everything it writes (write after write, write after read). That is
+// all the ordering an out-of-order queue needs, so independent commands, such as the work of separate
+// channels, are free to overlap, and on an in-order queue the wait lists are simply redundant. Commands can
+// also be spread over several queues, one per lane, in which case the wait lists order them across queues.
+class TaskGraph {
+public:
+	TaskGraph(cl::CommandQueue& queue, ProfilingReport& profiler) : queues(1, queue), profiler(profiler) {}
+	TaskGraph(const vector<cl::CommandQueue>& queues, ProfilingReport& profiler) : queues(queues), profiler(profiler) {}
+
+	// Profiling queue on device from the registry, out-of-order when the device supports it
+	static cl::CommandQueue GetQueue(const cl::Device& device) {
+		cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+		if (DeviceRegistry::Get().Info(device).queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+			properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		return DeviceRegistry::Get().Queue(device, properties);
+	}
+
+	static bool IsOutOfOrder(const cl::CommandQueue& queue) {
+		return (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+	}
+
+	// Queue of a lane, lanes beyond the number of queues share them round-robin
+	cl::CommandQueue& Queue(int lane) {
+		return queues[lane % queues.size()];
+	}
+
+	// Enqueues a stage of one or more commands through enqueue, which is handed the wait list to start from
+	// and must append the event of every command it issues. Returns those events.
+	vector<cl::Event> Enqueue(const string& stage, const vector<cl::Buffer>& inputs, const vector<cl::Buffer>& outputs, size_t bytes,
+		const function<void(const vector<cl::Event>*, vector<cl::Event>*)>& enqueue) {
+		vector<cl::Event> wait;
+		for (const cl::Buffer& buffer : inputs)
+			Append(wait, state[buffer()].writers);
+		for (const cl::Buffer& buffer : outputs) {
+			Append(wait, state[buffer()].writers);
+			Append(wait, state[buffer()].readers);
+		}
+
+		vector<cl::Event> events;
+		enqueue(wait.empty() ? NULL : &wait, &events);
+		profiler.Add(stage, events, bytes);
+		// A command waiting on another queue's event is only guaranteed to start once that queue is flushed
+		if (queues.size() > 1) {
+			for (cl::CommandQueue& queue : queues)
+				queue.flush();
+		}
+
+		for (const cl::Buffer& buffer : inputs)
+			Append(state[buffer()].readers, events);
+		for (const cl::Buffer& buffer : outputs) {
+			state[buffer()].writers = events;
+			state[buffer()].readers.clear();
+		}
+		return events;
+	}
+
+	void Write(const string& stage, const cl::Buffer& buffer, size_t size, const void* data, int lane = 0) {
+		Enqueue(stage, {}, { buffer }, size, [&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			cl::Event evnt;
+			Queue(lane).enqueueWriteBuffer(buffer, CL_FALSE, 0, size, data, wait, &evnt);
+			events->push_back(evnt);
+		});
+	}
+
+	void Fill(const string& stage, const cl::Buffer& buffer, size_t size, int lane = 0) {
+		Enqueue(stage, {}, { buffer }, size, [&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			cl::Event evnt;
+			Queue(lane).enqueueFillBuffer(buffer, 0, 0, size, wait, &evnt);
+			events->push_back(evnt);
+		});
+	}
+
+	void Kernel(const string& stage, const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local,
+		const vector<cl::Buffer>& inputs, const vector<cl::Buffer>& outputs, size_t bytes, int lane = 0, const cl::NDRange& offset = cl::NullRange) {
+		Enqueue(stage, inputs, outputs, bytes, [&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			cl::Event evnt;
+			Queue(lane).enqueueNDRangeKernel(kernel, offset, global, local, wait, &evnt);
+			events->push_back(evnt);
+		});
+	}
+
+	// Non-blocking read, data is only valid after Finish
+	void Read(const string& stage, const cl::Buffer& buffer, size_t size, void* data, int lane = 0) {
+		Enqueue(stage, { buffer }, {}, size, [&](const vector<cl::Event>* wait, vector<cl::Event>* events) {
+			cl::Event evnt;
+			Queue(lane).enqueueReadBuffer(buffer, CL_FALSE, 0, size, data, wait, &evnt);
+			events->push_back(evnt);
+		});
+	}
+
+	// The only synchronisation point: waits for every command enqueued so far
+	void Finish() {
+		for (cl::CommandQueue& queue : queues)
+			queue.finish();
+		state.clear();
+	}
+
+private:
+	// Commands that last wrote a buffer, and those that have read it since
+	struct BufferState {
+		vector<cl::Event> writers;
+		vector<cl::Event> readers;
+	};
+
+	vector<cl::CommandQueue> queues;
+	ProfilingReport& profiler;
+	map<cl_mem, BufferState> state;
+
+	static void Append(vector<cl::Event>& to, const vector<cl::Event>& from) {
+		to.insert(to.end(), from.begin(), from.end());
+	}
+};
@@ -4,6 +4,19 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <map>
+#include <iomanip>
+#include <climits>
+#include <mutex>
+#include <tuple>
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -24,18 +37,197 @@ ostream& operator<< (ostream& out, const vector<T>& v) {
 	return out;
 }
 
+// Identity and capabilities of a device, queried once when the registry enumerates it
+struct DeviceInfo {
+	int platform_id = 0;
+	int device_id = 0;
+	cl::Platform platform;
+	cl::Device device;
+	string platformName;
+	string name, version, vendor, driverVersion, extensions;
+	cl_device_type type = 0;
+	cl_uint computeUnits = 0;
+	cl_uint clockFrequency = 0; // [MHz]
+	cl_ulong globalMemSize = 0;
+	cl_ulong localMemSize = 0;
+	cl_ulong maxAllocSize = 0;
+	size_t maxWorkGroupSize = 0;
+	cl_uint baseAddrAlign = 0; // [bits]
+	cl_command_queue_properties queueProperties = 0;
+
+	// Identifies the device across runs whatever order the ICD loader lists it in
+	string Key() const {
+		return name + " | " + driverVersion;
+	}
+
+	bool HasExtension(const string& extension) const {
+		return (" " + extensions + " ").find(" " + extension + " ") != string::npos;
+	}
+
+	string TypeName() const {
+		string text;
+		if (type & CL_DEVICE_TYPE_DEFAULT)
+			text += "DEFAULT ";
+		if (type & CL_DEVICE_TYPE_CPU)
+			text += "CPU ";
+		if (type & CL_DEVICE_TYPE_GPU)
+			text += "GPU ";
+		if (type & CL_DEVICE_TYPE_ACCELERATOR)
+			text += "ACCELERATOR ";
+		return text;
+	}
+};
+
+// Enumerates the platforms and devices once per process and caches their handles and capabilities, so
+// looking a device up no longer goes back to the ICD loader. Contexts and queues are created the first
+// time they are asked for and handed out again afterwards, so every operation on a device shares them.
+class DeviceRegistry {
+public:
+	static DeviceRegistry& Get() {
+		// Never destroyed: releasing OpenCL objects during static destruction can run after the ICD has unloaded
+		static DeviceRegistry* registry = new DeviceRegistry();
+		return *registry;
+	}
+
+	size_t PlatformCount() const {
+		return platforms.size();
+	}
+
+	const cl::Platform& Platform(int platform_id) const {
+		return GetPlatform(platform_id).platform;
+	}
+
+	const string& PlatformName(int platform_id) const {
+		return GetPlatform(platform_id).name;
+	}
+
+	const string& PlatformVersion(int platform_id) const {
+		return GetPlatform(platform_id).version;
+	}
+
+	const string& PlatformVendor(int platform_id) const {
+		return GetPlatform(platform_id).vendor;
+	}
+
+	const vector<DeviceInfo>& Devices(int platform_id) const {
+		return GetPlatform(platform_id).devices;
+	}
+
+	const DeviceInfo& Info(int platform_id, int device_id) const {
+		const vector<DeviceInfo>& devices = Devices(platform_id);
+		if (device_id < 0 || device_id >= (int)devices.size())
+			throw cl::Error(CL_DEVICE_NOT_FOUND, "no device with that index on the platform");
+		return devices[device_id];
+	}
+
+	const DeviceInfo& Info(const cl::Device& device) const {
+		for (const PlatformInfo& platform : platforms) {
+			for (const DeviceInfo& info : platform.devices) {
+				if (info.device() == device())
+					return info;
+			}
+		}
+		throw cl::Error(CL_INVALID_DEVICE, "device was not enumerated");
+	}
+
+	// Context holding just this device
+	cl::Context Context(const cl::Device& device) {
+		lock_guard<mutex> lock(guard);
+		auto found = contexts.find(device());
+		if (found != contexts.end())
+			return found->second;
+		cl::Context context({ device });
+		contexts[device()] = context;
+		return context;
+	}
+
+	// Queue on the device's context with the given properties, index tells apart several queues with the
+	// same properties, such as one per lane
+	cl::CommandQueue Queue(const cl::Device& device, cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE, int index = 0) {
+		cl::Context context = Context(device);
+		lock_guard<mutex> lock(guard);
+		auto key = make_tuple(device(), properties, index);
+		auto found = queues.find(key);
+		if (found != queues.end())
+			return found->second;
+		cl::CommandQueue queue(context, device, properties);
+		queues[key] = queue;
+		return queue;
+	}
+
+private:
+	struct PlatformInfo {
+		cl::Platform platform;
+		string name, version, vendor;
+		vector<DeviceInfo> devices;
+	};
+
+	vector<PlatformInfo> platforms;
+	mutex guard;
+	map<cl_device_id, cl::Context> contexts;
+	map<tuple<cl_device_id, cl_command_queue_properties, int>, cl::CommandQueue> queues;
+
+	DeviceRegistry() {
+		vector<cl::Platform> handles;
+		cl::Platform::get(&handles);
+
+		for (unsigned int i = 0; i < handles.size(); i++) {
+			PlatformInfo platform;
+			platform.platform = handles[i];
+			platform.name = handles[i].getInfo<CL_PLATFORM_NAME>();
+			platform.version = handles[i].getInfo<CL_PLATFORM_VERSION>();
+			platform.vendor = handles[i].getInfo<CL_PLATFORM_VENDOR>();
+
+			vector<cl::Device> devices;
+			try {
+				handles[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+			}
+			catch (const cl::Error& err) {
+				// A platform without devices is still listed
+				if (err.err() != CL_DEVICE_NOT_FOUND)
+					throw;
+			}
+
+			for (unsigned int j = 0; j < devices.size(); j++) {
+				DeviceInfo info;
+				info.platform_id = i;
+				info.device_id = j;
+				info.platform = handles[i];
+				info.device = devices[j];
+				info.platformName = platform.name;
+				info.name = devices[j].getInfo<CL_DEVICE_NAME>().c_str();
+				info.version = devices[j].getInfo<CL_DEVICE_VERSION>().c_str();
+				info.vendor = devices[j].getInfo<CL_DEVICE_VENDOR>().c_str();
+				info.driverVersion = devices[j].getInfo<CL_DRIVER_VERSION>().c_str();
+				info.extensions = devices[j].getInfo<CL_DEVICE_EXTENSIONS>().c_str();
+				info.type = devices[j].getInfo<CL_DEVICE_TYPE>();
+				info.computeUnits = devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+				info.clockFrequency = devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+				info.globalMemSize = devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+				info.localMemSize = devices[j].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+				info.maxAllocSize = devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+				info.maxWorkGroupSize = devices[j].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+				info.baseAddrAlign = devices[j].getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>();
+				info.queueProperties = devices[j].getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+				platform.devices.push_back(info);
+			}
+			platforms.push_back(platform);
+		}
+	}
+
+	const PlatformInfo& GetPlatform(int platform_id) const {
+		if (platform_id < 0 || platform_id >= (int)platforms.size())
+			throw cl::Error(CL_INVALID_PLATFORM, "no platform with that index");
+		return platforms[platform_id];
+	}
+};
+
 string GetPlatformName(int platform_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
+	return DeviceRegistry::Get().PlatformName(platform_id);
 }
 
 string GetDeviceName(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	vector<cl::Device> devices;
-	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-	return devices[device_id].getInfo<CL_DEVICE_NAME>();
+	return DeviceRegistry::Get().Info(platform_id, device_id).name;
 }
 
 const char *getErrorString(cl_int error) {
@@ -131,44 +323,32 @@ void AddSources(cl::Program::Sources& sources, const string& file_name) {
 string ListPlatformsDevices() {
 
 	stringstream sstream;
-	vector<cl::Platform> platforms;
+	DeviceRegistry& registry = DeviceRegistry::Get();
 
-	cl::Platform::get(&platforms);
+	sstream << "Found " << registry.PlatformCount() << " platform(s):" << endl;
 
-	sstream << "Found " << platforms.size() << " platform(s):" << endl;
-
-	for (unsigned int i = 0; i < platforms.size(); i++)
+	for (unsigned int i = 0; i < registry.PlatformCount(); i++)
 	{
-		sstream << "\nPlatform " << i << ", " << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", version: " << platforms[i].getInfo<CL_PLATFORM_VERSION>();
-
-		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
-		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
-
-		vector<cl::Device> devices;
+		const vector<DeviceInfo>& devices = registry.Devices(i);
+		sstream << "\nPlatform " << i << ", " << registry.PlatformName(i) << ", version: " << registry.PlatformVersion(i);
 
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		sstream << ", vendor: " << registry.PlatformVendor(i) << endl;
+		//		sstream << ", extensions: " << registry.Platform(i).getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
 
 		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
 
 		for (unsigned int j = 0; j < devices.size(); j++)
 		{
-			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
-
-			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
-			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
-			sstream << ", type: ";
-			if (device_type & CL_DEVICE_TYPE_DEFAULT)
-				sstream << "DEFAULT ";
-			if (device_type & CL_DEVICE_TYPE_CPU)
-				sstream << "CPU ";
-			if (device_type & CL_DEVICE_TYPE_GPU)
-				sstream << "GPU ";
-			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
-				sstream << "ACCELERATOR ";
-			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			const DeviceInfo& info = devices[j];
+			sstream << "\n      Device " << j << ", " << info.name << ", version: " << info.version;
+
+			sstream << ", vendor: " << info.vendor;
+			sstream << ", type: " << info.TypeName();
+			sstream << ", compute units: " << info.computeUnits;
+			sstream << ", clock freq [MHz]: " << info.clockFrequency;
+			sstream << ", max memory size [B]: " << info.globalMemSize;
+			sstream << ", max allocatable memory [B]: " << info.maxAllocSize;
+			sstream << ", local memory [B]: " << info.localMemSize;
 
 			sstream << endl;
 		}
@@ -178,24 +358,321 @@ string ListPlatformsDevices() {
 	return sstream.str();
 }
 
+// Shared context of the device, from the registry
 cl::Context GetContext(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
+	DeviceRegistry& registry = DeviceRegistry::Get();
+	return registry.Context(registry.Info(platform_id, device_id).device);
+}
+
+// -D build option defining name as value
+string DefineOption(const string& name, const string& value) {
+	return "-D" + name + "=" + value;
+}
+
+// OpenCL C float literal with enough digits to round-trip value exactly
+string FloatLiteral(float value) {
+	stringstream text;
+	text << scientific << setprecision(9) << value << "f";
+	return text.str();
+}
 
-	cl::Platform::get(&platforms);
+// Programs built from a kernel file, one per context and set of build options. Options defining constants
+// with -D give every specialisation its own program, compiled the first time it is asked for and reused
+// by every later operation in the process.
+class ProgramCache {
+public:
+	static ProgramCache& Get() {
+		// Never destroyed, like the device registry
+		static ProgramCache* cache = new ProgramCache();
+		return *cache;
+	}
+
+	// Returns the program, building it first if needed. A failed build prints its log and rethrows.
+	cl::Program Build(const cl::Context& context, const cl::Device& device, const string& fileName, const string& options = "") {
+		lock_guard<mutex> lock(guard);
+		auto key = make_tuple(context(), fileName, options);
+		auto found = programs.find(key);
+		if (found != programs.end())
+			return found->second;
+
+		cl::Program::Sources sources;
+		AddSources(sources, fileName);
+		cl::Program program(context, sources);
+		try {
+			program.build(options.c_str());
+		}
+		catch (const cl::Error& err) {
+			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+			throw err;
+		}
+		programs[key] = program;
+		return program;
+	}
+
+	// Number of programs built so far
+	size_t Size() {
+		lock_guard<mutex> lock(guard);
+		return programs.size();
+	}
+
+private:
+	mutex guard;
+	map<tuple<cl_context, string, string>, cl::Program> programs;
+};
+
+// Name of this machine, device rankings are only reused on the host that measured them
+string GetHostName() {
+#ifdef _WIN32
+	const char* name = getenv("COMPUTERNAME");
+	return name ? name : "localhost";
+#else
+	char name[256] = {};
+	gethostname(name, sizeof(name) - 1);
+	return name;
+#endif
+}
+
+// Stages of the device selection benchmark
+enum SelectionStage {
+	SELECT_TRANSFER = 0, // image upload and result download
+	SELECT_HISTOGRAM = 1,
+	SELECT_LUT = 2,
+	SELECT_COUNT = 3
+};
+
+const char* SELECTION_STAGE_NAMES[SELECT_COUNT] = { "transfer", "histogram", "LUT" };
+
+// Linear cost model of one device, fitted to the benchmark: every stage of an image of n pixels takes
+// fixed + perPixel * n ns, so launch and transfer overheads that dominate small images and throughput that
+// dominates large ones are both accounted for
+struct DeviceBenchmark {
+	const DeviceInfo* info = NULL;
+	double fixed[SELECT_COUNT] = {}; // [ns]
+	double perPixel[SELECT_COUNT] = {}; // [ns]
+	bool cached = false; // loaded from the ranking file rather than measured in this run
+	string error; // why the device could not run the benchmark, empty when it could
+	double score = 0.0; // predicted time of the job mix [ns]
+
+	double Predict(size_t pixels) const {
+		double total = 0.0;
+		for (int stage = 0; stage < SELECT_COUNT; stage++)
+			total += fixed[stage] + perPixel[stage] * pixels;
+		return total;
+	}
+};
+
+// Times the transfers, histogram_batched and lut_batched on a small and a large image of random pixels on
+// the device, and fits the cost model to the median of each
+DeviceBenchmark BenchmarkDevice(const DeviceInfo& info, const string& kernelFilename) {
+	const int REPETITIONS = 5; // The first is a warm-up
+	const size_t LOCAL_SIZE = 256;
+	const size_t PIXELS_PER_ITEM = 16;
+	size_t sizes[2] = { (size_t)1 << 16, min((size_t)1 << 24, (size_t)info.maxAllocSize / 2) };
+
+	DeviceBenchmark result;
+	result.info = &info;
+	try {
+		DeviceRegistry& registry = DeviceRegistry::Get();
+		cl::Context context = registry.Context(info.device);
+		cl::CommandQueue queue = registry.Queue(info.device, CL_QUEUE_PROFILING_ENABLE);
+
+		cl::Program program = ProgramCache::Get().Build(context, info.device, kernelFilename);
+
+		double cost[2][SELECT_COUNT];
+		for (int s = 0; s < 2; s++) {
+			size_t pixels = sizes[s];
+			vector<unsigned char> image(pixels), output(pixels);
+			unsigned int state = 12345;
+			for (unsigned char& pixel : image) {
+				state = state * 1664525u + 1013904223u;
+				pixel = (unsigned char)(state >> 24);
+			}
+			vector<int> offsets = { 0, (int)pixels };
+
+			cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, pixels);
+			cl::Buffer outputBuffer(context, CL_MEM_WRITE_ONLY, pixels);
+			cl::Buffer offsetsBuffer(context, CL_MEM_READ_ONLY, offsets.size() * sizeof(int));
+			cl::Buffer histBuffer(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+			cl::Buffer lutBuffer(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+			queue.enqueueWriteBuffer(offsetsBuffer, CL_TRUE, 0, offsets.size() * sizeof(int), &offsets[0]);
+			queue.enqueueFillBuffer(lutBuffer, 0, 0, 256 * sizeof(int));
+
+			size_t groups = max((size_t)1, (pixels + LOCAL_SIZE * PIXELS_PER_ITEM - 1) / (LOCAL_SIZE * PIXELS_PER_ITEM));
+			cl::NDRange pixelRange(groups * LOCAL_SIZE, 1);
+
+			cl::Kernel kernelHist(program, "histogram_batched");
+			kernelHist.setArg(0, inputBuffer);
+			kernelHist.setArg(1, offsetsBuffer);
+			kernelHist.setArg(2, histBuffer);
+			kernelHist.setArg(3, cl::Local(256 * sizeof(int)));
+
+			cl::Kernel kernelLut(program, "lut_batched");
+			kernelLut.setArg(0, inputBuffer);
+			kernelLut.setArg(1, outputBuffer);
+			kernelLut.setArg(2, lutBuffer);
+			kernelLut.setArg(3, offsetsBuffer);
+
+			vector<double> samples[SELECT_COUNT];
+			for (int r = 0; r < REPETITIONS; r++) {
+				cl::Event write, fill, hist, lut, read;
+				queue.enqueueWriteBuffer(inputBuffer, CL_FALSE, 0, pixels, &image[0], NULL, &write);
+				queue.enqueueFillBuffer(histBuffer, 0, 0, 256 * sizeof(int), NULL, &fill);
+				queue.enqueueNDRangeKernel(kernelHist, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &hist);
+				queue.enqueueNDRangeKernel(kernelLut, cl::NullRange, pixelRange, cl::NDRange(LOCAL_SIZE, 1), NULL, &lut);
+				queue.enqueueReadBuffer(outputBuffer, CL_TRUE, 0, pixels, &output[0], NULL, &read);
+				if (r == 0)
+					continue;
+
+				auto duration = [](const cl::Event& evnt) {
+					return (double)(evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+				};
+				samples[SELECT_TRANSFER].push_back(duration(write) + duration(read));
+				samples[SELECT_HISTOGRAM].push_back(duration(fill) + duration(hist));
+				samples[SELECT_LUT].push_back(duration(lut));
+			}
+			for (int stage = 0; stage < SELECT_COUNT; stage++) {
+				sort(samples[stage].begin(), samples[stage].end());
+				cost[s][stage] = samples[stage][samples[stage].size() / 2];
+			}
+		}
+
+		// Straight line through the two sizes, clamped so noise cannot make either term negative
+		for (int stage = 0; stage < SELECT_COUNT; stage++) {
+			if (sizes[1] > sizes[0])
+				result.perPixel[stage] = max(0.0, (cost[1][stage] - cost[0][stage]) / (double)(sizes[1] - sizes[0]));
+			else
+				result.perPixel[stage] = cost[1][stage] / (double)sizes[1];
+			result.fixed[stage] = max(0.0, cost[0][stage] - result.perPixel[stage] * sizes[0]);
+		}
+	}
+	catch (const cl::Error& err) {
+		result.error = string(err.what()) + ", " + getErrorString(err.err());
+	}
+	return result;
+}
+
+// Reads this host's cost models from a file of "host<TAB>device key<TAB>fixed perPixel ..." lines
+map<string, DeviceBenchmark> LoadDeviceBenchmarks(const string& file_name, const string& host) {
+	map<string, DeviceBenchmark> benchmarks;
+	ifstream file(file_name);
+	string line;
+	while (getline(file, line)) {
+		size_t first = line.find('\t'), second = line.find('\t', first + 1);
+		if (first == string::npos || second == string::npos || line.substr(0, first) != host)
+			continue;
+
+		DeviceBenchmark benchmark;
+		stringstream values(line.substr(second + 1));
+		for (int stage = 0; stage < SELECT_COUNT; stage++)
+			values >> benchmark.fixed[stage] >> benchmark.perPixel[stage];
+		if (values) {
+			benchmark.cached = true;
+			benchmarks[line.substr(first + 1, second - first - 1)] = benchmark;
+		}
+	}
+	return benchmarks;
+}
 
-	for (unsigned int i = 0; i < platforms.size(); i++)
+// Stores the cost models of this host's devices, replacing any earlier ones and keeping other hosts' lines
+void SaveDeviceBenchmarks(const string& file_name, const string& host, const vector<DeviceBenchmark>& benchmarks) {
+	vector<string> lines;
 	{
-		vector<cl::Device> devices;
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		ifstream file(file_name);
+		string line;
+		while (getline(file, line)) {
+			if (line.substr(0, line.find('\t')) != host)
+				lines.push_back(line);
+		}
+	}
+	for (const DeviceBenchmark& benchmark : benchmarks) {
+		if (!benchmark.error.empty())
+			continue;
+		stringstream line;
+		line << host << "\t" << benchmark.info->Key() << "\t";
+		for (int stage = 0; stage < SELECT_COUNT; stage++)
+			line << benchmark.fixed[stage] << " " << benchmark.perPixel[stage] << (stage + 1 < SELECT_COUNT ? " " : "");
+		lines.push_back(line.str());
+	}
 
-		for (unsigned int j = 0; j < devices.size(); j++)
-		{
-			if ((i == platform_id) && (j == device_id))
-				return cl::Context({ devices[j] });
+	ofstream file(file_name);
+	for (const string& line : lines)
+		file << line << endl;
+}
+
+// Picks the device that is predicted to finish jobs of the given pixel counts soonest. Devices are matched
+// to cached cost models by key rather than index, so a change in ICD ordering does not change the choice,
+// and only devices without a model (or all of them when remeasure is set) are benchmarked. The ranking
+// and the reason for the choice are written to explanation.
+const DeviceInfo& SelectDevice(const vector<size_t>& jobSizes, const string& cacheFilename, const string& kernelFilename, bool remeasure, ostream& explanation) {
+	DeviceRegistry& registry = DeviceRegistry::Get();
+	vector<const DeviceInfo*> devices;
+	for (unsigned int i = 0; i < registry.PlatformCount(); i++) {
+		for (const DeviceInfo& info : registry.Devices(i))
+			devices.push_back(&info);
+	}
+	if (devices.empty())
+		throw cl::Error(CL_DEVICE_NOT_FOUND, "no OpenCL devices found");
+	if (devices.size() == 1) {
+		explanation << "[AUTO] Only one device, " << devices[0]->name << endl;
+		return *devices[0];
+	}
+
+	string host = GetHostName();
+	map<string, DeviceBenchmark> cached;
+	if (!remeasure)
+		cached = LoadDeviceBenchmarks(cacheFilename, host);
+
+	vector<DeviceBenchmark> benchmarks;
+	bool measured = false;
+	for (const DeviceInfo* info : devices) {
+		auto found = cached.find(info->Key());
+		if (found != cached.end()) {
+			benchmarks.push_back(found->second);
+			benchmarks.back().info = info;
 		}
+		else {
+			explanation << "[AUTO] Benchmarking " << info->name << "..." << endl;
+			benchmarks.push_back(BenchmarkDevice(*info, kernelFilename));
+			measured = true;
+		}
+	}
+	if (measured)
+		SaveDeviceBenchmarks(cacheFilename, host, benchmarks);
+
+	// Lower predicted time of the whole job mix is better, devices that failed are never picked
+	size_t totalPixels = 0;
+	for (size_t pixels : jobSizes)
+		totalPixels += pixels;
+	for (DeviceBenchmark& benchmark : benchmarks) {
+		benchmark.score = benchmark.error.empty() ? 0.0 : numeric_limits<double>::infinity();
+		for (size_t pixels : jobSizes)
+			benchmark.score += benchmark.Predict(pixels);
+	}
+	stable_sort(benchmarks.begin(), benchmarks.end(), [](const DeviceBenchmark& a, const DeviceBenchmark& b) { return a.score < b.score; });
+	if (!benchmarks[0].error.empty())
+		throw cl::Error(CL_DEVICE_NOT_FOUND, "no device could run the selection benchmark");
+
+	explanation << "[AUTO] Device ranking for " << jobSizes.size() << " job(s) of " << totalPixels / max((size_t)1, jobSizes.size()) << " pixels on average:" << endl;
+	for (const DeviceBenchmark& benchmark : benchmarks) {
+		const DeviceInfo& info = *benchmark.info;
+		explanation << "  " << info.platform_id << "." << info.device_id << " " << info.name << " (" << info.TypeName() << "), ";
+		if (!benchmark.error.empty()) {
+			explanation << "unusable: " << benchmark.error << endl;
+			continue;
+		}
+		for (int stage = 0; stage < SELECT_COUNT; stage++)
+			explanation << SELECTION_STAGE_NAMES[stage] << " " << benchmark.fixed[stage] * 1e-3 << " us + " << benchmark.perPixel[stage] * 1e6 << " ns/MPixel, ";
+		explanation << "predicted " << benchmark.score * 1e-6 << " ms" << (benchmark.cached ? " (cached)" : " (measured)") << endl;
 	}
 
-	return cl::Context();
+	const DeviceBenchmark& best = benchmarks[0];
+	explanation << "[AUTO] Selected platform " << best.info->platform_id << ", device " << best.info->device_id << ", " << best.info->name;
+	if (benchmarks[1].error.empty())
+		explanation << ", " << benchmarks[1].score / max(best.score, 1.0) << "x faster than " << benchmarks[1].info->name;
+	explanation << " (-p/-d override, -A re-benchmarks)" << endl;
+	return *best.info;
 }
 
 enum ProfilingResolution {
@@ -205,6 +682,17 @@ enum ProfilingResolution {
 	PROF_S = 1000000000
 };
 
+// Unit suffix printed after times in a resolution
+string GetResolutionUnit(ProfilingResolution resolution) {
+	switch (resolution) {
+	case PROF_NS: return " [ns]";
+	case PROF_US: return " [us]";
+	case PROF_MS: return " [ms]";
+	case PROF_S: return " [s]";
+	default: return "";
+	}
+}
+
 string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
 	stringstream sstream;
 
@@ -212,14 +700,235 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 	sstream << ", Submitted " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()) / resolution;
 	sstream << ", Executed " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / resolution;
 	sstream << ", Total " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+	sstream << GetResolutionUnit(resolution);
 
-	switch (resolution) {
-	case PROF_NS: sstream << " [ns]"; break;
-	case PROF_US: sstream << " [us]"; break;
-	case PROF_MS: sstream << " [ms]"; break;
-	case PROF_S: sstream << " [s]"; break;
-	default: break;
+	return sstream.str();
+}
+
+// Returns a short name for the type of command an event was recorded against
+string GetCommandTypeName(cl_command_type type) {
+	switch (type) {
+	case CL_COMMAND_NDRANGE_KERNEL: return "kernel";
+	case CL_COMMAND_TASK: return "task";
+	case CL_COMMAND_READ_BUFFER: return "read";
+	case CL_COMMAND_WRITE_BUFFER: return "write";
+	case CL_COMMAND_COPY_BUFFER: return "copy";
+	case CL_COMMAND_FILL_BUFFER: return "fill";
+	case CL_COMMAND_MAP_BUFFER: return "map";
+	case CL_COMMAND_UNMAP_MEM_OBJECT: return "unmap";
+	case CL_COMMAND_MARKER: return "marker";
+	default: return "other";
 	}
+}
 
-	return sstream.str();
-}
\ No newline at end of file
+// Rounds value up to a multiple of multiple, e.g. a global size up to the work-group size
+size_t RoundUp(size_t value, size_t multiple) {
+	return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Host steady_clock time [ns], the common time base for host spans and calibrated device timestamps
+long long GetHostTime() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A span of host-side work such as image decode or program build, drawn on a named host track
+struct HostSpan {
+	string name;
+	string track;
+	long long begin, end; // steady_clock [ns]
+};
+
+// A single enqueued command, tagged with the pipeline stage it belongs to
+struct ProfiledCommand {
+	string stage;
+	cl::Event event;
+	size_t bytes; // bytes moved by a transfer, or read + written by a kernel
+};
+
+// Records the event of every enqueued command and reports their timings once the queue has drained
+class ProfilingReport {
+public:
+	// Register a command; the event must come from a queue created with CL_QUEUE_PROFILING_ENABLE
+	void Add(const string& stage, const cl::Event& evnt, size_t bytes = 0) {
+		commands.push_back({ stage, evnt, bytes });
+	}
+
+	// Register a span of host work measured with GetHostTime
+	void AddHostSpan(const string& name, long long begin, long long end, const string& track = "host") {
+		spans.push_back({ name, track, begin, end });
+	}
+
+	// Measure the offset between a queue's device clock and the host steady_clock, so that
+	// device commands can be drawn on the same timeline as host spans
+	void Calibrate(cl::CommandQueue& queue) {
+		cl::Event marker;
+		long long before = GetHostTime();
+		queue.enqueueMarkerWithWaitList(NULL, &marker);
+		marker.wait();
+		long long after = GetHostTime();
+		clock_offsets[queue()] = (before + after) / 2 - (long long)marker.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	}
+
+	// Register the commands of a stage that needed several; the bytes are counted against the first
+	void Add(const string& stage, const vector<cl::Event>& events, size_t bytes = 0) {
+		for (size_t i = 0; i < events.size(); i++)
+			Add(events.size() > 1 ? stage + " " + to_string(i + 1) + "/" + to_string(events.size()) : stage, events[i], i ? 0 : bytes);
+	}
+
+	void Clear() { commands.clear(); spans.clear(); }
+	bool Empty() const { return commands.empty(); }
+	const vector<ProfiledCommand>& Commands() const { return commands; }
+
+	// Machine-readable report, one object per command with raw device timestamps [ns]
+	string ToJSON() const {
+		stringstream sstream;
+		sstream << "{\n  \"commands\": [";
+		for (size_t i = 0; i < commands.size(); i++) {
+			Timings t = GetTimings(commands[i]);
+			sstream << (i ? "," : "") << "\n    { \"stage\": \"" << commands[i].stage << "\", \"type\": \"" << t.type << "\"";
+			sstream << ", \"queued\": " << t.queued << ", \"submit\": " << t.submit << ", \"start\": " << t.start << ", \"end\": " << t.end;
+			sstream << ", \"duration_ns\": " << t.end - t.start << ", \"bytes\": " << commands[i].bytes << ", \"gbps\": " << t.gbps << " }";
+		}
+		sstream << "\n  ],\n  \"total_ns\": " << TotalTime() << "\n}\n";
+		return sstream.str();
+	}
+
+	// The same report as comma-separated values with a header row
+	string ToCSV() const {
+		stringstream sstream;
+		sstream << "stage,type,queued,submit,start,end,duration_ns,bytes,gbps" << endl;
+		for (const ProfiledCommand& command : commands) {
+			Timings t = GetTimings(command);
+			sstream << command.stage << "," << t.type << "," << t.queued << "," << t.submit << "," << t.start << "," << t.end;
+			sstream << "," << t.end - t.start << "," << command.bytes << "," << t.gbps << endl;
+		}
+		return sstream.str();
+	}
+
+	// Human-readable table for the console
+	string Summary(ProfilingResolution resolution) const {
+		stringstream sstream;
+		for (const ProfiledCommand& command : commands) {
+			Timings t = GetTimings(command);
+			sstream << "[" << command.stage << "] " << t.type << ": " << GetFullProfilingInfo(command.event, resolution);
+			if (command.bytes)
+				sstream << ", " << command.bytes << " B, " << t.gbps << " GB/s";
+			sstream << endl;
+		}
+		// Commands on out-of-order or several queues overlap, so this can exceed the elapsed time
+		sstream << "Summed command time: " << TotalTime() / resolution << GetResolutionUnit(resolution) << endl;
+		return sstream.str();
+	}
+
+	// Sum of the execution time of every command [ns]
+	cl_ulong TotalTime() const {
+		cl_ulong total = 0;
+		for (const ProfiledCommand& command : commands)
+			total += command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		return total;
+	}
+
+	// Chrome Trace Event JSON (chrome://tracing, ui.perfetto.dev) with host spans on their own tracks
+	// and device commands on one track per command queue
+	string ToChromeTrace() const {
+		map<string, int> tracks; // track name -> tid, in order of first appearance
+		map<cl_command_queue, int> queue_tracks;
+		stringstream events;
+		long long origin = LLONG_MAX;
+
+		// Device timestamps shifted onto the host time base
+		vector<long long> starts(commands.size()), ends(commands.size());
+		vector<int> tids(commands.size());
+		for (size_t i = 0; i < commands.size(); i++) {
+			cl::CommandQueue queue = commands[i].event.getInfo<CL_EVENT_COMMAND_QUEUE>();
+			auto offset = clock_offsets.find(queue());
+			long long shift = (offset != clock_offsets.end()) ? offset->second : 0;
+			if (!queue_tracks.count(queue())) {
+				int tid = (int)(tracks.size() + queue_tracks.size()) + 1;
+				queue_tracks[queue()] = tid;
+				events << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+					<< ", \"args\": { \"name\": \"queue " << queue_tracks.size() - 1 << " (" << queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_NAME>().c_str() << ")\" } },\n";
+			}
+			tids[i] = queue_tracks[queue()];
+			starts[i] = (long long)commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>() + shift;
+			ends[i] = (long long)commands[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>() + shift;
+			origin = min(origin, starts[i]);
+		}
+		for (const HostSpan& span : spans) {
+			if (!tracks.count(span.track)) {
+				int tid = (int)(tracks.size() + queue_tracks.size()) + 1;
+				tracks[span.track] = tid;
+				events << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+					<< ", \"args\": { \"name\": \"" << span.track << "\" } },\n";
+			}
+			origin = min(origin, span.begin);
+		}
+
+		// Complete ("X") events with microsecond timestamps relative to the earliest activity
+		events << fixed << setprecision(3);
+		for (const HostSpan& span : spans) {
+			events << "    { \"name\": \"" << span.name << "\", \"cat\": \"host\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tracks[span.track]
+				<< ", \"ts\": " << (span.begin - origin) / 1000.0 << ", \"dur\": " << (span.end - span.begin) / 1000.0 << " },\n";
+		}
+		for (size_t i = 0; i < commands.size(); i++) {
+			Timings t = GetTimings(commands[i]);
+			events << "    { \"name\": \"" << commands[i].stage << "\", \"cat\": \"" << t.type << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tids[i]
+				<< ", \"ts\": " << (starts[i] - origin) / 1000.0 << ", \"dur\": " << (ends[i] - starts[i]) / 1000.0
+				<< ", \"args\": { \"bytes\": " << commands[i].bytes << ", \"gbps\": " << t.gbps << " } },\n";
+		}
+
+		string body = events.str();
+		if (!body.empty())
+			body.erase(body.size() - 2, 1); // drop the trailing comma
+		return "{\n  \"displayTimeUnit\": \"ns\",\n  \"traceEvents\": [\n" + body + "  ]\n}\n";
+	}
+
+	// Write the timeline to a file for chrome://tracing or Perfetto
+	void SaveChromeTrace(const string& file_name) const {
+		ofstream file(file_name);
+		file << ToChromeTrace();
+	}
+
+	// Write the report to a file, choosing CSV or JSON from the extension
+	void Save(const string& file_name) const {
+		ofstream file(file_name);
+		bool is_csv = file_name.size() >= 4 && file_name.compare(file_name.size() - 4, 4, ".csv") == 0;
+		file << (is_csv ? ToCSV() : ToJSON());
+	}
+
+private:
+	struct Timings {
+		string type;
+		cl_ulong queued, submit, start, end;
+		double gbps;
+	};
+
+	static Timings GetTimings(const ProfiledCommand& command) {
+		Timings t;
+		t.type = GetCommandTypeName(command.event.getInfo<CL_EVENT_COMMAND_TYPE>());
+		t.queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		t.submit = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		t.start = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		t.end = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		// Bytes per nanosecond is the same as GB/s
+		t.gbps = (t.end > t.start) ? (double)command.bytes / (double)(t.end - t.start) : 0.0;
+		return t;
+	}
+
+	vector<ProfiledCommand> commands;
+	vector<HostSpan> spans;
+	map<cl_command_queue, long long> clock_offsets; // host steady_clock minus device clock [ns]
+};
+
+// Records a host span covering the lifetime of the object
+class ScopedHostSpan {
+public:
+	ScopedHostSpan(ProfilingReport& report, const string& name, const string& track = "host")
+		: report(report), name(name), track(track), begin(GetHostTime()) {}
+	~ScopedHostSpan() { report.AddHostSpan(name, begin, GetHostTime(), track); }
+
+private:
+	ProfilingReport& report;
+	string name, track;
+	long long begin;
+};
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+using namespace std;
+
+// Stages of the greyscale equalisation pipeline that have interchangeable kernel implementations
+enum PipelineStage {
+	STAGE_HISTOGRAM, // image -> histogram
+	STAGE_SCAN,      // histogram -> cumulative histogram
+	STAGE_LUT_BUILD, // cumulative histogram -> normalised look-up table
+	STAGE_APPLY,     // image + look-up table -> output image
+	STAGE_COUNT
+};
+
+string GetStageName(PipelineStage stage) {
+	switch (stage) {
+	case STAGE_HISTOGRAM: return "histogram";
+	case STAGE_SCAN: return "scan";
+	case STAGE_LUT_BUILD: return "lut_build";
+	case STAGE_APPLY: return "apply";
+	default: return "unknown";
+	}
+}
+
+PipelineStage ParseStageName(const string& name) {
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+		if (GetStageName((PipelineStage)stage) == name)
+			return (PipelineStage)stage;
+	throw invalid_argument("unknown pipeline stage '" + name + "'");
+}
+
+// Tunable launch parameters of a kernel variant, not every variant uses every parameter
+struct VariantParams {
+	int localSize;
+	int pixelsPerItem;
+	int subHistograms;
+};
+
+string FormatVariantParams(const VariantParams& params) {
+	return to_string(params.localSize) + ":" + to_string(params.pixelsPerItem) + ":" + to_string(params.subHistograms);
+}
+
+// Device buffers read and written by the stages, shared by every variant of a stage
+struct StageBuffers {
+	cl::Buffer image;   // input pixels (uchar)
+	cl::Buffer output;  // output pixels (uchar), written by the apply stage
+	cl::Buffer hist;    // histogram (int[256])
+	cl::Buffer cumHist; // cumulative histogram (int[256])
+	cl::Buffer lut;     // normalised cumulative histogram used as the look-up table (int[256])
+	cl::Buffer scale;   // normalisation factor 255 / pixel count (float)
+	float scaleValue;   // the same factor, for variants that take it by value
+	size_t pixels;      // number of pixels in image
+	cl::Buffer scratch; // intermediate results of multi-kernel variants, grown on demand
+	size_t scratchSize = 0;
+};
+
+// One implementation of a stage. The histogram stage expects hist to have been cleared by the caller.
+// enqueue appends the event of every command it issues to events, as some variants need several kernels.
+struct KernelVariant {
+	PipelineStage stage;
+	string name;   // name used for selection on the command line and in tuning files
+	string kernel; // kernel function in assign_kernels.cl
+	vector<VariantParams> candidates; // parameter sets tried by the autotuner, the first is the default
+	function<void(cl::CommandQueue&, cl::Kernel&, StageBuffers&, const VariantParams&, const vector<cl::Event>*, vector<cl::Event>*)> enqueue;
+	function<size_t(const VariantParams&)> localMemory = nullptr; // bytes of local memory a launch needs, unset for none
+};
+
+// The variant and parameters chosen for one stage
+struct VariantChoice {
+	string name;
+	VariantParams params;
+};
+
+// One choice per stage, indexed by PipelineStage
+typedef vector<VariantChoice> VariantConfig;
+
+// Enqueues one kernel of a stage and records its event
+cl::Event EnqueueStageKernel(cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+	cl::Event evnt;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, wait, &evnt);
+	if (events)
+		events->push_back(evnt);
+	return evnt;
+}
+
+// Device time covered by the commands of a stage, from the first start to the last end [ns]
+cl_ulong GetStageTime(const vector<cl::Event>& events) {
+	return events.back().getProfilingInfo<CL_PROFILING_COMMAND_END>() - events.front().getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// Makes sure the scratch buffer can hold at least size bytes
+cl::Buffer& GetScratchBuffer(StageBuffers& b, const cl::Kernel& kernel, size_t size) {
+	if (b.scratchSize < size) {
+		b.scratch = cl::Buffer(kernel.getInfo<CL_KERNEL_CONTEXT>(), CL_MEM_READ_WRITE, size);
+		b.scratchSize = size;
+	}
+	return b.scratch;
+}
+
+// Local size for kernels without bounds checks: the requested size if it divides the work, otherwise let the runtime pick
+cl::NDRange GetExactLocalRange(size_t global, int localSize) {
+	return (global % localSize == 0) ? cl::NDRange(localSize) : cl::NullRange;
+}
+
+// Every variant shipped in assign_kernels.cl
+class VariantRegistry {
+public:
+	VariantRegistry() {
+		vector<VariantParams> localSizes = { { 256, 1, 1 }, { 64, 1, 1 }, { 128, 1, 1 } };
+
+		Add({ STAGE_HISTOGRAM, "histogram", "histogram", localSizes,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.image);
+				kernel.setArg(1, b.hist);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(b.pixels), GetExactLocalRange(b.pixels, p.localSize), wait, events);
+			} });
+
+		vector<VariantParams> localHist;
+		for (int localSize : { 256, 64, 128 })
+			for (int pixelsPerItem : { 16, 1, 4, 64 })
+				for (int subHistograms : { 1, 4, 8 })
+					localHist.push_back({ localSize, pixelsPerItem, subHistograms });
+		Add({ STAGE_HISTOGRAM, "histogram_local", "histogram_local", localHist,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.image);
+				kernel.setArg(1, b.hist);
+				kernel.setArg(2, cl::Local(256 * p.subHistograms * sizeof(int)));
+				kernel.setArg(3, (int)b.pixels);
+				kernel.setArg(4, p.pixelsPerItem);
+				kernel.setArg(5, p.subHistograms);
+				size_t global = RoundUp((b.pixels + p.pixelsPerItem - 1) / p.pixelsPerItem, p.localSize);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(global), cl::NDRange(p.localSize), wait, events);
+			},
+			[](const VariantParams& p) { return 256 * p.subHistograms * sizeof(int); } });
+
+		// Atomic-free and deterministic: cost depends only on the image size, not on the pixel values.
+		// Local memory holds 256 counters per work-item, so the local size is kept small.
+		vector<VariantParams> privateHist;
+		for (int localSize : { 32, 16 })
+			for (int pixelsPerItem : { 256, 64, 1024 })
+				privateHist.push_back({ localSize, pixelsPerItem, 1 });
+		Add({ STAGE_HISTOGRAM, "histogram_private", "histogram_private", privateHist,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				const int REDUCE_SIZE = 64;
+				size_t groups = (b.pixels + (size_t)p.localSize * p.pixelsPerItem - 1) / ((size_t)p.localSize * p.pixelsPerItem);
+				cl::Buffer& partial = GetScratchBuffer(b, kernel, groups * 256 * sizeof(int));
+
+				kernel.setArg(0, b.image);
+				kernel.setArg(1, partial);
+				kernel.setArg(2, cl::Local(256 * p.localSize * sizeof(int)));
+				kernel.setArg(3, (int)b.pixels);
+				kernel.setArg(4, p.pixelsPerItem);
+				vector<cl::Event> counted = { EnqueueStageKernel(queue, kernel, cl::NDRange(groups * p.localSize), cl::NDRange(p.localSize), wait, events) };
+
+				// Merge the per work-group histograms, one work-group per bin
+				cl::Kernel reduce(kernel.getInfo<CL_KERNEL_PROGRAM>(), "histogram_reduce");
+				reduce.setArg(0, partial);
+				reduce.setArg(1, b.hist);
+				reduce.setArg(2, cl::Local(REDUCE_SIZE * sizeof(int)));
+				reduce.setArg(3, (int)groups);
+				EnqueueStageKernel(queue, reduce, cl::NDRange(256 * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), &counted, events);
+			},
+			[](const VariantParams& p) { return 256 * p.localSize * sizeof(int); } });
+
+		// Both scans synchronise with barriers, so the whole histogram must fit in one work-group
+		Add({ STAGE_SCAN, "scan_hs", "scan_hs", { { 256, 1, 1 } },
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& , const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.hist);
+				kernel.setArg(1, b.cumHist);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(256), cl::NDRange(256), wait, events);
+			} });
+		Add({ STAGE_SCAN, "scan_add", "scan_add", { { 256, 1, 1 } },
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& , const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.hist);
+				kernel.setArg(1, b.cumHist);
+				kernel.setArg(2, cl::Local(256 * sizeof(int)));
+				kernel.setArg(3, cl::Local(256 * sizeof(int)));
+				EnqueueStageKernel(queue, kernel, cl::NDRange(256), cl::NDRange(256), wait, events);
+			},
+			[](const VariantParams&) { return 2 * 256 * sizeof(int); } });
+
+		vector<VariantParams> binLocalSizes = { { 256, 1, 1 }, { 32, 1, 1 }, { 64, 1, 1 }, { 128, 1, 1 } };
+		Add({ STAGE_LUT_BUILD, "norm_bins", "norm_bins", binLocalSizes,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.cumHist);
+				kernel.setArg(1, b.lut);
+				kernel.setArg(2, b.scale);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(256), cl::NDRange(p.localSize), wait, events);
+			} });
+		Add({ STAGE_LUT_BUILD, "norm_bins_arg", "norm_bins_arg", binLocalSizes,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.cumHist);
+				kernel.setArg(1, b.lut);
+				kernel.setArg(2, b.scaleValue);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(256), cl::NDRange(p.localSize), wait, events);
+			} });
+
+		Add({ STAGE_APPLY, "lut", "lut", localSizes,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.image);
+				kernel.setArg(1, b.output);
+				kernel.setArg(2, b.lut);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(b.pixels), GetExactLocalRange(b.pixels, p.localSize), wait, events);
+			} });
+
+		vector<VariantParams> multiLut;
+		for (int localSize : { 256, 64, 128 })
+			for (int pixelsPerItem : { 4, 2, 8, 16 })
+				multiLut.push_back({ localSize, pixelsPerItem, 1 });
+		Add({ STAGE_APPLY, "lut_multi", "lut_multi", multiLut,
+			[](cl::CommandQueue& queue, cl::Kernel& kernel, StageBuffers& b, const VariantParams& p, const vector<cl::Event>* wait, vector<cl::Event>* events) {
+				kernel.setArg(0, b.image);
+				kernel.setArg(1, b.output);
+				kernel.setArg(2, b.lut);
+				kernel.setArg(3, (int)b.pixels);
+				kernel.setArg(4, p.pixelsPerItem);
+				size_t global = RoundUp((b.pixels + p.pixelsPerItem - 1) / p.pixelsPerItem, p.localSize);
+				EnqueueStageKernel(queue, kernel, cl::NDRange(global), cl::NDRange(p.localSize), wait, events);
+			} });
+	}
+
+	void Add(const KernelVariant& variant) { variants.push_back(variant); }
+
+	const vector<KernelVariant>& All() const { return variants; }
+
+	vector<const KernelVariant*> Get(PipelineStage stage) const {
+		vector<const KernelVariant*> result;
+		for (const KernelVariant& variant : variants)
+			if (variant.stage == stage)
+				result.push_back(&variant);
+		return result;
+	}
+
+	const KernelVariant& Find(PipelineStage stage, const string& name) const {
+		for (const KernelVariant& variant : variants)
+			if (variant.stage == stage && variant.name == name)
+				return variant;
+		throw invalid_argument("unknown " + GetStageName(stage) + " variant '" + name + "'");
+	}
+
+	// The original kernels of each stage with their default parameters
+	VariantConfig DefaultConfig() const {
+		VariantConfig config(STAGE_COUNT);
+		for (int stage = 0; stage < STAGE_COUNT; stage++) {
+			const KernelVariant& variant = *Get((PipelineStage)stage).front();
+			config[stage] = { variant.name, variant.candidates.front() };
+		}
+		return config;
+	}
+
+private:
+	vector<KernelVariant> variants;
+};
+
+// Formats a configuration as "stage=variant:localSize:pixelsPerItem:subHistograms,..."
+string FormatVariantConfig(const VariantConfig& config) {
+	stringstream sstream;
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+		sstream << (stage ? "," : "") << GetStageName((PipelineStage)stage) << "=" << config[stage].name << ":" << FormatVariantParams(config[stage].params);
+	return sstream.str();
+}
+
+// Overrides the stages named in a configuration string; stages left out keep their current choice
+// and parameters left out take the variant's defaults
+VariantConfig ParseVariantConfig(const VariantRegistry& registry, const string& text, VariantConfig config) {
+	stringstream entries(text);
+	string entry;
+	while (getline(entries, entry, ',')) {
+		size_t equals = entry.find('=');
+		if (equals == string::npos)
+			throw invalid_argument("expected stage=variant in '" + entry + "'");
+
+		PipelineStage stage = ParseStageName(entry.substr(0, equals));
+		stringstream fields(entry.substr(equals + 1));
+		string name, field;
+		getline(fields, name, ':');
+
+		const KernelVariant& variant = registry.Find(stage, name);
+		VariantParams params = variant.candidates.front();
+		int* values[] = { &params.localSize, &params.pixelsPerItem, &params.subHistograms };
+		for (int i = 0; i < 3 && getline(fields, field, ':'); i++)
+			*values[i] = stoi(field);
+
+		config[stage] = { name, params };
+	}
+	return config;
+}
+
+// Looks up the tuned configuration for a device in a file of "device key<TAB>configuration" lines
+bool LoadTunedConfig(const VariantRegistry& registry, const string& file_name, const string& device_key, VariantConfig& config) {
+	ifstream file(file_name);
+	string line;
+	while (getline(file, line)) {
+		size_t tab = line.find('\t');
+		if (tab != string::npos && line.substr(0, tab) == device_key) {
+			config = ParseVariantConfig(registry, line.substr(tab + 1), registry.DefaultConfig());
+			return true;
+		}
+	}
+	return false;
+}
+
+// Stores the tuned configuration for a device, replacing any earlier entry for the same device
+void SaveTunedConfig(const string& file_name, const string& device_key, const VariantConfig& config) {
+	vector<string> lines;
+	{
+		ifstream file(file_name);
+		string line;
+		while (getline(file, line))
+			if (line.substr(0, line.find('\t')) != device_key)
+				lines.push_back(line);
+	}
+	lines.push_back(device_key + "\t" + FormatVariantConfig(config));
+
+	ofstream file(file_name);
+	for (const string& line : lines)
+		file << line << endl;
+}
+
+// Times every variant and parameter set of each stage on the given greyscale image and returns the
+// fastest one that reproduces a host reference result. Each candidate's median over the repetitions is used.
+VariantConfig AutotuneVariants(const VariantRegistry& registry, const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, const CImg<unsigned char>& image, int repetitions = 5) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	const size_t HIST_SIZE = 256 * sizeof(int);
+
+	// Host reference for every stage
+	vector<int> refHist(256, 0), refCum(256), refLut(256);
+	for (unsigned char pixel : image)
+		refHist[pixel]++;
+	float scale = 255.0f / (float)image.size();
+	for (int i = 0, sum = 0; i < 256; i++) {
+		sum += refHist[i];
+		refCum[i] = sum;
+		refLut[i] = (int)(refCum[i] * scale);
+	}
+	vector<unsigned char> refOutput(image.size());
+	for (size_t i = 0; i < image.size(); i++)
+		refOutput[i] = (unsigned char)refLut[image[i]];
+
+	StageBuffers b;
+	b.pixels = image.size();
+	b.scaleValue = scale;
+	b.image = cl::Buffer(context, CL_MEM_READ_ONLY, b.pixels);
+	b.output = cl::Buffer(context, CL_MEM_READ_WRITE, b.pixels);
+	b.hist = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	b.cumHist = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	b.lut = cl::Buffer(context, CL_MEM_READ_WRITE, HIST_SIZE);
+	b.scale = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float));
+	queue.enqueueWriteBuffer(b.image, CL_TRUE, 0, b.pixels, image.data());
+	queue.enqueueWriteBuffer(b.scale, CL_TRUE, 0, sizeof(float), &scale);
+
+	// Reset the inputs of a stage to the reference values before each run
+	auto prepare = [&](PipelineStage stage) {
+		switch (stage) {
+		case STAGE_HISTOGRAM: queue.enqueueFillBuffer(b.hist, 0, 0, HIST_SIZE); break;
+		case STAGE_SCAN: queue.enqueueWriteBuffer(b.hist, CL_TRUE, 0, HIST_SIZE, &refHist[0]); break;
+		case STAGE_LUT_BUILD: queue.enqueueWriteBuffer(b.cumHist, CL_TRUE, 0, HIST_SIZE, &refCum[0]); break;
+		default: queue.enqueueWriteBuffer(b.lut, CL_TRUE, 0, HIST_SIZE, &refLut[0]); break;
+		}
+	};
+	auto check = [&](PipelineStage stage) {
+		vector<int> bins(256);
+		switch (stage) {
+		case STAGE_HISTOGRAM: queue.enqueueReadBuffer(b.hist, CL_TRUE, 0, HIST_SIZE, &bins[0]); return bins == refHist;
+		case STAGE_SCAN: queue.enqueueReadBuffer(b.cumHist, CL_TRUE, 0, HIST_SIZE, &bins[0]); return bins == refCum;
+		case STAGE_LUT_BUILD: queue.enqueueReadBuffer(b.lut, CL_TRUE, 0, HIST_SIZE, &bins[0]); return bins == refLut;
+		default: {
+			vector<unsigned char> output(b.pixels);
+			queue.enqueueReadBuffer(b.output, CL_TRUE, 0, b.pixels, &output[0]);
+			return output == refOutput;
+		}
+		}
+	};
+
+	VariantConfig config = registry.DefaultConfig();
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		PipelineStage stage = (PipelineStage)s;
+		double best = 0.0;
+
+		for (const KernelVariant* variant : registry.Get(stage)) {
+			cl::Kernel kernel(program, variant->kernel.c_str());
+			size_t maxLocal = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+			cl_ulong localMem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+			for (const VariantParams& params : variant->candidates) {
+				if ((size_t)params.localSize > maxLocal || (variant->localMemory && (cl_ulong)variant->localMemory(params) > localMem))
+					continue;
+
+				vector<cl_ulong> times;
+				try {
+					for (int i = 0; i <= repetitions; i++) {
+						vector<cl::Event> events;
+						prepare(stage);
+						variant->enqueue(queue, kernel, b, params, NULL, &events);
+						cl::WaitForEvents(events);
+						if (i == 0 && !check(stage)) // the first run doubles as warm-up and validation
+							break;
+						if (i > 0)
+							times.push_back(GetStageTime(events));
+					}
+				}
+				catch (const cl::Error& err) {
+					// Launch configurations this device cannot run are simply not candidates
+					cout << "[Tune] " << GetStageName(stage) << " " << variant->name << " " << FormatVariantParams(params) << " failed: " << getErrorString(err.err()) << endl;
+					continue;
+				}
+				if (times.empty()) {
+					cout << "[Tune] " << GetStageName(stage) << " " << variant->name << " " << FormatVariantParams(params) << " gave an incorrect result" << endl;
+					continue;
+				}
+
+				sort(times.begin(), times.end());
+				double median = (double)times[times.size() / 2];
+				cout << "[Tune] " << GetStageName(stage) << " " << variant->name << " " << FormatVariantParams(params) << " median [ns]: " << median << endl;
+				if (best == 0.0 || median < best) {
+					best = median;
+					config[stage] = { variant->name, params };
+				}
+			}
+		}
+	}
+
+	return config;
+}